@@ -6,6 +6,10 @@ import pandas as pd
 import numpy as np
 import sys
 
+def column(data, rep, i):
+    # absent from results predating the column
+    return data[rep,i] if data.shape[1] > i else np.nan
+
 def main():
     results = list()
     for root, dirs, files in os.walk('results/'):
@@ -23,7 +27,10 @@ def main():
                         'estimate' : data[rep,1],
                         'bitsize' : data[rep,2],
                         'compressCount' : data[rep,3],
-                        'rebaseCount' : data[rep,4]
+                        'rebaseCount' : data[rep,4],
+                        'dictionaryBits' : column(data, rep, 5),
+                        'peakResidentBits' : column(data, rep, 6),
+                        'scanCount' : column(data, rep, 7)
                     }}
                     results.append(result)
     pd.DataFrame(results).to_csv(sys.stdout,index = False)
@@ -5,6 +5,7 @@
 #include <cpc_sketch.hpp>
 #include <cpc_union.hpp> // needed for merging
 #include <iostream>
+#include <fstream>
 #include <cstdint>
 #include <chrono>
 
@@ -35,6 +36,11 @@ using std::chrono::nanoseconds;
 using std::chrono::steady_clock;
 using std::cin;
 using hyperlogloglog::readData;
+using hyperlogloglog::MappedFile;
+using hyperlogloglog::NetworkUint64;
+using hyperlogloglog::InputHeader;
+using hyperlogloglog::readInputHeader;
+using hyperlogloglog::parseDatatype;
 
 
 template<typename T>
@@ -110,6 +116,63 @@ void adds(SketchType& S, ConstIterator begin,
 
 
 
+/**
+ * Records taken directly from a memory-mapped input file: uint64
+ * values are byte-swapped as they are added unless they are in native
+ * byte order, and strings are added from the mapping without being
+ * copied
+ */
+template<typename DataType>
+struct MappedRecords {
+  const char* data;
+  size_t n;
+  size_t len;
+  bool native; // the integers are in native byte order
+};
+
+template<typename SketchType>
+void adds(SketchType& S, const MappedRecords<uint64_t>& records,
+          size_t i0, size_t i1) {
+  if (records.native) {
+    const uint64_t* data = reinterpret_cast<const uint64_t*>(records.data);
+    for (size_t i = i0; i < i1; ++i)
+      S.update(data[i]);
+    return;
+  }
+  const NetworkUint64* data = reinterpret_cast<const NetworkUint64*>(records.data);
+  for (size_t i = i0; i < i1; ++i)
+    S.update(data[i].value());
+}
+
+template<typename SketchType>
+void adds(SketchType& S, const MappedRecords<string>& records,
+          size_t i0, size_t i1) {
+  for (size_t i = i0; i < i1; ++i)
+    S.update(records.data + i*records.len, records.len);
+}
+
+template<typename DataType, typename SketchType>
+void adds(SketchType& S, const MappedRecords<DataType>& records) {
+  adds(S, records, 0, records.n);
+}
+
+template<typename DataType, typename SketchType>
+void adds(SketchType& S, const vector<DataType>& data, size_t i0, size_t i1) {
+  adds(S, data.cbegin() + i0, data.cbegin() + i1);
+}
+
+template<typename DataType>
+size_t numRecords(const vector<DataType>& data) {
+  return data.size();
+}
+
+template<typename DataType>
+size_t numRecords(const MappedRecords<DataType>& records) {
+  return records.n;
+}
+
+
+
 template<typename T>
 void report(double seconds, T& S) {
   double estimate = S.get_estimate();
@@ -125,8 +188,8 @@ void report(double seconds, T& S) {
 }
 
 
-template<typename DataType, typename SketchType> 
-static void measureQuery(const vector<DataType>& data,
+template<typename Records, typename SketchType> 
+static void measureQuery(const Records& data,
                          int logM,
                          target_hll_type hllType) {
   unique_ptr<SketchType> S = constructSketch<SketchType>(logM,
@@ -170,17 +233,18 @@ cpc_sketch merge(const cpc_sketch& S1,
 
 
 
-template<typename DataType, typename SketchType> 
-static void measureMerge(const vector<DataType>& data,
+template<typename Records, typename SketchType> 
+static void measureMerge(const Records& data,
                          int logM,
                          target_hll_type hllType) {
-  size_t n1 = data.size() / 2;
+  size_t n = numRecords(data);
+  size_t n1 = n / 2;
   unique_ptr<SketchType> S1 = constructSketch<SketchType>(logM,
                                                           hllType);
   unique_ptr<SketchType> S2 = constructSketch<SketchType>(logM,
                                                           hllType);
-  adds(*S1, data.cbegin(), data.cbegin() + n1);
-  adds(*S2, data.cbegin() + n1, data.cend());
+  adds(*S1, data, 0, n1);
+  adds(*S2, data, n1, n);
   auto start = steady_clock::now();
   auto S = merge(*S1, *S2, logM);
   auto end = steady_clock::now();
@@ -191,30 +255,62 @@ static void measureMerge(const vector<DataType>& data,
 
 
 
-template<typename DataType, typename SketchType> 
+template<typename Records, typename SketchType> 
 static void measure(const string& mode,
-                    const vector<DataType>& data,
+                    const Records& data,
                     int logM,
                     target_hll_type hllType) {
   if (mode == "query")
-    measureQuery<DataType,SketchType>(data, logM, hllType);
+    measureQuery<Records,SketchType>(data, logM, hllType);
   else if (mode == "merge")
-    measureMerge<DataType,SketchType>(data, logM, hllType);
+    measureMerge<Records,SketchType>(data, logM, hllType);
 }
 
 
 
-template<typename DataType> 
+template<typename Records> 
 static void measure(const string& mode,
                     const string& algo,
                     int logM,
                     target_hll_type hllType,
-                    size_t n, size_t len) {
-  vector<DataType> data = readData<DataType>(n, len);
+                    const Records& data) {
   if (algo == "hll")
-    measure<DataType,hll_sketch>(mode, data, logM, hllType);
+    measure<Records,hll_sketch>(mode, data, logM, hllType);
   else if (algo == "cpc")
-    measure<DataType,cpc_sketch>(mode, data, logM, hllType);
+    measure<Records,cpc_sketch>(mode, data, logM, hllType);
+}
+
+
+
+template<typename DataType> 
+static void measure(const string& mode,
+                    const string& algo,
+                    int logM,
+                    target_hll_type hllType,
+                    size_t n, size_t len, bool bigEndian) {
+  vector<DataType> data = readData<DataType>(n, len, bigEndian);
+  measure(mode, algo, logM, hllType, data);
+}
+
+
+
+template<typename DataType> 
+static void measureMapped(const string& mode,
+                          const string& algo,
+                          int logM,
+                          target_hll_type hllType,
+                          const MappedFile& file,
+                          size_t n, size_t len,
+                          bool bigEndian, size_t offset) {
+  size_t recordSize = std::is_same<DataType,uint64_t>::value ?
+    sizeof(uint64_t) : len;
+  size_t available = (file.size() - std::min(file.size(), offset)) / recordSize;
+  if (available < n)
+    throw std::runtime_error("Truncated input: " + std::to_string(available) +
+                             " of " + std::to_string(n) + " records");
+  bool native = bigEndian == (InputHeader::native() == InputHeader::BIG);
+  MappedRecords<DataType> records { file.data() + offset, n, len, native };
+  measure(mode, algo, logM, hllType, records);
 }
 
 
@@ -225,11 +321,24 @@ static void measure(const string& mode,
                     int logM,
                     target_hll_type hllType,
                     size_t n,
-                    size_t len) {
+                    size_t len,
+                    const string& input,
+                    bool bigEndian,
+                    size_t offset) {
+  if (!input.empty()) {
+    MappedFile file(input);
+    if (dt == "uint64")
+      measureMapped<uint64_t>(mode, algo, logM, hllType, file, n, len,
+                              bigEndian, offset);
+    else if (dt == "str")
+      measureMapped<string>(mode, algo, logM, hllType, file, n, len,
+                            bigEndian, offset);
+    return;
+  }
   if (dt == "uint64")
-    measure<uint64_t>(mode, algo, logM, hllType, n, len);
+    measure<uint64_t>(mode, algo, logM, hllType, n, len, bigEndian);
   else if (dt == "str")
-    measure<string>(mode, algo, logM, hllType, n, len);
+    measure<string>(mode, algo, logM, hllType, n, len, bigEndian);
 }
 
 
@@ -262,6 +371,14 @@ int main(int argc, char* argv[]) {
                             "number of bits per register for hll",
                             false, 8, &hllBitValuesConstraint, cmd);
     ValueArg<size_t> lenArg("", "len", "length of strings to read", false, 0, "int", cmd);
+    vector<string> formatValues { "raw", "binary" };
+    ValuesConstraint<string> formatValuesConstraint(formatValues);
+    ValueArg<string> formatArg("", "format", "input format: raw big-endian "
+                               "records or a binary container with a header",
+                               false, "raw", &formatValuesConstraint, cmd);
+    ValueArg<string> inputArg("", "input", "read the values from this file "
+                              "(memory-mapped) instead of stdin",
+                              false, "", "file", cmd);
     cmd.parse(argc, argv);
     
     if (helpSwitch.getValue()) {
@@ -305,7 +422,10 @@ int main(int argc, char* argv[]) {
       return EXIT_FAILURE;
     }
 
-    if (dt == "str" && !lenArg.isSet()) {
+    string format = formatArg.getValue();
+    string input = inputArg.getValue();
+
+    if (dt == "str" && !lenArg.isSet() && format == "raw") {
       cerr << "len must be set if datatype is string" << endl;
       return EXIT_FAILURE;
     }
@@ -313,14 +433,52 @@ int main(int argc, char* argv[]) {
       cerr << "len must not be set if datatype is not string" << endl;
       return EXIT_FAILURE;
     }
+    if (dt == "str" && lenArg.isSet() && len == 0) {
+      cerr << "len must be positive if datatype is string" << endl;
+      return EXIT_FAILURE;
+    }
+
+    bool bigEndian = true;
+    size_t offset = 0;
+    if (format == "binary") {
+      InputHeader header;
+      if (input.empty()) {
+        header = readInputHeader(cin);
+      }
+      else {
+        std::ifstream is(input, std::ios::binary);
+        if (!is)
+          throw std::runtime_error(input + ": cannot open");
+        header = readInputHeader(is);
+      }
+      if (header.datatype != parseDatatype(dt)) {
+        cerr << "the datatype of the input does not match!" << endl;
+        return EXIT_FAILURE;
+      }
+      if (lenArg.isSet() && len != header.len) {
+        cerr << "len does not match the string length of the input!" << endl;
+        return EXIT_FAILURE;
+      }
+      if (n > header.count) {
+        cerr << "the input has only " << header.count << " values!" << endl;
+        return EXIT_FAILURE;
+      }
+      len = header.len;
+      bigEndian = header.endianness == InputHeader::BIG;
+      offset = sizeof(InputHeader);
+    }
 
-    measure(mode, algo, dt, logM, hllType, n, len);
+    measure(mode, algo, dt, logM, hllType, n, len, input, bigEndian, offset);
   }
   catch (TCLAP::ArgException &e) {
     cerr << "error: " << e.error() << " for arg " << e.argId()
          << endl;
     return EXIT_FAILURE;
   }
+  catch (std::runtime_error& e) {
+    cerr << "error: " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
 
   return EXIT_SUCCESS;
 }
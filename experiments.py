@@ -18,7 +18,11 @@ NS = [(1 << i//2) if i%2 == 0 else int(round(math.sqrt(2)*(1 << i//2))) \
 MS = [1 << i for i in range(4,19)]
 NUM_REPS = 10
 DATATYPES = ['uint64', 'str', 'jr']
-ALGORITHMS = ['hyperloglog', 'hyperloglogzstd', 'hyperlogloglog',
+ALGORITHMS = ['hyperloglog',
+                  'hyperloglogzstd', # recompressed after every update
+                  'hyperloglogzstdl', # recompressed lazily, only at the end
+                  'hyperloglogzstdd', # with a dictionary of 8 sample sketches
+                  'hyperlogloglog',
                   'hyperloglogloga', # append only
                   'hyperlogloglogi', # increase only
                   'hyperlogloglogai', # append and increase only
@@ -116,6 +120,10 @@ def construct_docker_command(instance, seed):
             cmd += '--flags appendincreaseonly '
         elif algo == 'hyperlogloglogb':
             cmd += '--flags bottom '
+        elif algo == 'hyperloglogzstd':
+            cmd += '--flush 1 '
+        elif algo == 'hyperloglogzstdd':
+            cmd += '--flush 1 --dictionary 8 '
     if algo.startswith('apache-'):
         cmd += 'datasketches/measure '
         if algo == 'apache-hll4':
@@ -133,6 +141,8 @@ def construct_docker_command(instance, seed):
         cmd += f'{algo} '
     elif algo.startswith('hyperlogloglog'):
         cmd += 'hyperlogloglog '
+    elif algo.startswith('hyperloglogzstd'):
+        cmd += 'hyperloglogzstd '
     elif algo.startswith('apache-hll'):
         cmd += 'hll '
     elif algo == 'apache-cpc':
@@ -195,7 +205,7 @@ def run(instance, container_name, cpu, max_memory):
     stderrf.close()
     stdoutf.close()
 
-    df = pd.DataFrame(results, columns = ['time', 'estimate', 'bitsize', 'compressCount', 'rebaseCount'] )
+    df = pd.DataFrame(results, columns = ['time', 'estimate', 'bitsize', 'compressCount', 'rebaseCount', 'dictionaryBits', 'peakResidentBits', 'scanCount'] )
     with h5py.File(hdf5_filename, 'w') as f:
         f.create_dataset('measurements', data=df.to_numpy())
         f.attrs['mode'] = mode
@@ -0,0 +1,222 @@
+#ifndef HYPERLOGLOGLOG_BIT_PACKING
+#define HYPERLOGLOGLOG_BIT_PACKING
+
+#include <cstdint>
+#include <cstddef>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HYPERLOGLOGLOG_HAVE_AVX2_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace hyperlogloglog {
+  /**
+   * Vectorized kernels for converting between packed arrays of k-bit
+   * elements (k = 3, 4, 5, 6) and arrays of bytes holding one element
+   * each. The packed layout is the one used by PackedVector on a
+   * little-endian machine: element i occupies bits [i*k, (i+1)*k) of
+   * the byte stream, least significant bit first.
+   *
+   * The kernels are compiled for AVX2 with function-level target
+   * attributes and selected at runtime with CPUID, so the code does
+   * not depend on -march. Each kernel processes a prefix of the input
+   * in chunks of 32 elements and returns the number of elements
+   * processed; the caller handles the rest with scalar code.
+   */
+  namespace bitpacking {
+    /**
+     * Returns true if the vectorized kernels can be used on this CPU
+     */
+    inline bool haveKernels() {
+#ifdef HYPERLOGLOGLOG_HAVE_AVX2_KERNELS
+      static const bool avx2 = []() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+      }();
+      return avx2;
+#else
+      return false;
+#endif
+    }
+
+
+
+    /**
+     * Returns true if there is a vectorized kernel for width k
+     */
+    inline bool haveKernel(size_t k) {
+      return 3 <= k && k <= 6 && haveKernels();
+    }
+
+
+
+#ifdef HYPERLOGLOGLOG_HAVE_AVX2_KERNELS
+    /**
+     * Shuffle and multiplier constants for unpacking 8 elements of K
+     * bits (K bytes) per 128-bit lane into 16-bit lanes: element i is
+     * read as a 16-bit window starting at byte i*K/8, moved to the top
+     * of the lane by a multiplication, and then shifted down.
+     */
+    template<size_t K>
+    struct UnpackConstants {
+      alignas(32) uint8_t shuffle[32];
+      alignas(32) uint16_t multiplier[16];
+      constexpr UnpackConstants() : shuffle(), multiplier() {
+        for (size_t i = 0; i < 16; ++i) {
+          size_t bit = (i % 8) * K;
+          shuffle[2*i] = bit / 8;
+          shuffle[2*i+1] = bit / 8 + 1;
+          multiplier[i] = 1u << (16 - K - bit % 8);
+        }
+      }
+    };
+
+
+
+    /**
+     * Shuffle constants for compacting the K low bytes of both 64-bit
+     * halves of a 128-bit lane into its 2K low bytes.
+     */
+    template<size_t K>
+    struct PackConstants {
+      alignas(32) uint8_t shuffle[32];
+      constexpr PackConstants() : shuffle() {
+        for (size_t i = 0; i < 32; ++i) {
+          size_t j = i % 16;
+          shuffle[i] = j < K ? j : j < 2*K ? j - K + 8 : 0x80;
+        }
+      }
+    };
+
+
+
+    template<size_t K>
+    __attribute__((target("avx2")))
+    inline __m256i unpack16(const uint8_t* in) {
+      static constexpr UnpackConstants<K> c;
+      __m256i v = _mm256_inserti128_si256
+        (_mm256_castsi128_si256
+         (_mm_loadu_si128(reinterpret_cast<const __m128i*>(in))),
+         _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + K)), 1);
+      v = _mm256_shuffle_epi8
+        (v, _mm256_load_si256(reinterpret_cast<const __m256i*>(c.shuffle)));
+      v = _mm256_mullo_epi16
+        (v, _mm256_load_si256(reinterpret_cast<const __m256i*>(c.multiplier)));
+      return _mm256_srli_epi16(v, 16 - K);
+    }
+
+
+
+    template<size_t K>
+    __attribute__((target("avx2")))
+    size_t unpackAvx2(const uint8_t* in, size_t inBytes,
+                      uint8_t* out, size_t count) {
+      size_t done = 0;
+      size_t p = 0;
+      while (done + 32 <= count && p + 3*K + 16 <= inBytes) {
+        __m256i a = unpack16<K>(in + p);
+        __m256i b = unpack16<K>(in + p + 2*K);
+        __m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + done), v);
+        done += 32;
+        p += 4*K;
+      }
+      return done;
+    }
+
+
+
+    template<size_t K>
+    __attribute__((target("avx2")))
+    size_t packAvx2(const uint8_t* in, size_t count,
+                    uint8_t* out, size_t outBytes) {
+      static constexpr PackConstants<K> c;
+      const __m256i mask = _mm256_set1_epi8((1 << K) - 1);
+      const __m256i pairs = _mm256_set1_epi16(1 | (1 << (K + 8)));
+      const __m256i quads = _mm256_set1_epi32(1 | (1 << (2*K + 16)));
+      const __m256i low = _mm256_set1_epi64x(0xffffffff);
+      const __m256i shuffle =
+        _mm256_load_si256(reinterpret_cast<const __m256i*>(c.shuffle));
+      size_t done = 0;
+      size_t p = 0;
+      while (done + 32 <= count && p + 2*K + 16 <= outBytes) {
+        __m256i v = _mm256_and_si256
+          (_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + done)),
+           mask);
+        v = _mm256_maddubs_epi16(v, pairs); // 2 elements per 16 bits
+        v = _mm256_madd_epi16(v, quads); // 4 elements per 32 bits
+        v = _mm256_or_si256(_mm256_and_si256(v, low),
+                            _mm256_slli_epi64(_mm256_srli_epi64(v, 32), 4*K));
+        v = _mm256_shuffle_epi8(v, shuffle);
+        // the stores overlap; the second one overwrites the zero
+        // padding left by the first one
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + p),
+                         _mm256_castsi256_si128(v));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + p + 2*K),
+                         _mm256_extracti128_si256(v, 1));
+        done += 32;
+        p += 4*K;
+      }
+      return done;
+    }
+#endif // HYPERLOGLOGLOG_HAVE_AVX2_KERNELS
+
+
+
+    /**
+     * Unpacks a prefix of count k-bit elements from the byte-aligned
+     * packed stream in (of which inBytes bytes may be read) into out.
+     * Returns the number of elements unpacked.
+     */
+    inline size_t unpack(size_t k, const uint8_t* in, size_t inBytes,
+                         uint8_t* out, size_t count) {
+#ifdef HYPERLOGLOGLOG_HAVE_AVX2_KERNELS
+      if (haveKernels()) {
+        switch (k) {
+        case 3:
+          return unpackAvx2<3>(in, inBytes, out, count);
+        case 4:
+          return unpackAvx2<4>(in, inBytes, out, count);
+        case 5:
+          return unpackAvx2<5>(in, inBytes, out, count);
+        case 6:
+          return unpackAvx2<6>(in, inBytes, out, count);
+        }
+      }
+#else
+      (void)k; (void)in; (void)inBytes; (void)out; (void)count;
+#endif
+      return 0;
+    }
+
+
+
+    /**
+     * Packs a prefix of the count elements of in into the byte-aligned
+     * k-bit stream out. No byte at or beyond out + outBytes is written.
+     * Returns the number of elements packed.
+     */
+    inline size_t pack(size_t k, const uint8_t* in, size_t count,
+                       uint8_t* out, size_t outBytes) {
+#ifdef HYPERLOGLOGLOG_HAVE_AVX2_KERNELS
+      if (haveKernels()) {
+        switch (k) {
+        case 3:
+          return packAvx2<3>(in, count, out, outBytes);
+        case 4:
+          return packAvx2<4>(in, count, out, outBytes);
+        case 5:
+          return packAvx2<5>(in, count, out, outBytes);
+        case 6:
+          return packAvx2<6>(in, count, out, outBytes);
+        }
+      }
+#else
+      (void)k; (void)in; (void)count; (void)out; (void)outBytes;
+#endif
+      return 0;
+    }
+  }
+}
+
+#endif // HYPERLOGLOGLOG_BIT_PACKING
@@ -0,0 +1,292 @@
+#ifndef HYPERLOGLOGLOG_CONCURRENT_HYPERLOGLOG
+#define HYPERLOGLOGLOG_CONCURRENT_HYPERLOGLOG
+
+#include "HyperLogLog.hpp"
+#include "HyperLogLogLog.hpp"
+#include <atomic>
+#include <memory>
+
+namespace hyperlogloglog {
+  /**
+   * HyperLogLog that can be updated by many threads at once without
+   * locks. A register is raised with a compare-and-swap loop on the
+   * cell that contains it, which only retries while the register is
+   * still smaller than the new value, so an update whose value does
+   * not exceed the register is a single load.
+   *
+   * Packed selects the layout: false stores a register per byte,
+   * true packs ten 6-bit registers into each 64-bit word (no register
+   * straddles two words, so a single CAS covers it). The packed
+   * layout is 20% smaller, but the threads contend on words shared by
+   * ten registers.
+   */
+  template<typename Word = uint64_t, bool Packed = false>
+  class ConcurrentHyperLogLog {
+  public:
+    typedef typename std::conditional<Packed, uint64_t, uint8_t>::type Cell;
+    static constexpr int REGISTER_BITS = Packed ? 6 : 8;
+    static constexpr int REGISTERS_PER_CELL = sizeof(Cell)*CHAR_BIT / REGISTER_BITS;
+
+    /**
+     * Basic constructor
+     * m : the number of registers
+     */
+    explicit ConcurrentHyperLogLog(int m) :
+      m(m), logM(log2i(m)), numCells((m + REGISTERS_PER_CELL - 1) /
+                                     REGISTERS_PER_CELL),
+      cells(new std::atomic<Cell>[numCells]) {
+      for (int i = 0; i < numCells; ++i)
+        cells[i].store(0, std::memory_order_relaxed);
+    }
+
+
+
+    /**
+     * Returns the size of the sketch (the number of bits)
+     */
+    inline size_t bitSize() const {
+      return static_cast<size_t>(numCells) * sizeof(Cell) * CHAR_BIT;
+    }
+
+
+
+    /**
+     * Adds a new element to the sketch. Safe to call concurrently with
+     * any other member function.
+     */
+    template<typename Object,
+             typename XHashFun = decltype(farmhash<Object>),
+             typename JHashFun = decltype(fibonacciHash<Word>),
+             typename = std::enable_if_t<std::is_invocable_v<XHashFun, const Object&>>>
+    inline void add(const Object& o, XHashFun h = farmhash<Object>,
+                    JHashFun f = fibonacciHash<Word>) {
+      static_assert(std::is_same<decltype(h(o)),Word>::value,
+                    "Hash function type does not match the Word type of the class");
+      addHash(h(o), f);
+    }
+
+
+
+    /**
+     * Adds the len bytes at data to the sketch without copying them.
+     * Equivalent to adding std::string(data, len).
+     */
+    inline void add(const char* data, size_t len) {
+      add(std::string_view(data, len));
+    }
+
+
+
+    /**
+     * Adds a new hash to the sketch. Potentially useful if a
+     * different kind of hashing scheme is used outside the class.
+     */
+    template<typename JHashFun = decltype(fibonacciHash<Word>)>
+    inline void addHash(Word x, JHashFun f = fibonacciHash<Word>) {
+      static_assert(std::is_same<decltype(f(x,logM)),Word>::value,
+                    "Hash function type does not match the Word type of the class");
+      addJr(f(x,logM), rho(x));
+    }
+
+
+
+    /**
+     * Raises register j to r unless it is already at least r.
+     * j must satisfy 0 <= j < m but no checks are made
+     * r must satisfy 0 <= r < log(word length) (64 for uint64_t) but no checks are made
+     */
+    inline void addJr(Word j, Word r) {
+      // rho of the hashes 0 and 1 exceeds the register range; saturate it
+      r = std::min(r, VALUE_MASK);
+      std::atomic<Cell>& cell = cells[j / REGISTERS_PER_CELL];
+      int shift = j % REGISTERS_PER_CELL * REGISTER_BITS;
+      Cell mask = static_cast<Cell>(REGISTER_MASK) << shift;
+      Cell old = cell.load(std::memory_order_relaxed);
+      // on failure, old is reloaded and the register compared again
+      while (static_cast<Word>((old & mask) >> shift) < r) {
+        Cell updated = (old & ~mask) | (static_cast<Cell>(r) << shift);
+        if (cell.compare_exchange_weak(old, updated, std::memory_order_relaxed))
+          return;
+      }
+    }
+
+
+
+    /**
+     * Adds the n objects of the array to the sketch. The objects are
+     * hashed a batch at a time before the registers are updated.
+     */
+    template<typename Object,
+             typename XHashFun = decltype(farmhash<Object>),
+             typename JHashFun = decltype(fibonacciHash<Word>)>
+    void addBatch(const Object* objects, size_t n,
+                  XHashFun h = farmhash<Object>,
+                  JHashFun f = fibonacciHash<Word>) {
+      forEachHashBatch<Word>(h, objects, n, [&](const Word* hashes, size_t k) {
+        addHashes(hashes, k, f);
+      });
+    }
+
+
+
+    /**
+     * Adds the n hashes of the array to the sketch
+     */
+    template<typename JHashFun = decltype(fibonacciHash<Word>)>
+    void addHashes(const Word* hashes, size_t n,
+                   JHashFun f = fibonacciHash<Word>) {
+      for (size_t i = 0; i < n; ++i)
+        addHash(hashes[i], f);
+    }
+
+
+
+    /**
+     * Returns register j
+     */
+    inline uint8_t get(Word j) const {
+      Cell c = cells[j / REGISTERS_PER_CELL].load(std::memory_order_relaxed);
+      return (c >> (j % REGISTERS_PER_CELL * REGISTER_BITS)) & REGISTER_MASK;
+    }
+
+
+
+    /**
+     * Returns a vector that contains the register values
+     */
+    std::vector<uint8_t> exportRegisters() const {
+      std::vector<uint8_t> v(m);
+      for (int j = 0; j < m; ++j)
+        v[j] = get(j);
+      return v;
+    }
+
+
+
+    /**
+     * Returns the present estimate. Wait-free: the registers are read
+     * once each without blocking the writers. As registers only grow,
+     * the snapshot reflects every update that completed before the
+     * call, and possibly some of those running concurrently with it.
+     */
+    double estimate() const {
+      RegisterHistogram<Word> h;
+      for (int j = 0; j < m; ++j)
+        h.increment(get(j));
+      return HyperLogLog<Word>::estimate(m, h);
+    }
+
+
+
+    /**
+     * Merges this sketch with the other sketch and returns a new sketch
+     *
+     * Note: if the sketches were constructed with different hash
+     * functions, the result will be nonsensical. It is up to the
+     * caller to ensure that the exact same hash functions were used.
+     */
+    ConcurrentHyperLogLog merge(const ConcurrentHyperLogLog& that) const {
+      if (m != that.m)
+        throw std::invalid_argument("Mismatch in the number of registers");
+      ConcurrentHyperLogLog H(m);
+      H.mergeInto(*this);
+      H.mergeInto(that);
+      return H;
+    }
+
+
+
+    /**
+     * Merges the other sketch into this one in place. Safe to call
+     * while other threads update either sketch.
+     */
+    void mergeInto(const ConcurrentHyperLogLog& that) {
+      if (m != that.m)
+        throw std::invalid_argument("Mismatch in the number of registers");
+      for (int j = 0; j < m; ++j)
+        addJr(j, that.get(j));
+    }
+
+
+
+    /**
+     * Same as mergeInto
+     */
+    ConcurrentHyperLogLog& operator|=(const ConcurrentHyperLogLog& that) {
+      mergeInto(that);
+      return *this;
+    }
+
+
+
+    /**
+     * Converts the sketch into a vanilla HyperLogLog sketch
+     */
+    HyperLogLog<Word> toHyperLogLog() const {
+      return HyperLogLog<Word>(exportRegisters());
+    }
+
+
+
+    /**
+     * Converts a vanilla HyperLogLog sketch into a concurrent one
+     */
+    static ConcurrentHyperLogLog fromHyperLogLog(const HyperLogLog<Word>& hll) {
+      return fromRegisters(hll.exportRegisters());
+    }
+
+
+
+    /**
+     * Converts the sketch into a HyperLogLogLog sketch (see the
+     * HyperLogLogLog constructor for the parameters)
+     */
+    template<size_t MBits = 0>
+    HyperLogLogLog<Word, MBits>
+    toHyperLogLogLog(int mBits = MBits > 0 ? MBits : 3,
+                     int flags = HyperLogLogLog<Word, MBits>::
+                     HYPERLOGLOGLOG_COMPRESS_DEFAULT) const {
+      return HyperLogLogLog<Word, MBits>::fromHyperLogLog(toHyperLogLog(),
+                                                          mBits, flags);
+    }
+
+
+
+    /**
+     * Converts a HyperLogLogLog sketch into a concurrent one
+     */
+    template<size_t MBits>
+    static ConcurrentHyperLogLog
+    fromHyperLogLogLog(const HyperLogLogLog<Word, MBits>& hlll) {
+      return fromRegisters(hlll.exportRegisters());
+    }
+
+
+
+    /**
+     * Returns the number of registers
+     */
+    inline int getM() const {
+      return m;
+    }
+
+  private:
+    static constexpr unsigned REGISTER_MASK = (1u << REGISTER_BITS) - 1;
+    static constexpr Word VALUE_MASK = sizeof(Word)*CHAR_BIT - 1;
+    static_assert(VALUE_MASK <= REGISTER_MASK);
+
+    static ConcurrentHyperLogLog fromRegisters(const std::vector<uint8_t>& registers) {
+      ConcurrentHyperLogLog H(registers.size());
+      for (int j = 0; j < H.m; ++j)
+        H.addJr(j, registers[j]);
+      return H;
+    }
+
+    int m;
+    int logM; // register address length
+    int numCells;
+    std::unique_ptr<std::atomic<Cell>[]> cells;
+  };
+}
+
+#endif // HYPERLOGLOGLOG_CONCURRENT_HYPERLOGLOG
@@ -1,10 +1,21 @@
 #ifndef HYPERLOGLOGLOG_HASH
 #define HYPERLOGLOGLOG_HASH
 
+#include "common.hpp"
 #include <farmhash/farmhash.h>
+#include <zstd/common/xxhash.h>
+#include <algorithm>
 #include <climits>
 #include <cstdint>
+#include <cstddef>
 #include <string>
+#include <string_view>
+#include <type_traits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HYPERLOGLOGLOG_HAVE_SIMD_FINGERPRINT
+#include <immintrin.h>
+#endif
 
 namespace hyperlogloglog {
   template<typename T, typename Word = uint64_t>
@@ -24,10 +35,228 @@ namespace hyperlogloglog {
     return farmhash::Hash64(x);
   }
 
+  template<>
+  inline uint64_t farmhash(const std::string_view& x) {
+    return farmhash::Hash64(x.data(), x.size());
+  }
+
   template<>
   inline uint64_t farmhash(const uint64_t& x) {
     return farmhash::Fingerprint(x);
   }
+
+
+
+  /**
+   * XXH64 from the xxHash copy vendored with zstd (which is built
+   * without XXH3). Can be passed as the hash function to add().
+   * The programs link xxhash.c compiled from external/zstd/common,
+   * as libzstd does not export the symbols.
+   */
+  template<typename T, typename Word = uint64_t>
+  Word xxh64(const T& x);
+
+  template<>
+  inline uint64_t xxh64(const std::string& x) {
+    return XXH64(x.data(), x.size(), 0);
+  }
+
+  template<>
+  inline uint64_t xxh64(const std::string_view& x) {
+    return XXH64(x.data(), x.size(), 0);
+  }
+
+  template<>
+  inline uint64_t xxh64(const uint64_t& x) {
+    return XXH64(&x, sizeof(x), 0);
+  }
+
+
+
+  /**
+   * Vectorized versions of farmhash::Fingerprint(uint64_t) that hash
+   * 4 (AVX2) or 8 (AVX-512) keys at a time. The kernels are selected
+   * at runtime with CPUID and produce bit-identical output to the
+   * scalar function. Each kernel processes a prefix of the input and
+   * returns its length; the caller hashes the rest with scalar code.
+   */
+  namespace fingerprint {
+    static const uint64_t K_MUL = 0x9ddfea08eb382d69ULL;
+
+    /**
+     * Hashes the keys one at a time
+     */
+    inline void scalar(const uint64_t* in, size_t n, uint64_t* out) {
+      for (size_t i = 0; i < n; ++i)
+        out[i] = farmhash::Fingerprint(in[i]);
+    }
+
+
+
+#ifdef HYPERLOGLOGLOG_HAVE_SIMD_FINGERPRINT
+    inline bool haveAvx2() {
+      static const bool avx2 = []() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+      }();
+      return avx2;
+    }
+
+
+
+    inline bool haveAvx512() {
+      static const bool avx512 = []() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512f") != 0 &&
+          __builtin_cpu_supports("avx512dq") != 0;
+      }();
+      return avx512;
+    }
+
+
+
+    /**
+     * Multiplies the 64-bit lanes by K_MUL using 32-bit multiplies
+     * (AVX2 has no 64-bit multiply)
+     */
+    __attribute__((target("avx2")))
+    inline __m256i mulAvx2(__m256i a) {
+      const __m256i kLow = _mm256_set1_epi64x(K_MUL & 0xffffffff);
+      const __m256i kHigh = _mm256_set1_epi64x(K_MUL >> 32);
+      __m256i low = _mm256_mul_epu32(a, kLow);
+      __m256i cross = _mm256_add_epi64
+        (_mm256_mul_epu32(_mm256_srli_epi64(a, 32), kLow),
+         _mm256_mul_epu32(a, kHigh));
+      return _mm256_add_epi64(low, _mm256_slli_epi64(cross, 32));
+    }
+
+
+
+    __attribute__((target("avx2")))
+    inline size_t avx2(const uint64_t* in, size_t n, uint64_t* out) {
+      size_t i = 0;
+      for (; i + 4 <= n; i += 4) {
+        __m256i b = mulAvx2
+          (_mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i)));
+        b = _mm256_xor_si256(b, _mm256_srli_epi64(b, 44));
+        b = mulAvx2(b);
+        b = _mm256_xor_si256(b, _mm256_srli_epi64(b, 41));
+        b = mulAvx2(b);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), b);
+      }
+      return i;
+    }
+
+
+
+    __attribute__((target("avx512f,avx512dq")))
+    inline size_t avx512(const uint64_t* in, size_t n, uint64_t* out) {
+      const __m512i k = _mm512_set1_epi64(K_MUL);
+      // the shifts are masked only because the unmasked intrinsic
+      // triggers a spurious -Wmaybe-uninitialized in some GCC versions
+      size_t i = 0;
+      for (; i + 8 <= n; i += 8) {
+        __m512i b = _mm512_mullo_epi64(_mm512_loadu_si512(in + i), k);
+        b = _mm512_xor_si512(b, _mm512_maskz_srli_epi64(0xff, b, 44));
+        b = _mm512_mullo_epi64(b, k);
+        b = _mm512_xor_si512(b, _mm512_maskz_srli_epi64(0xff, b, 41));
+        b = _mm512_mullo_epi64(b, k);
+        _mm512_storeu_si512(out + i, b);
+      }
+      return i;
+    }
+#endif // HYPERLOGLOGLOG_HAVE_SIMD_FINGERPRINT
+  }
+
+
+
+  /**
+   * Computes out[i] = farmhash(in[i]) for the n keys, using the
+   * widest vector instructions available
+   */
+  inline void farmhashBatch(const uint64_t* in, size_t n, uint64_t* out) {
+    size_t done = 0;
+#ifdef HYPERLOGLOGLOG_HAVE_SIMD_FINGERPRINT
+    if (fingerprint::haveAvx512())
+      done = fingerprint::avx512(in, n, out);
+    else if (fingerprint::haveAvx2())
+      done = fingerprint::avx2(in, n, out);
+#endif
+    fingerprint::scalar(in + done, n - done, out + done);
+  }
+
+
+
+  /**
+   * Computes out[i] = h(in[i]) for the n objects. Used by the batch
+   * adds of the sketches.
+   */
+  template<typename T, typename Word, typename XHashFun>
+  inline void hashBatch(XHashFun h, const T* in, size_t n, Word* out) {
+    for (size_t i = 0; i < n; ++i)
+      out[i] = h(in[i]);
+  }
+
+  /**
+   * Overload for hash function pointers on uint64_t keys; the default
+   * hash function, farmhash, is vectorized
+   */
+  inline void hashBatch(uint64_t (*h)(const uint64_t&), const uint64_t* in,
+                        size_t n, uint64_t* out) {
+    if (h == &farmhash<uint64_t>)
+      farmhashBatch(in, n, out);
+    else
+      for (size_t i = 0; i < n; ++i)
+        out[i] = h(in[i]);
+  }
+
+
+
+  /**
+   * Hashes the n objects with h, HASH_BATCH_SIZE at a time, and calls
+   * batch(hashes, k) with each batch of k hashes. This is the hashing
+   * half of the batch adds of the sketches.
+   */
+  template<typename Word, typename Object, typename XHashFun,
+           typename BatchFun>
+  inline void forEachHashBatch(XHashFun h, const Object* objects, size_t n,
+                               BatchFun batch) {
+    static_assert(std::is_same<decltype(h(*objects)),Word>::value,
+                  "Hash function type does not match the Word type of the class");
+    Word hashes[HASH_BATCH_SIZE];
+    for (size_t i0 = 0; i0 < n; i0 += HASH_BATCH_SIZE) {
+      size_t k = std::min<size_t>(HASH_BATCH_SIZE, n - i0);
+      hashBatch(h, objects + i0, k, hashes);
+      batch(static_cast<const Word*>(hashes), k);
+    }
+  }
+
+
+
+  /**
+   * Computes the register indices j = f(x, logM) of the n hashes x a
+   * batch at a time and calls prefetch(j) on all of the batch before
+   * calling update(j, rho(x)) on each, so that the registers of a
+   * batch are loaded in parallel.
+   */
+  template<typename Word, typename JHashFun, typename PrefetchFun,
+           typename UpdateFun>
+  inline void forEachRegisterBatch(const Word* hashes, size_t n, int logM,
+                                   JHashFun f, PrefetchFun prefetch,
+                                   UpdateFun update) {
+    static_assert(std::is_same<decltype(f(*hashes,logM)),Word>::value,
+                  "Hash function type does not match the Word type of the class");
+    Word js[HASH_BATCH_SIZE];
+    for (size_t i0 = 0; i0 < n; i0 += HASH_BATCH_SIZE) {
+      size_t k = std::min<size_t>(HASH_BATCH_SIZE, n - i0);
+      for (size_t i = 0; i < k; ++i) {
+        js[i] = f(hashes[i0 + i], logM);
+        prefetch(js[i]);
+      }
+      for (size_t i = 0; i < k; ++i)
+        update(js[i], static_cast<Word>(rho(hashes[i0 + i])));
+    }
+  }
 }
 
 #endif // HYPERLOGLOGLOG_HASH
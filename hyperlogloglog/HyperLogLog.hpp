@@ -3,25 +3,62 @@
 
 #include "common.hpp"
 #include "PackedVector.hpp"
+#include "PackedMap.hpp"
 #include "Hash.hpp"
+#include "RegisterHistogram.hpp"
+#include <algorithm>
 #include <cstdint>
 #include <cmath>
+#include <type_traits>
 
 namespace hyperlogloglog {
   /**
    * Basic HyperLogLog. The template parameter Word determines the
    * word type and length (that is, the length of the hashes).
+   * RegisterBits fixes the register width at compile time (0 selects
+   * the runtime-width packed vector).
+   *
+   * A sketch constructed as sparse stores only its nonzero registers,
+   * as (j, r) pairs in a packed map, and allocates the dense register
+   * array once the pairs would take as many bits. The conversion is
+   * transparent to all operations. The cached aggregates are only
+   * allocated if the estimate is cached.
    */
-  template<typename Word = uint64_t>
+  template<typename Word = uint64_t,
+           size_t RegisterBits = log2i(sizeof(Word)*CHAR_BIT)>
   class HyperLogLog {
   public:
     /**
      * Basic constructor
      * m : the number of registers
+     * cacheEstimate : if true, the harmonic sum and the number of zero
+     *                 registers are maintained on every update, making
+     *                 estimate() O(1)
+     * sparse : if true, the sketch starts in the sparse representation
      */
-    explicit HyperLogLog(int m) :
+    explicit HyperLogLog(int m, bool cacheEstimate = false,
+                         bool sparse = false) :
       m(m), logW(log2i(sizeof(Word)*CHAR_BIT)),
-      logM(log2i(m)), M(logW,m) {
+      logM(log2i(m)), M(logW, sparse ? 0 : m), S(logM, logW),
+      sparse(sparse), cacheEstimate(cacheEstimate) {
+      if (cacheEstimate)
+        aggregates.emplace(m);
+    }
+
+
+
+    /**
+     * Constructs a sketch with the given register values
+     * registers : the register values (as returned by exportRegisters)
+     * cacheEstimate : as in the basic constructor
+     */
+    explicit HyperLogLog(const std::vector<uint8_t>& registers,
+                         bool cacheEstimate = false) :
+      HyperLogLog(registers.size(), cacheEstimate) {
+      M.pack(registers.data(), 0, m);
+      if (cacheEstimate)
+        for (uint8_t r : registers)
+          aggregates->update(0, r);
     }
 
     
@@ -30,17 +67,40 @@ namespace hyperlogloglog {
      * Returns the size of the sketch (the number of bits)
      */
     inline size_t bitSize() const {
-      return M.bitSize();
+      return M.bitSize() + S.bitSize();
+    }
+
+
+
+    /**
+     * Returns the number of bits allocated for the sketch (including
+     * unused capacity and the cached aggregates)
+     */
+    inline size_t allocatedBits() const {
+      return M.allocatedBits() + S.allocatedBits() +
+        aggregates.allocatedBits();
     }
 
 
 
     /**
-     * Adds a new element to the sketch
+     * Returns true if the sketch is in the sparse representation
+     */
+    inline bool isSparse() const {
+      return sparse;
+    }
+
+
+
+    /**
+     * Adds a new element to the sketch. Only viable when h can hash
+     * the element, so that add(data, len) with any integer length
+     * reaches the raw-bytes overload below.
      */
     template<typename Object,
              typename XHashFun = decltype(farmhash<Object>),
-             typename JHashFun = decltype(fibonacciHash<Word>)>
+             typename JHashFun = decltype(fibonacciHash<Word>),
+             typename = std::enable_if_t<std::is_invocable_v<XHashFun, const Object&>>>
     inline void add(const Object& o, XHashFun h = farmhash<Object>,
                     JHashFun f = fibonacciHash<Word>) {
       static_assert(std::is_same<decltype(h(o)),Word>::value,
@@ -50,6 +110,16 @@ namespace hyperlogloglog {
 
 
 
+    /**
+     * Adds the len bytes at data to the sketch without copying them.
+     * Equivalent to adding std::string(data, len).
+     */
+    inline void add(const char* data, size_t len) {
+      add(std::string_view(data, len));
+    }
+
+
+
     /**
      * Adds a new hash to the sketch. Potentially useful if a
      * different kind of hashing scheme is used outside the class.
@@ -70,20 +140,64 @@ namespace hyperlogloglog {
      * r must satisfy 0 <= r < log(word length) (64 for uint64_t) but no checks are made
      */
     inline void addJr(Word j, Word r) {
+      // rho of the hashes 0 and 1 exceeds the register range; saturate it
+      r = std::min(r, VALUE_MASK);
+      if (sparse) {
+        addSparse(j, r);
+        return;
+      }
       Word r0 = M.get(j);
-      if (r > r0)
-        M.set(j, r);      
+      if (r > r0) {
+        M.set(j, r);
+        if (cacheEstimate)
+          aggregates->update(r0, r);
+      }
     }
     
 
 
+    /**
+     * Adds the n objects of the array to the sketch. The objects are
+     * hashed a batch at a time before the registers are updated.
+     */
+    template<typename Object,
+             typename XHashFun = decltype(farmhash<Object>),
+             typename JHashFun = decltype(fibonacciHash<Word>)>
+    void addBatch(const Object* objects, size_t n,
+                  XHashFun h = farmhash<Object>,
+                  JHashFun f = fibonacciHash<Word>) {
+      forEachHashBatch<Word>(h, objects, n, [&](const Word* hashes, size_t k) {
+        addHashes(hashes, k, f);
+      });
+    }
+
+
+
+    /**
+     * Adds the n hashes of the array to the sketch. The register
+     * indices of a batch are computed and their words prefetched
+     * before any of the registers is updated.
+     */
+    template<typename JHashFun = decltype(fibonacciHash<Word>)>
+    void addHashes(const Word* hashes, size_t n,
+                   JHashFun f = fibonacciHash<Word>) {
+      forEachRegisterBatch(hashes, n, logM, f,
+                           [this](Word j) { if (!sparse) M.prefetch(j); },
+                           [this](Word j, Word r) { addJr(j, r); });
+    }
+
+
+
     /**
      * Returns a vector that contains the register values
      */
     std::vector<uint8_t> exportRegisters() const {
       std::vector<uint8_t> v(m);
-      for (int i = 0; i < m; ++i)
-        v[i] = M.get(i);
+      if (sparse)
+        for (size_t i = 0; i < S.size(); ++i)
+          v[S.keyAt(i)] = S.at(i);
+      else
+        M.unpack(v.data(), 0, m);
       return v;
     }
 
@@ -93,14 +207,42 @@ namespace hyperlogloglog {
      * Returns the present estimate
      */
     double estimate() const {
-      double E = 0;
-      int V = 0;
-      for (int j = 0; j < m; ++j) {
-        Word r = M.get(j);
-        V += (r == 0);
-        E += 1.0 / (1ull << r);
+      if (cacheEstimate)
+        return estimate(m, aggregates->value(), aggregates->zeros());
+      RegisterHistogram<Word> h;
+      if (sparse) {
+        h.increment(0, m - S.size());
+        for (size_t i = 0; i < S.size(); ++i)
+          h.increment(S.at(i));
+        return estimate(m, h);
+      }
+      uint8_t block[REGISTER_BLOCK_SIZE];
+      for (int j0 = 0; j0 < m; j0 += REGISTER_BLOCK_SIZE) {
+        int n = std::min(REGISTER_BLOCK_SIZE, m - j0);
+        M.unpack(block, j0, n);
+        h.add(block, n);
       }
-      E = alpha(m) * m * m / E;
+      return estimate(m, h);
+    }
+
+
+
+    /**
+     * Returns the estimate of a sketch with m registers whose values
+     * are counted in the histogram h
+     */
+    static double estimate(int m, const RegisterHistogram<Word>& h) {
+      return estimate(m, h.harmonicSum(), h.zeros());
+    }
+
+
+
+    /**
+     * Returns the estimate of a sketch with m registers, given the
+     * harmonic sum sum_j 2^-M[j] and the number V of zero registers
+     */
+    static double estimate(int m, double harmonicSum, int V) {
+      double E = alpha(m) * m * m / harmonicSum;
       if (E <= 5.0 / 2.0 * m && V != 0) {
         return m*log(static_cast<double>(m)/V);
       }
@@ -124,14 +266,72 @@ namespace hyperlogloglog {
     HyperLogLog merge(const HyperLogLog& that) const {
       if (m != that.m)
         throw std::invalid_argument("Mismatch in the number of registers");
-      HyperLogLog H(m);
-      for (int j = 0; j < m; ++j)
-        H.M.set(j, std::max(M.get(j), that.M.get(j)));
+      if (sparse || that.sparse) {
+        HyperLogLog H = *this;
+        H.mergeInto(that);
+        return H;
+      }
+      HyperLogLog H(m, cacheEstimate);
+      uint8_t block1[REGISTER_BLOCK_SIZE];
+      uint8_t block2[REGISTER_BLOCK_SIZE];
+      for (int j0 = 0; j0 < m; j0 += REGISTER_BLOCK_SIZE) {
+        int n = std::min(REGISTER_BLOCK_SIZE, m - j0);
+        M.unpack(block1, j0, n);
+        that.M.unpack(block2, j0, n);
+        for (int j = 0; j < n; ++j)
+          block1[j] = std::max(block1[j], block2[j]);
+        H.M.pack(block1, j0, n);
+        if (cacheEstimate)
+          for (int j = 0; j < n; ++j)
+            H.aggregates->update(0, block1[j]);
+      }
       return H;
     }
 
     
     
+    /**
+     * Merges the other sketch into this one in place. A sparse sketch
+     * is merged pair by pair; a dense one densifies this sketch.
+     */
+    void mergeInto(const HyperLogLog& that) {
+      if (m != that.m)
+        throw std::invalid_argument("Mismatch in the number of registers");
+      if (that.sparse) {
+        for (size_t i = 0; i < that.S.size(); ++i)
+          addJr(that.S.keyAt(i), that.S.at(i));
+        return;
+      }
+      if (sparse)
+        densify();
+      uint8_t block1[REGISTER_BLOCK_SIZE];
+      uint8_t block2[REGISTER_BLOCK_SIZE];
+      for (int j0 = 0; j0 < m; j0 += REGISTER_BLOCK_SIZE) {
+        int n = std::min(REGISTER_BLOCK_SIZE, m - j0);
+        M.unpack(block1, j0, n);
+        that.M.unpack(block2, j0, n);
+        if (cacheEstimate)
+          for (int j = 0; j < n; ++j)
+            if (block2[j] > block1[j])
+              aggregates->update(block1[j], block2[j]);
+        for (int j = 0; j < n; ++j)
+          block1[j] = std::max(block1[j], block2[j]);
+        M.pack(block1, j0, n);
+      }
+    }
+
+
+
+    /**
+     * Same as mergeInto
+     */
+    HyperLogLog& operator|=(const HyperLogLog& that) {
+      mergeInto(that);
+      return *this;
+    }
+
+
+
     /**
      * Returns the correction coefficient
      */
@@ -159,10 +359,48 @@ namespace hyperlogloglog {
 
     
   private:
+    /**
+     * Raises the register j to r in the sparse representation, and
+     * converts the sketch into the dense one once the pairs take at
+     * least as many bits as the dense registers
+     */
+    void addSparse(Word j, Word r) {
+      int idx = S.find(j);
+      Word r0 = idx >= 0 ? S.at(idx) : 0;
+      if (r > r0) {
+        S.add(j, r);
+        if (cacheEstimate)
+          aggregates->update(r0, r);
+        if (idx < 0 && S.bitSize() >= static_cast<size_t>(m) * logW)
+          densify();
+      }
+    }
+
+
+
+    /**
+     * Converts the sketch into the dense representation
+     */
+    void densify() {
+      M = PackedVector<Word, RegisterBits>(logW, m);
+      for (size_t i = 0; i < S.size(); ++i)
+        M.set(S.keyAt(i), S.at(i));
+      S = PackedMap<Word>(logM, logW);
+      sparse = false;
+    }
+
+
+
+    static constexpr Word VALUE_MASK = sizeof(Word)*CHAR_BIT - 1;
+
     int m;
     int logW; // register length
     int logM; // register address length
-    PackedVector<Word> M;
+    PackedVector<Word, RegisterBits> M; // empty while sparse
+    PackedMap<Word> S; // the nonzero registers while sparse
+    bool sparse;
+    bool cacheEstimate;
+    HeapOptional<HarmonicSum<Word>> aggregates; // only if cacheEstimate
   };
 }
 
@@ -0,0 +1,291 @@
+#ifndef HYPERLOGLOGLOG_HYPERLOGLOG8
+#define HYPERLOGLOGLOG_HYPERLOGLOG8
+
+#include "HyperLogLog.hpp"
+#include "HyperLogLogLog.hpp"
+#include <vector>
+
+namespace hyperlogloglog {
+  /**
+   * Basic HyperLogLog with a byte per register. An update is a single
+   * load, compare and store instead of the bit-misaligned
+   * read-modify-write of the packed registers of HyperLogLog, for the
+   * price of 8 instead of 6 bits per register; intended for
+   * latency-critical paths with moderate m. The register values, and
+   * hence the estimates, are identical to those of HyperLogLog.
+   */
+  template<typename Word = uint64_t>
+  class HyperLogLog8 {
+  public:
+    /**
+     * Basic constructor
+     * m : the number of registers
+     * cacheEstimate : if true, the harmonic sum and the number of zero
+     *                 registers are maintained on every update, making
+     *                 estimate() O(1)
+     */
+    explicit HyperLogLog8(int m, bool cacheEstimate = false) :
+      m(m), logM(log2i(m)), M(m, 0), cacheEstimate(cacheEstimate),
+      aggregates(cacheEstimate ? m : 0) {
+    }
+
+
+
+    /**
+     * Constructs a sketch with the given register values
+     * registers : the register values (as returned by exportRegisters)
+     * cacheEstimate : as in the basic constructor
+     */
+    explicit HyperLogLog8(const std::vector<uint8_t>& registers,
+                          bool cacheEstimate = false) :
+      HyperLogLog8(registers.size(), cacheEstimate) {
+      M = registers;
+      if (cacheEstimate)
+        for (uint8_t r : registers)
+          aggregates.update(0, r);
+    }
+
+
+
+    /**
+     * Returns the size of the sketch (the number of bits)
+     */
+    inline size_t bitSize() const {
+      return M.size() * CHAR_BIT;
+    }
+
+
+
+    /**
+     * Returns the number of bits allocated for the sketch (including
+     * unused capacity)
+     */
+    inline size_t allocatedBits() const {
+      return M.capacity() * CHAR_BIT;
+    }
+
+
+
+    /**
+     * Adds a new element to the sketch
+     */
+    template<typename Object,
+             typename XHashFun = decltype(farmhash<Object>),
+             typename JHashFun = decltype(fibonacciHash<Word>),
+             typename = std::enable_if_t<std::is_invocable_v<XHashFun, const Object&>>>
+    inline void add(const Object& o, XHashFun h = farmhash<Object>,
+                    JHashFun f = fibonacciHash<Word>) {
+      static_assert(std::is_same<decltype(h(o)),Word>::value,
+                    "Hash function type does not match the Word type of the class");
+      addHash(h(o), f);
+    }
+
+
+
+    /**
+     * Adds the len bytes at data to the sketch without copying them.
+     * Equivalent to adding std::string(data, len).
+     */
+    inline void add(const char* data, size_t len) {
+      add(std::string_view(data, len));
+    }
+
+
+
+    /**
+     * Adds a new hash to the sketch. Potentially useful if a
+     * different kind of hashing scheme is used outside the class.
+     */
+    template<typename JHashFun = decltype(fibonacciHash<Word>)>
+    inline void addHash(Word x, JHashFun f = fibonacciHash<Word>) {
+      static_assert(std::is_same<decltype(f(x,logM)),Word>::value,
+                    "Hash function type does not match the Word type of the class");
+      addJr(f(x,logM), rho(x));
+    }
+
+
+
+    /**
+     * Adds the specific j and r values to the sketch. This may be
+     * useful if full control is required of the hashing faculties.
+     * j must satisfy 0 <= j < m but no checks are made
+     * r must satisfy 0 <= r < log(word length) (64 for uint64_t) but no checks are made
+     */
+    inline void addJr(Word j, Word r) {
+      // rho of the hashes 0 and 1 exceeds the register range; saturate it
+      r = std::min(r, VALUE_MASK);
+      uint8_t r0 = M[j];
+      if (r > r0) {
+        M[j] = r;
+        if (cacheEstimate)
+          aggregates.update(r0, r);
+      }
+    }
+
+
+
+    /**
+     * Adds the n objects of the array to the sketch. The objects are
+     * hashed a batch at a time before the registers are updated.
+     */
+    template<typename Object,
+             typename XHashFun = decltype(farmhash<Object>),
+             typename JHashFun = decltype(fibonacciHash<Word>)>
+    void addBatch(const Object* objects, size_t n,
+                  XHashFun h = farmhash<Object>,
+                  JHashFun f = fibonacciHash<Word>) {
+      forEachHashBatch<Word>(h, objects, n, [&](const Word* hashes, size_t k) {
+        addHashes(hashes, k, f);
+      });
+    }
+
+
+
+    /**
+     * Adds the n hashes of the array to the sketch. The register
+     * indices of a batch are computed and prefetched before any of
+     * the registers is updated.
+     */
+    template<typename JHashFun = decltype(fibonacciHash<Word>)>
+    void addHashes(const Word* hashes, size_t n,
+                   JHashFun f = fibonacciHash<Word>) {
+      forEachRegisterBatch(hashes, n, logM, f,
+                           [this](Word j) { __builtin_prefetch(&M[j], 1); },
+                           [this](Word j, Word r) { addJr(j, r); });
+    }
+
+
+
+    /**
+     * Returns a vector that contains the register values
+     */
+    std::vector<uint8_t> exportRegisters() const {
+      return M;
+    }
+
+
+
+    /**
+     * Returns the present estimate. The registers need no unpacking,
+     * so they are counted in place with vector compares.
+     */
+    double estimate() const {
+      if (cacheEstimate)
+        return HyperLogLog<Word>::estimate(m, aggregates.value(),
+                                           aggregates.zeros());
+      RegisterHistogram<Word> h;
+      h.addVectorized(M.data(), m);
+      return HyperLogLog<Word>::estimate(m, h);
+    }
+
+
+
+    /**
+     * Merges this sketch with the other sketch and returns a new sketch
+     *
+     * Note: if the sketches were constructed with different hash
+     * functions, the result will be nonsensical. It is up to the
+     * caller to ensure that the exact same hash functions were used.
+     */
+    HyperLogLog8 merge(const HyperLogLog8& that) const {
+      HyperLogLog8 H = *this;
+      H.mergeInto(that);
+      return H;
+    }
+
+
+
+    /**
+     * Merges the other sketch into this one in place. The byte-wise
+     * maximum is a straight loop the compiler vectorizes (vpmaxub).
+     */
+    void mergeInto(const HyperLogLog8& that) {
+      if (m != that.m)
+        throw std::invalid_argument("Mismatch in the number of registers");
+      if (&that == this)
+        return;
+      if (cacheEstimate)
+        for (int j = 0; j < m; ++j)
+          if (that.M[j] > M[j])
+            aggregates.update(M[j], that.M[j]);
+      // byte stores may alias any member, so the bound is kept local
+      uint8_t* __restrict a = M.data();
+      const uint8_t* __restrict b = that.M.data();
+      for (int j = 0, n = m; j < n; ++j)
+        a[j] = std::max(a[j], b[j]);
+    }
+
+
+
+    /**
+     * Same as mergeInto
+     */
+    HyperLogLog8& operator|=(const HyperLogLog8& that) {
+      mergeInto(that);
+      return *this;
+    }
+
+
+
+    /**
+     * Converts the sketch into a packed HyperLogLog sketch
+     */
+    HyperLogLog<Word> toHyperLogLog() const {
+      return HyperLogLog<Word>(M);
+    }
+
+
+
+    /**
+     * Converts a packed HyperLogLog sketch into a byte-per-register one
+     */
+    static HyperLogLog8 fromHyperLogLog(const HyperLogLog<Word>& hll) {
+      return HyperLogLog8(hll.exportRegisters());
+    }
+
+
+
+    /**
+     * Converts the sketch into a HyperLogLogLog sketch (see the
+     * HyperLogLogLog constructor for the parameters)
+     */
+    template<size_t MBits = 0>
+    HyperLogLogLog<Word, MBits>
+    toHyperLogLogLog(int mBits = MBits > 0 ? MBits : 3,
+                     int flags = HyperLogLogLog<Word, MBits>::
+                     HYPERLOGLOGLOG_COMPRESS_DEFAULT) const {
+      return HyperLogLogLog<Word, MBits>::fromHyperLogLog(toHyperLogLog(),
+                                                          mBits, flags);
+    }
+
+
+
+    /**
+     * Converts a HyperLogLogLog sketch into a byte-per-register one
+     */
+    template<size_t MBits>
+    static HyperLogLog8 fromHyperLogLogLog(const HyperLogLogLog<Word, MBits>& hlll) {
+      return HyperLogLog8(hlll.exportRegisters());
+    }
+
+
+
+    /**
+     * Returns the number of registers
+     */
+    inline int getM() const {
+      return m;
+    }
+
+  private:
+    static constexpr Word VALUE_MASK = sizeof(Word)*CHAR_BIT - 1;
+
+    int m;
+    int logM; // register address length
+    std::vector<uint8_t> M;
+    bool cacheEstimate;
+    HarmonicSum<Word> aggregates;
+  };
+}
+
+#endif // HYPERLOGLOGLOG_HYPERLOGLOG8
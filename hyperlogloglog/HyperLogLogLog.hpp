@@ -5,15 +5,30 @@
 #include "Hash.hpp"
 #include "common.hpp"
 #include "PackedMap.hpp"
+#include <zstd/common/fse.h>
+#include <algorithm>
 #include <cstdint>
+#include <iterator>
 #include <set>
+#include <string>
+#include <thread>
+#include <vector>
 
 namespace hyperlogloglog {
   /**
    * HyperLogLogLog. The template parameter Word determines the
    * word type and length (that is, the length of the hashes).
+   * MBits fixes the width of the offsets in M at compile time (0
+   * selects the runtime width given to the constructor).
+   *
+   * A sketch constructed as sparse keeps all of its nonzero registers
+   * in S with the base fixed at zero and M unallocated, and is
+   * converted into the base+M/S representation once S takes as many
+   * bits as M would. The conversion is transparent to all operations.
+   * The histogram of the register values is only allocated in the
+   * dense representation; a sparse sketch counts its pairs instead.
    */
-  template<typename Word = uint64_t>
+  template<typename Word = uint64_t, size_t MBits = 0>
   class HyperLogLogLog {
   public:
     // these are flags
@@ -37,18 +52,23 @@ namespace hyperlogloglog {
      * Basic constructor
      * m : number of registers
      * mBits : log2(log2(n)) bits for offsets in the M registers; 
-     *         should be 2 or 3
+     *         should be 2 or 3 (and equal MBits if it is nonzero)
      * flags : how to perform compression (default value gives theoretical 
      *         guarantees, but might be slow initially)
+     * sparse : if true, the sketch starts in the sparse representation
      */
-    explicit HyperLogLogLog(int m, int mBits = 3, 
-                            int flags_ = HYPERLOGLOGLOG_COMPRESS_DEFAULT) :
+    explicit HyperLogLogLog(int m, int mBits = MBits > 0 ? MBits : 3, 
+                            int flags_ = HYPERLOGLOGLOG_COMPRESS_DEFAULT,
+                            bool sparse = false) :
       m(m), logM(log2i(m)), mBits(mBits),
       sBits(log2i(sizeof(Word)*CHAR_BIT)), flags(flags_),
-      M(mBits,m), S(log2i(m), sBits), minValueCount(m),
+      M(mBits, sparse ? 0 : m), S(log2i(m), sBits), sparse(sparse),
+      minValueCount(m),
       maxOffset((1u << mBits) - 1) {
       if (m != 1 << log2i(m))
         throw std::invalid_argument("m must be a power of two");
+      if (!sparse)
+        histogram.emplace().increment(0, m);
       
       if (flags == HYPERLOGLOGLOG_COMPRESS_TYPE_FULL ||
           flags == HYPERLOGLOGLOG_COMPRESS_TYPE_INCREASE)
@@ -76,7 +96,8 @@ namespace hyperlogloglog {
      */
     template<typename Object,
              typename XHashFun = decltype(farmhash<Object>),
-             typename JHashFun = decltype(fibonacciHash<Word>)>
+             typename JHashFun = decltype(fibonacciHash<Word>),
+             typename = std::enable_if_t<std::is_invocable_v<XHashFun, const Object&>>>
     inline void add(const Object& o, XHashFun h = farmhash<Object>,
                     JHashFun f = fibonacciHash<Word>) {
       static_assert(std::is_same<decltype(h(o)),Word>::value,
@@ -86,6 +107,16 @@ namespace hyperlogloglog {
 
 
 
+    /**
+     * Adds the len bytes at data to the sketch without copying them.
+     * Equivalent to adding std::string(data, len).
+     */
+    inline void add(const char* data, size_t len) {
+      add(std::string_view(data, len));
+    }
+
+
+
     /**
      * Adds a new hash to the sketch. Potentially useful if a
      * different kind of hashing scheme is used outside the class.
@@ -106,34 +137,44 @@ namespace hyperlogloglog {
      * r must satisfy 0 <= r < log(word length) (64 for uint64_t) but no checks are made
      */
     inline void addJr(Word j, Word r) {
-      if (r <= lowerBound)
-        return;
+      if (updateJr(j, r))
+        compress();
+    }
 
-      bool updated = false;
-      bool sizeIncreased = false;
-      int idx = S.find(j);
-      Word r0 = idx >= 0 ? S.at(idx) : M.get(j) + B;
-      if (r0 < r) {
-        if (B <= r && r <= B + maxOffset) {
-          if (idx >= 0)
-            S.eraseAt(idx);
-          M.set(j, r - B);
-        }
-        else {
-          S.add(j,r);
-          sizeIncreased = idx < 0;
-        }
-        
-        if (r0 == lowerBound)
-          --minValueCount;
-        
-        updated = true;
-      }
 
-      
-      if ((updated && (flags & HYPERLOGLOGLOG_COMPRESS_WHEN_ALWAYS)) ||
-          (sizeIncreased && (flags & HYPERLOGLOGLOG_COMPRESS_WHEN_APPEND)) ||
-          (minValueCount == 0 && (flags == HYPERLOGLOGLOG_COMPRESS_BOTTOM)))
+
+    /**
+     * Adds the n objects of the array to the sketch. The objects are
+     * hashed a batch at a time before the registers are updated, and
+     * the sketch is compressed at most once per call, at the end
+     * (except under the increase policy, which compresses as single
+     * adds do).
+     */
+    template<typename Object,
+             typename XHashFun = decltype(farmhash<Object>),
+             typename JHashFun = decltype(fibonacciHash<Word>)>
+    void addBatch(const Object* objects, size_t n,
+                  XHashFun h = farmhash<Object>,
+                  JHashFun f = fibonacciHash<Word>) {
+      bool pending = false;
+      forEachHashBatch<Word>(h, objects, n, [&](const Word* hashes, size_t k) {
+        pending |= updateHashes(hashes, k, f);
+      });
+      if (pending)
+        compress();
+    }
+
+
+
+    /**
+     * Adds the n hashes of the array to the sketch. The sketch is
+     * compressed at most once per call, at the end (except under the
+     * increase policy, which compresses as single adds do).
+     */
+    template<typename JHashFun = decltype(fibonacciHash<Word>)>
+    void addHashes(const Word* hashes, size_t n,
+                   JHashFun f = fibonacciHash<Word>) {
+      if (updateHashes(hashes, n, f))
         compress();
     }
 
@@ -148,13 +189,35 @@ namespace hyperlogloglog {
 
 
 
+    /**
+     * Returns the number of bits allocated for the sketch (including
+     * unused capacity of the sparse array and the histogram of a dense
+     * sketch)
+     */
+    inline size_t allocatedBits() const {
+      return M.allocatedBits() + S.allocatedBits() +
+        histogram.allocatedBits();
+    }
+
+
+
+    /**
+     * Returns true if the sketch is in the sparse representation
+     */
+    inline bool isSparse() const {
+      return sparse;
+    }
+
+
+
     /**
      * Returns a vector that contains the register values
      */
     std::vector<uint8_t> exportRegisters() const {
       std::vector<uint8_t> v(m);
-      for (int i = 0; i < m; ++i)
-        v[i] = get(i);
+      iterateBlocks([&](int j0, const uint8_t* block, int n) {
+          std::copy(block, block + n, v.begin() + j0);
+        });
       return v;
     }
 
@@ -164,22 +227,11 @@ namespace hyperlogloglog {
      * Returns the present estimate
      */
     double estimate() const {
-      double E = 0;
-      int V = 0;
-      iterate([&](Word, Word r) {
-          V += (r == 0);
-          E += 1.0 / (1ull << r);
-        });
-      E = HyperLogLog<Word>::alpha(m) * m * m / E;
-      if (E <= 5.0 / 2.0 * m && V != 0) {
-        return m*log(static_cast<double>(m)/V);
-      }
-      else if (E <= (1ull << 32)/30) {
-        return E;
-      }
-      else {
-        return -(1ll << 32) * log(1-E/(1ll << 32));
-      }
+      // the histogram is maintained on every update, so this is O(w)
+      // for a dense sketch
+      if (histogram)
+        return HyperLogLog<Word>::estimate(m, *histogram);
+      return HyperLogLog<Word>::estimate(m, sparseHistogram());
     }
 
     
@@ -190,95 +242,139 @@ namespace hyperlogloglog {
      * functions; otherwise the operation is meaningless.
      */
     HyperLogLogLog merge(const HyperLogLogLog& that) const {
-      if (m != that.m)
-        throw std::invalid_argument("Mismatch in the number of registers");
-      assert(logM == that.logM);
-      if (mBits != that.mBits)
-        throw std::invalid_argument("Mismatch in the number of M bits");
-      if (sBits != that.sBits)
-        throw std::invalid_argument("Mismatch in the number of S bits");
-      if (flags != that.flags)
-        throw std::invalid_argument("Mismatch in the flags");
-
+      checkCompatible(that);
+      if (sparse && that.sparse) {
+        HyperLogLogLog H = *this;
+        H.mergeInto(that);
+        return H;
+      }
       HyperLogLogLog H(m, mBits, flags);
-      H.B = std::max(B, that.B);
-      Word j = 0;
-      size_t i1 = 0;
-      size_t i2 = 0;
-      Word r1, r2, r;
-      while (i1 < S.size() && i2 < that.S.size()) {
-        Word k1 = S.keyAt(i1);
-        Word k2 = that.S.keyAt(i2);
-        Word k = std::min(k1,k2);
-        while (j < k) {
-          r1 = M.get(j)+B;
-          r2 = that.M.get(j)+that.B;
-          H.M.set(j, std::max(r1,r2)-H.B);
-          ++j;
-        }
-        if (k1 == k) {
-          r1 = S.at(i1);
-          ++i1;
-        }
-        else {
-          r1 = M.get(j)+B;
-        }
-        if (k2 == k) {
-          r2 = that.S.at(i2);
-          ++i2;
-        }
-        else {
-          r2 = that.M.get(j)+that.B;
-        }
-        r = std::max(r1,r2);
-        if (H.B <= r && r <= H.B + H.maxOffset)
-          H.M.set(j, r - H.B);
-        else
-          H.S.add(j,r);
-        ++j;
+      H.assignMax(*this, that);
+      return H;
+    }
+
+
+
+    /**
+     * Merges the other sketch into this one in place. The registers
+     * are rewritten in a single sweep and the sketch is compressed
+     * (and thus rebased) at most once, at the end. A sparse sketch is
+     * merged pair by pair without the sweep.
+     */
+    void mergeInto(const HyperLogLogLog& that) {
+      checkCompatible(that);
+      if (that.sparse) {
+        bool pending = false;
+        for (size_t i = 0; i < that.S.size(); ++i)
+          pending |= updateJr(that.S.keyAt(i), that.S.at(i));
+        if (pending)
+          compress();
+        return;
       }
-      while (i1 < S.size()) {
-        Word k = S.keyAt(i1);
-        while (j < k) {
-          r1 = M.get(j)+B;
-          r2 = that.M.get(j)+that.B;
-          H.M.set(j, std::max(r1,r2)-H.B);
-          ++j;
-        }
-        r1 = S.at(i1++);
-        r2 = that.M.get(j)+that.B;
-        r = std::max(r1,r2);
-        if (H.B <= r && r <= H.B + H.maxOffset)
-          H.M.set(j, r - H.B);
-        else
-          H.S.add(j,r);
-        ++j;
+      if (sparse)
+        densify();
+      assignMax(*this, that);
+    }
+
+
+
+    /**
+     * Same as mergeInto
+     */
+    HyperLogLogLog& operator|=(const HyperLogLogLog& that) {
+      mergeInto(that);
+      return *this;
+    }
+
+
+
+    /**
+     * Returns the union of the sketches in the range [begin, end) in
+     * a single K-way pass over the registers: the register-wise
+     * maximum is taken directly from the base+M/S representation of
+     * each sketch, the base is chosen once from the combined
+     * histogram, and M and S are written once. With numThreads > 1,
+     * the register range is split across that many threads, which
+     * are started and joined on every call; when taking many unions
+     * of small sketches, pass an executor instead (see below) so that
+     * the threads of a pool are reused.
+     *
+     * The sketches must be compatible (see merge).
+     */
+    template<typename Iterator>
+    static HyperLogLogLog unionAll(Iterator begin, Iterator end,
+                                   int numThreads = 1) {
+      return unionAll(begin, end, numThreads, [](int n, const auto& task) {
+        runOnThreads(n, task);
+      });
+    }
+
+
+
+    /**
+     * Same as above, but the register range is split into numTasks
+     * parts that are handed to the executor: execute(numTasks, task)
+     * must call task(t) once for every t in [0, numTasks), in any
+     * order and on any threads, and return when all the calls have
+     * returned.
+     */
+    template<typename Iterator, typename Executor>
+    static HyperLogLogLog unionAll(Iterator begin, Iterator end,
+                                   int numTasks, Executor&& execute) {
+      static_assert(std::is_base_of<std::forward_iterator_tag,
+                    typename std::iterator_traits<Iterator>::iterator_category>::value,
+                    "unionAll requires forward iterators");
+      if (begin == end)
+        throw std::invalid_argument("Cannot take the union of zero sketches");
+      std::vector<const HyperLogLogLog*> sketches;
+      for (Iterator it = begin; it != end; ++it) {
+        begin->checkCompatible(*it);
+        sketches.push_back(&*it);
       }
-      while (i2 < that.S.size()) {
-        Word k = that.S.keyAt(i2);
-        while (j < k) {
-          r1 = M.get(j)+B;
-          r2 = that.M.get(j)+that.B;
-          H.M.set(j, std::max(r1,r2)-H.B);
-          ++j;
+
+      const HyperLogLogLog& first = *sketches[0];
+      HyperLogLogLog H(first.m, first.mBits, first.flags);
+      std::vector<uint8_t> registers(H.m);
+      int numBlocks = (H.m + REGISTER_BLOCK_SIZE - 1) / REGISTER_BLOCK_SIZE;
+      numTasks = std::max(1, std::min(numTasks, numBlocks));
+      std::vector<RegisterHistogram<Word>> histograms(numTasks);
+      auto work = [&](int t) {
+        int j0 = numBlocks * t / numTasks * REGISTER_BLOCK_SIZE;
+        int j1 = std::min(H.m, numBlocks * (t + 1) / numTasks *
+                          REGISTER_BLOCK_SIZE);
+        maxRange(sketches, registers.data(), j0, j1);
+        histograms[t].add(registers.data() + j0, j1 - j0);
+      };
+      execute(numTasks, work);
+
+      RegisterHistogram<Word>& combined = H.histogram.emplace();
+      for (const RegisterHistogram<Word>& h : histograms)
+        combined.add(h);
+      for (const HyperLogLogLog* sketch : sketches)
+        H.B = std::max(H.B, sketch->B);
+      // the increase-only policy moves the base by one step at a time,
+      // so repeat until the base is stable
+      for (uint8_t b = H.chooseBase(); b != H.B; b = H.chooseBase())
+        H.B = b;
+
+      uint8_t block[REGISTER_BLOCK_SIZE];
+      for (int j0 = 0; j0 < H.m; j0 += REGISTER_BLOCK_SIZE) {
+        int n = std::min(REGISTER_BLOCK_SIZE, H.m - j0);
+        for (int j = 0; j < n; ++j) {
+          Word r = registers[j0 + j];
+          if (H.B <= r && r <= H.B + H.maxOffset) {
+            block[j] = r - H.B;
+          }
+          else {
+            H.S.append(j0 + j, r);
+            block[j] = 0;
+          }
         }
-        r1 = M.get(j) + B;
-        r2 = that.S.at(i2++);
-        r = std::max(r1,r2);
-        if (H.B <= r && r <= H.B + H.maxOffset)
-          H.M.set(j, r - H.B);
-        else
-          H.S.add(j,r);
-        ++j;
-      }
-      while (j < static_cast<Word>(m)) {
-        r1 = M.get(j)+B;
-        r2 = that.M.get(j)+that.B;
-        H.M.set(j, std::max(r1,r2)-H.B);
-        ++j;
+        H.M.pack(block, j0, n);
       }
 
-      H.compress();
+      ++H.scanCount;
+      ++H.compressCount;
       return H;
     }
 
@@ -302,15 +398,21 @@ namespace hyperlogloglog {
 
 
 
+    /**
+     * Returns the number of full sweeps over all m registers performed
+     * while updating the sketch (by rebasing and merging)
+     */
+    int getScanCount() const {
+      return scanCount;
+    }
+
+
+
     /**
      * Converts the sketch into an uncompressed, vanilla HyperLogLog sketch.
      */
     HyperLogLog<Word> toHyperLogLog() const {
-      HyperLogLog hll(m);
-      iterate([&](Word j, Word r) {
-          hll.addJr(j,r);
-        });
-      return hll;
+      return HyperLogLog<Word>(exportRegisters());
     }
 
 
@@ -320,7 +422,7 @@ namespace hyperlogloglog {
      */
     static
     HyperLogLogLog fromHyperLogLog(const HyperLogLog<Word>& hll,
-                                   int mBits = 3,
+                                   int mBits = MBits > 0 ? MBits : 3,
                                    int flags =
                                    HYPERLOGLOGLOG_COMPRESS_DEFAULT) {
       HyperLogLogLog hlll(hll.getM(), mBits, flags);
@@ -330,11 +432,157 @@ namespace hyperlogloglog {
       return hlll;
     }
 
-    
+
+
+    /**
+     * Serializes the sketch into a byte string from which deserialize
+     * reconstructs an identical sketch. The format is a 16-byte
+     * header (magic, version, word length, log2(m), mBits, flags, the
+     * base, the sparse flag, the encoding of M, and the number of
+     * pairs in S), followed by M and the packed pairs of S, all
+     * multibyte values in little-endian order. If entropyCoded is
+     * true, the offsets of M are coded with the tANS (FSE) coder of
+     * Zstd whenever that is smaller than packing them, which brings
+     * them from mBits bits down to about their empirical entropy.
+     */
+    std::vector<uint8_t> serialize(bool entropyCoded = false) const {
+      uint8_t encoding = M_PACKED;
+      std::vector<uint8_t> offsets;
+      std::vector<uint8_t> coded;
+      size_t codedSize = 0;
+      if (!sparse && entropyCoded) {
+        offsets.resize(m);
+        M.unpack(offsets.data(), 0, m);
+        coded.resize(FSE_compressBound(m));
+        codedSize = FSE_compress(coded.data(), coded.size(), offsets.data(), m);
+        // 0 means incompressible and 1 a single repeated offset
+        if (FSE_isError(codedSize) || codedSize == 0)
+          encoding = M_PACKED;
+        else if (codedSize == 1)
+          encoding = M_RLE;
+        else if (codedSize + 4 < M.byteSize())
+          encoding = M_FSE;
+      }
+
+      std::vector<uint8_t> out(SERIALIZED_MAGIC, SERIALIZED_MAGIC + 4);
+      out.push_back(SERIALIZED_VERSION);
+      out.push_back(sizeof(Word)*CHAR_BIT);
+      out.push_back(logM);
+      out.push_back(mBits);
+      out.push_back(flags);
+      out.push_back(B);
+      out.push_back(sparse);
+      out.push_back(encoding);
+      putU32(out, S.size());
+      assert(out.size() == SERIALIZED_HEADER_SIZE);
+
+      if (encoding == M_RLE) {
+        out.push_back(offsets[0]);
+      }
+      else if (encoding == M_FSE) {
+        putU32(out, codedSize);
+        out.insert(out.end(), coded.begin(), coded.begin() + codedSize);
+      }
+      else if (!sparse) {
+        size_t k = out.size();
+        out.resize(k + M.byteSize());
+        M.toBytes(out.data() + k);
+      }
+      size_t k = out.size();
+      out.resize(k + S.byteSize());
+      S.toBytes(out.data() + k);
+      return out;
+    }
+
+
+
+    /**
+     * Reconstructs a sketch from the output of serialize. M and S are
+     * read straight into their packed storage (or, if entropy coded,
+     * decoded in one pass and packed in bulk), and the histogram is
+     * rebuilt from a vectorized count of the offsets, without any
+     * register updates. Throws std::invalid_argument if the input is
+     * not a valid serialized sketch of this type.
+     */
+    static HyperLogLogLog deserialize(const uint8_t* data, size_t size) {
+      if (size < SERIALIZED_HEADER_SIZE ||
+          !std::equal(SERIALIZED_MAGIC, SERIALIZED_MAGIC + 4, data))
+        throw std::invalid_argument("Not a serialized HyperLogLogLog sketch");
+      if (data[4] != SERIALIZED_VERSION)
+        throw std::invalid_argument("Unsupported serialization version " +
+                                    std::to_string(data[4]));
+      if (data[5] != sizeof(Word)*CHAR_BIT)
+        throw std::invalid_argument("Mismatch in the word length");
+      int logM = data[6];
+      int mBits = data[7];
+      uint8_t B = data[9];
+      bool sparse = data[10];
+      uint8_t encoding = data[11];
+      size_t sCount = getU32(data + 12);
+      const int sBits = log2i(sizeof(Word)*CHAR_BIT);
+      if (logM < 1 || logM > 30 || mBits < 1 || mBits >= sBits || data[10] > 1 ||
+          encoding > M_FSE || (sparse && (B != 0 || encoding != M_PACKED)) ||
+          B >= 1 << sBits || sCount > (1u << logM))
+        throw std::invalid_argument("Invalid serialized HyperLogLogLog header");
+
+      // constructed sparse so that M is not allocated before it is read
+      HyperLogLogLog H(1 << logM, mBits, data[8], true);
+      H.sparse = sparse;
+      H.B = B;
+      const uint8_t* p = data + SERIALIZED_HEADER_SIZE;
+      const uint8_t* end = data + size;
+      auto consume = [&](size_t n) {
+        if (static_cast<size_t>(end - p) < n)
+          throw std::invalid_argument("Truncated serialized HyperLogLogLog sketch");
+        const uint8_t* q = p;
+        p += n;
+        return q;
+      };
+
+      std::vector<uint8_t> offsets;
+      if (!sparse && encoding == M_PACKED) {
+        size_t n = (static_cast<size_t>(H.m) * mBits + CHAR_BIT - 1) / CHAR_BIT;
+        H.M.fromBytes(consume(n), H.m);
+      }
+      else if (!sparse) {
+        offsets.resize(H.m);
+        if (encoding == M_RLE) {
+          std::fill(offsets.begin(), offsets.end(), *consume(1));
+        }
+        else {
+          size_t n = getU32(consume(4));
+          size_t d = FSE_decompress(offsets.data(), H.m, consume(n), n);
+          if (FSE_isError(d) || d != offsets.size())
+            throw std::invalid_argument("Corrupted entropy-coded offsets");
+        }
+        if (*std::max_element(offsets.begin(), offsets.end()) > H.maxOffset)
+          throw std::invalid_argument("Offset out of range");
+        H.M = PackedVector<Word, MBits>(mBits, H.m);
+        H.M.pack(offsets.data(), 0, H.m);
+      }
+      size_t n = (sCount * (logM + sBits) + CHAR_BIT - 1) / CHAR_BIT;
+      H.S.fromBytes(consume(n), sCount);
+      if (p != end)
+        throw std::invalid_argument("Trailing bytes after serialized HyperLogLogLog sketch");
+
+      H.restoreHistogram(offsets.empty() ? nullptr : offsets.data());
+      return H;
+    }
+
+
+
+    /**
+     * Same as deserialize(data.data(), data.size())
+     */
+    static HyperLogLogLog deserialize(const std::vector<uint8_t>& data) {
+      return deserialize(data.data(), data.size());
+    }
+
+
     
 #ifdef HYPERLOGLOGLOG_DEBUG
     // debug getters
-    const PackedVector<Word>& getM() const {
+    const PackedVector<Word, MBits>& getM() const {
       return M;
     }
 
@@ -356,24 +604,386 @@ namespace hyperlogloglog {
 
     
   private:
+    static constexpr uint8_t SERIALIZED_MAGIC[4] = { 'H', 'L', 'L', 'L' };
+    static constexpr uint8_t SERIALIZED_VERSION = 1;
+    static constexpr size_t SERIALIZED_HEADER_SIZE = 16;
+    // encodings of M in the serialized format
+    static constexpr uint8_t M_PACKED = 0;
+    static constexpr uint8_t M_RLE = 1; // a single offset repeated m times
+    static constexpr uint8_t M_FSE = 2; // length-prefixed FSE-coded offsets
+
+    static void putU32(std::vector<uint8_t>& out, uint32_t x) {
+      for (int i = 0; i < 4; ++i)
+        out.push_back(x >> (i * CHAR_BIT));
+    }
+
+    static uint32_t getU32(const uint8_t* in) {
+      uint32_t x = 0;
+      for (int i = 0; i < 4; ++i)
+        x |= static_cast<uint32_t>(in[i]) << (i * CHAR_BIT);
+      return x;
+    }
+
+
+
+    /**
+     * Rebuilds the histogram (of a dense sketch) and the lower bound
+     * of a deserialized sketch and checks that its S is consistent
+     * with the base. offsets holds the unpacked M if it is at hand
+     * (nullptr: M is unpacked here a block at a time). The registers
+     * of M are counted at the base first, and each pair of S then
+     * moves its register from the value M holds for it to the value
+     * in S.
+     */
+    void restoreHistogram(const uint8_t* offsets) {
+      const int numValues = 1u << sBits;
+      if (sparse) {
+        histogram.reset();
+      }
+      else {
+        histogram.emplace();
+        RegisterHistogram<Word> counts;
+        if (offsets) {
+          counts.addVectorized(offsets, m);
+        }
+        else {
+          uint8_t block[REGISTER_BLOCK_SIZE];
+          for (int j0 = 0; j0 < m; j0 += REGISTER_BLOCK_SIZE) {
+            int n = std::min(REGISTER_BLOCK_SIZE, m - j0);
+            M.unpack(block, j0, n);
+            counts.addVectorized(block, n);
+          }
+        }
+        for (int r = 0; r <= maxOffset; ++r) {
+          if (counts.count(r) > 0 && B + r >= numValues)
+            throw std::invalid_argument("Register value out of range");
+          histogram->increment(B + r, counts.count(r));
+        }
+      }
+
+      for (size_t i = 0; i < S.size(); ++i) {
+        Word j = S.keyAt(i);
+        Word r = S.at(i);
+        if (i > 0 && j <= S.keyAt(i - 1))
+          throw std::invalid_argument("Unsorted keys in S");
+        if (!sparse) {
+          if (B <= r && r <= B + maxOffset)
+            throw std::invalid_argument("S holds a register within the range of M");
+          histogram->update(M.get(j) + B, r);
+        }
+      }
+      // only called for the lower bound (and the count of the minimum);
+      // the base itself was chosen by the serialized sketch
+      if (!sparse)
+        chooseBase();
+    }
+
+
+
     /**
      * Performs the rebase operation, that is, adjusts things to a new base.
      */
     void rebase(uint8_t newB) {
-      for (int i = 0; i < m; ++i) {
-        int idx = S.find(i);
-        Word r = idx >= 0 ? S.at(idx) : M.get(i) + B;
-        if (newB <= r && r <= newB + maxOffset) {
-          M.set(i, r - newB);
+      // the registers are visited in order, so the new sparse array
+      // can be built by appending without any shifting
+      PackedMap<Word> newS(logM, sBits);
+      uint8_t block[REGISTER_BLOCK_SIZE];
+      size_t idx = 0;
+      for (int j0 = 0; j0 < m; j0 += REGISTER_BLOCK_SIZE) {
+        int n = std::min(REGISTER_BLOCK_SIZE, m - j0);
+        M.unpack(block, j0, n);
+        for (int j = 0; j < n; ++j) {
+          Word r;
+          if (idx < S.size() && S.keyAt(idx) == static_cast<Word>(j0 + j))
+            r = S.at(idx++);
+          else
+            r = block[j] + B;
+          if (newB <= r && r <= newB + maxOffset)
+            block[j] = r - newB;
+          else
+            newS.append(j0 + j, r);
+        }
+        M.pack(block, j0, n);
+      }
+      S = std::move(newS);
+      B = newB;
+      ++rebaseCount;
+      ++scanCount;
+    }
+
+    
+    
+    /**
+     * Decodes the values of n registers starting from the register j0
+     * into out. idx is the position in S of the first key not smaller
+     * than j0, and is advanced past the keys of the block.
+     */
+    void decodeBlock(uint8_t* out, int j0, int n, size_t& idx) const {
+      if (sparse) {
+        std::fill(out, out + n, 0);
+      }
+      else {
+        M.unpack(out, j0, n);
+        for (int j = 0; j < n; ++j)
+          out[j] += B;
+      }
+      for (; idx < S.size() && S.keyAt(idx) < static_cast<Word>(j0 + n); ++idx)
+        out[S.keyAt(idx) - j0] = S.at(idx);
+    }
+
+
+
+    /**
+     * Updates register j to r if r is larger than its present value,
+     * without compressing. Returns true if the compression policy
+     * calls for compression after the update.
+     */
+    inline bool updateJr(Word j, Word r) {
+      // rho of the hashes 0 and 1 exceeds the register range; saturate it
+      r = std::min(r, VALUE_MASK);
+      if (r <= lowerBound)
+        return false;
+      if (sparse)
+        return updateSparse(j, r);
+
+      bool updated = false;
+      bool sizeIncreased = false;
+      int idx = S.find(j);
+      Word r0 = idx >= 0 ? S.at(idx) : M.get(j) + B;
+      if (r0 < r) {
+        if (B <= r && r <= B + maxOffset) {
           if (idx >= 0)
             S.eraseAt(idx);
+          M.set(j, r - B);
         }
         else {
-          S.add(i, r);
+          S.add(j,r);
+          sizeIncreased = idx < 0;
         }
+        
+        if (r0 == lowerBound)
+          --minValueCount;
+
+        histogram->update(r0, r);
+        
+        updated = true;
+      }
+
+      return (updated && (flags & HYPERLOGLOGLOG_COMPRESS_WHEN_ALWAYS)) ||
+        (sizeIncreased && (flags & HYPERLOGLOGLOG_COMPRESS_WHEN_APPEND)) ||
+        (minValueCount == 0 && (flags == HYPERLOGLOGLOG_COMPRESS_BOTTOM));
+    }
+
+
+
+    /**
+     * Updates register j to r in the sparse representation, and
+     * converts the sketch into the dense one once S takes at least as
+     * many bits as M. Returns true if the sketch was converted and
+     * should be compressed.
+     */
+    bool updateSparse(Word j, Word r) {
+      int idx = S.find(j);
+      Word r0 = idx >= 0 ? S.at(idx) : 0;
+      if (r0 >= r)
+        return false;
+      S.add(j, r);
+      if (idx < 0 && S.bitSize() >= static_cast<size_t>(m) * mBits) {
+        densify();
+        return true;
       }
+      return false;
+    }
+
+
+
+    /**
+     * Returns the histogram of the registers of a sparse sketch
+     */
+    RegisterHistogram<Word> sparseHistogram() const {
+      RegisterHistogram<Word> h;
+      h.increment(0, m - S.size());
+      for (size_t i = 0; i < S.size(); ++i)
+        h.increment(S.at(i));
+      return h;
+    }
+
+
+
+    /**
+     * Converts the sketch into the dense representation with the base
+     * zero; the sketch must be compressed afterwards to choose the base
+     */
+    void densify() {
+      assert(B == 0);
+      histogram.emplace(sparseHistogram());
+      M = PackedVector<Word, MBits>(mBits, m);
+      PackedMap<Word> newS(logM, sBits);
+      for (size_t i = 0; i < S.size(); ++i) {
+        Word r = S.at(i);
+        if (r <= maxOffset)
+          M.set(S.keyAt(i), r);
+        else
+          newS.append(S.keyAt(i), r);
+      }
+      S = std::move(newS);
+      sparse = false;
+      ++scanCount;
+    }
+
+
+
+    /**
+     * Updates the registers with the hashes. The register indices of a
+     * batch are computed and their words prefetched before any of the
+     * registers is updated. Returns true if the compression policy
+     * calls for compression, which is then left to the caller. The
+     * increase policy moves the base by at most one step per
+     * compression, so under it the sketch is instead compressed after
+     * every update that calls for it, exactly as with single adds.
+     */
+    template<typename JHashFun>
+    bool updateHashes(const Word* hashes, size_t n, JHashFun f) {
+      bool pending = false;
+      forEachRegisterBatch(hashes, n, logM, f,
+                           [this](Word j) { if (!sparse) M.prefetch(j); },
+                           [&](Word j, Word r) {
+                             if (updateJr(j, r)) {
+                               if (flags & HYPERLOGLOGLOG_COMPRESS_TYPE_INCREASE)
+                                 compress();
+                               else
+                                 pending = true;
+                             }
+                           });
+      return pending;
+    }
+
+
+
+    /**
+     * Throws if the sketches cannot be merged
+     */
+    void checkCompatible(const HyperLogLogLog& that) const {
+      if (m != that.m)
+        throw std::invalid_argument("Mismatch in the number of registers");
+      assert(logM == that.logM);
+      if (mBits != that.mBits)
+        throw std::invalid_argument("Mismatch in the number of M bits");
+      if (sBits != that.sBits)
+        throw std::invalid_argument("Mismatch in the number of S bits");
+      if (flags != that.flags)
+        throw std::invalid_argument("Mismatch in the flags");
+    }
+
+
+
+    /**
+     * Sets the registers of this sketch to the register-wise maximum
+     * of a and b, and compresses the result. Either of a and b may be
+     * this sketch: the registers are decoded block by block before the
+     * block is overwritten, and the sparse array is built on the side.
+     */
+    void assignMax(const HyperLogLogLog& a, const HyperLogLogLog& b) {
+      uint8_t newB = std::max(a.B, b.B);
+      PackedMap<Word> newS(logM, sBits);
+      RegisterHistogram<Word> newHistogram;
+      uint8_t block1[REGISTER_BLOCK_SIZE];
+      uint8_t block2[REGISTER_BLOCK_SIZE];
+      size_t i1 = 0;
+      size_t i2 = 0;
+      for (int j0 = 0; j0 < m; j0 += REGISTER_BLOCK_SIZE) {
+        int n = std::min(REGISTER_BLOCK_SIZE, m - j0);
+        a.decodeBlock(block1, j0, n, i1);
+        b.decodeBlock(block2, j0, n, i2);
+        for (int j = 0; j < n; ++j) {
+          Word r = std::max(block1[j], block2[j]);
+          newHistogram.increment(r);
+          if (newB <= r && r <= newB + maxOffset) {
+            block1[j] = r - newB;
+          }
+          else {
+            newS.append(j0 + j, r);
+            block1[j] = 0;
+          }
+        }
+        M.pack(block1, j0, n);
+      }
+
       B = newB;
-      ++rebaseCount;
+      S = std::move(newS);
+      *histogram = newHistogram;
+      ++scanCount;
+      compress();
+    }
+
+
+
+    /**
+     * Calls task(t) for every t in [0, numTasks), each t > 0 on a
+     * thread of its own and t = 0 on the calling thread, and returns
+     * when all have finished
+     */
+    template<typename Task>
+    static void runOnThreads(int numTasks, const Task& task) {
+      std::vector<std::thread> threads;
+      threads.reserve(numTasks - 1);
+      try {
+        for (int t = 1; t < numTasks; ++t)
+          threads.emplace_back(task, t);
+      }
+      catch (...) {
+        for (std::thread& thread : threads)
+          thread.join();
+        throw;
+      }
+      task(0);
+      for (std::thread& thread : threads)
+        thread.join();
+    }
+
+
+
+    /**
+     * Writes the register-wise maximum of the sketches over the
+     * registers j0, ..., j1-1 into out[j0], ..., out[j1-1]. j0 must be
+     * a multiple of REGISTER_BLOCK_SIZE.
+     */
+    static void maxRange(const std::vector<const HyperLogLogLog*>& sketches,
+                         uint8_t* out, int j0, int j1) {
+      uint8_t block[REGISTER_BLOCK_SIZE];
+      for (size_t k = 0; k < sketches.size(); ++k) {
+        size_t idx = sketches[k]->S.lowerBound(j0);
+        for (int b0 = j0; b0 < j1; b0 += REGISTER_BLOCK_SIZE) {
+          int n = std::min(REGISTER_BLOCK_SIZE, j1 - b0);
+          if (k == 0) {
+            sketches[k]->decodeBlock(out + b0, b0, n, idx);
+          }
+          else {
+            sketches[k]->decodeBlock(block, b0, n, idx);
+            for (int j = 0; j < n; ++j)
+              out[b0 + j] = std::max(out[b0 + j], block[j]);
+          }
+        }
+      }
+    }
+
+
+
+    /**
+     * Iterates over all registers in blocks of at most
+     * REGISTER_BLOCK_SIZE registers, and applies the function to the
+     * (j0, values, n) triples, where values holds the values of the
+     * registers j0, ..., j0+n-1
+     */
+    template<typename Fun>
+    void iterateBlocks(Fun f) const {
+      uint8_t block[REGISTER_BLOCK_SIZE];
+      size_t idx = 0;
+      for (int j0 = 0; j0 < m; j0 += REGISTER_BLOCK_SIZE) {
+        int n = std::min(REGISTER_BLOCK_SIZE, m - j0);
+        decodeBlock(block, j0, n, idx);
+        f(j0, block, n);
+      }
     }
 
     
@@ -383,118 +993,133 @@ namespace hyperlogloglog {
      */
     template<typename Fun>
     void iterate(Fun f) const {
-      Word j = 0;
-      for (size_t i = 0; i < S.size(); ++i) {
-        Word k = S.keyAt(i);
-        while (j < k) {
-          f(j, M.get(j) + B);
-          ++j;
-        }
-        f(j,S.at(i));
-        ++j;
-      }
-      while (j < static_cast<Word>(m)) {
-        f(j, M.get(j) + B);
-        ++j;
-      }
+      iterateBlocks([&](int j0, const uint8_t* block, int n) {
+          for (int j = 0; j < n; ++j)
+            f(j0 + j, block[j]);
+        });
     }
 
     
     void compress() {
+      assert(S.size() == sparseCount(B));
+      uint8_t newB = chooseBase();
+      if (newB != B)
+        rebase(newB);
+      compressCount++;
+    }
+
+
+
+    /**
+     * Returns the base the sketch should have according to the
+     * compression policy, and updates the lower bound. Only the
+     * histogram and the current base are used, so this can also be
+     * called before the registers are encoded.
+     */
+    uint8_t chooseBase() {
       if (flags & HYPERLOGLOGLOG_COMPRESS_TYPE_FULL)
-        compressFull();
+        return chooseBaseFull();
       else if (flags & HYPERLOGLOGLOG_COMPRESS_TYPE_INCREASE)
-        compressIncrease();
+        return chooseBaseIncrease();
       else if (flags == HYPERLOGLOGLOG_COMPRESS_BOTTOM)
-        compressBottom();
-      else
-        assert(false && "Invalid flags");
-      compressCount++;
+        return chooseBaseBottom();
+      assert(false && "Invalid flags");
+      return B;
     }
 
 
 
-    void compressFull() {
-      size_t bestNs = S.size();
-      uint8_t bestPotentialBase = B;
+    /**
+     * Returns the number of registers that would be stored in the
+     * sparse array with the base b
+     */
+    size_t sparseCount(int b) const {
+      const RegisterHistogram<Word>& h = *histogram;
+      const int numValues = 1u << sBits;
+      size_t ns = m;
+      for (int r = b; r <= b + maxOffset && r < numValues; ++r)
+        ns -= h.count(r);
+      return ns;
+    }
 
-      uint8_t potentialBase = (1u << sBits);
-      uint8_t nextPotentialBase = potentialBase;
 
-      iterate([&](Word, Word r) {
-          if (r < potentialBase) {
-            nextPotentialBase = potentialBase;
-            potentialBase = r;
-          }
-          else if (r < nextPotentialBase) {
-            nextPotentialBase = r;
-          }
-        });
+
+    uint8_t chooseBaseFull() {
+      const RegisterHistogram<Word>& h = *histogram;
+      size_t bestNs = sparseCount(B);
+      uint8_t bestPotentialBase = B;
+
+      const int numValues = 1u << sBits;
+      int potentialBase = 0;
+      while (potentialBase < numValues &&
+             h.count(potentialBase) == 0)
+        ++potentialBase;
       lowerBound = potentialBase;
 
+      // the number of registers whose value lies in
+      // [potentialBase, potentialBase + maxOffset] is maintained as a
+      // sliding window sum over the histogram
+      size_t inWindow = 0;
+      for (int r = potentialBase;
+           r <= potentialBase + maxOffset && r < numValues; ++r)
+        inWindow += h.count(r);
+
       size_t nBelowB = 0; // this is a lower bound on ns
-      while (nBelowB < bestNs && potentialBase < (1u << sBits)) {
-        nextPotentialBase = (1u << sBits);
-        size_t ns = 0;
-        iterate([&](Word, Word r) {
-            if ((r < potentialBase) || (r > potentialBase + maxOffset))
-              ++ns;
-            if (r == potentialBase)
-              ++nBelowB;
-            if (r > potentialBase && r < nextPotentialBase)
-              nextPotentialBase = r;
-          });
+      while (nBelowB < bestNs && potentialBase < numValues) {
+        size_t ns = m - inWindow;
+        nBelowB += h.count(potentialBase);
 
         if (ns < bestNs) {
           bestNs = ns;
           bestPotentialBase = potentialBase;
         }
 
+        int nextPotentialBase = potentialBase + 1;
+        while (nextPotentialBase < numValues &&
+               h.count(nextPotentialBase) == 0)
+          ++nextPotentialBase;
+        for (int r = potentialBase; r < nextPotentialBase; ++r) {
+          inWindow -= h.count(r);
+          if (r + maxOffset + 1 < numValues)
+            inWindow += h.count(r + maxOffset + 1);
+        }
         potentialBase = nextPotentialBase;
       }
 
-      if (bestPotentialBase != B)
-        rebase(bestPotentialBase);
+      return bestPotentialBase;
     }
 
 
     
-    void compressIncrease() {
-      uint8_t potentialBase = (1u << sBits);
-      lowerBound = potentialBase;
-      iterate([&](Word, Word r) {
-          if (B < r && r < potentialBase) 
-            potentialBase = r;
-          if (r < lowerBound)
-            lowerBound = r;
-        });
-
-      size_t ns = 0;
-      iterate([&](Word, Word r) {
-          ns += (r < potentialBase) || (r > potentialBase + maxOffset);
-        });
-
-      if (ns < S.size()) {
-        rebase(potentialBase);
-      }
+    uint8_t chooseBaseIncrease() {
+      const RegisterHistogram<Word>& h = *histogram;
+      const int numValues = 1u << sBits;
+      int potentialBase = B + 1;
+      while (potentialBase < numValues &&
+             h.count(potentialBase) == 0)
+        ++potentialBase;
+      lowerBound = 0;
+      while (lowerBound < numValues && h.count(lowerBound) == 0)
+        ++lowerBound;
+
+      if (potentialBase < numValues &&
+          sparseCount(potentialBase) < sparseCount(B))
+        return potentialBase;
+      return B;
     }
 
     
       
-    void compressBottom() {
-      lowerBound = (1u << sBits);
-      iterate([&](Word, Word r) {
-          lowerBound = r < lowerBound ? r : lowerBound;
-        });
-      minValueCount = 0;
-      iterate([&](Word, Word r) {
-          if (r == lowerBound)
-            ++minValueCount;
-        });
-
-      if (lowerBound > B) {
-        rebase(lowerBound);
-      }
+    uint8_t chooseBaseBottom() {
+      const RegisterHistogram<Word>& h = *histogram;
+      const int numValues = 1u << sBits;
+      lowerBound = 0;
+      while (lowerBound < numValues && h.count(lowerBound) == 0)
+        ++lowerBound;
+      minValueCount =
+        lowerBound < numValues ? h.count(lowerBound) : 0;
+
+      return lowerBound > B ? lowerBound : B;
     }
 
 
@@ -506,25 +1131,33 @@ namespace hyperlogloglog {
       int idx = S.find(j);
       if (idx >= 0)
         return S.at(idx);
+      else if (sparse)
+        return 0;
       else
         return M.get(j) + B;
     }
 
     
     
+    static constexpr Word VALUE_MASK = sizeof(Word)*CHAR_BIT - 1;
+
     int m;
     int logM;
     uint8_t mBits;
     uint8_t sBits;
     uint8_t flags;
-    PackedVector<Word> M;
+    PackedVector<Word, MBits> M; // empty while sparse
     PackedMap<Word> S;
+    bool sparse;
     uint8_t lowerBound = 0; // Lower bound on the register values
     int minValueCount = 0; // number of minimum-valued registers
     uint8_t B = 0; // Current base value
     uint8_t maxOffset;
     int compressCount = 0;
     int rebaseCount = 0;
+    int scanCount = 0;
+    // number of registers holding each value; absent while sparse
+    HeapOptional<RegisterHistogram<Word>> histogram;
   };
 
 
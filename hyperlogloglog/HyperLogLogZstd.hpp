@@ -2,13 +2,42 @@
 #define HYPERLOGLOGLOG_HYPERLOGLOG_ZSTD
 
 #include "HyperLogLog.hpp"
-#include <zstd/zstd.h>
+#include "ZstdDictionary.hpp"
+#include <memory>
+#include <stdexcept>
 
 namespace hyperlogloglog {
   /**
    * Zstd-compressed Basic HyperLogLog. The template parameter Word
    * determines the word type and length (that is, the length of the
    * hashes).
+   *
+   * The registers are compressed and decompressed with contexts that
+   * are created once per thread and shared by all the sketches of the
+   * thread, instead of the fresh context per call of the one-shot
+   * functions.
+   *
+   * The registers are split into blocks of blockSize registers, each
+   * compressed into a frame of its own and with a lower bound of its
+   * own on the register values. An update touches a single block, and
+   * the whole-sketch operations decompress one block at a time.
+   *
+   * The sketch is either sealed, holding only the compressed
+   * registers, or open, holding decompressed registers as well. An
+   * update opens the sketch, decompresses its block unless it already
+   * is, and is written to the decompressed registers only, so an open
+   * sketch can be dirty; reading a block that is not decompressed
+   * uses a buffer of the thread instead. The dirty blocks are
+   * recompressed (flushed) by flush(), by seal(), which also closes
+   * the sketch, and after every maxDirty register updates if maxDirty
+   * is nonzero. The const members never write to the sketch, so a
+   * shared sketch can be read from several threads.
+   *
+   * Sketches can share a ZstdDictionary by reference; the registers
+   * are then compressed against the dictionary.
+   *
+   * A failing Zstd call throws std::runtime_error with the Zstd error
+   * name.
    */
   template<typename Word = uint64_t>
   class HyperLogLogZstd {
@@ -16,20 +45,126 @@ namespace hyperlogloglog {
     /**
      * Basic constructor
      * m : the number of registers
+     * cacheEstimate : if true, the harmonic sum and the number of zero
+     *                 registers are maintained on every update, making
+     *                 estimate() O(1) without decompressing the sketch
+     * level : the Zstd compression level
+     * maxDirty : the number of register updates after which an open
+     *            sketch is flushed (0: only flush when asked to)
+     * dictionary : the dictionary to compress with (null: none); its
+     *              level must equal level
+     * blockSize : the number of registers per block (0: a single block)
      */
-    explicit HyperLogLogZstd(int m) :
-      m(m), logM(log2i(m)), compressedSize(0),
-      Mcompressed(ZSTD_compressBound(m)), Mtemp(m,0) {
-      compress();
+    explicit HyperLogLogZstd(int m, bool cacheEstimate = false, int level = 1,
+                             size_t maxDirty = 0,
+                             std::shared_ptr<const ZstdDictionary> dictionary
+                             = nullptr, int blockSize = 0) :
+      m(m), logM(log2i(m)), level(level),
+      blockSize(blockSize > 0 ? std::min(blockSize, m) : m),
+      numBlocks((m + this->blockSize - 1) / this->blockSize),
+      windowLog(windowLogFor(this->blockSize)), maxDirty(maxDirty),
+      dictionary(std::move(dictionary)), dirtyBlocks(numBlocks, true),
+      Mcompressed(numBlocks), lowerBounds(numBlocks, 0), Mtemp(m,0),
+      openBlocks(numBlocks, true), cacheEstimate(cacheEstimate) {
+      if (cacheEstimate)
+        aggregates.emplace(m);
+      ZSTD_bounds bounds = ZSTD_cParam_getBounds(ZSTD_c_compressionLevel);
+      if (level < bounds.lowerBound || level > bounds.upperBound)
+        throw std::invalid_argument("Invalid compression level");
+      if (this->dictionary && this->dictionary->getLevel() != level)
+        throw std::invalid_argument("Mismatch in the compression level of the dictionary");
+      if (blockSize < 0)
+        throw std::invalid_argument("The block size must not be negative");
+      flush();
     }
 
-    
+
 
     /**
-     * Returns the size of the sketch (the number of bits)
+     * Returns the size of the compressed sketch (the number of bits)
+     * as of a flush. The dirty blocks are compressed into a buffer of
+     * the thread for their size only; flush() stores them.
      */
     inline size_t bitSize() const {
-      return compressedSize * CHAR_BIT;
+      size_t bytes = 0;
+      for (int b = 0; b < numBlocks; ++b)
+        bytes += dirtyBlocks[b] ? compressBlock(b) : Mcompressed[b].size();
+      return bytes * CHAR_BIT;
+    }
+
+
+
+    /**
+     * Returns the number of bits presently allocated for the sketch,
+     * including the decompressed registers of an open sketch and the
+     * cached aggregates
+     */
+    inline size_t allocatedBits() const {
+      size_t bytes = Mtemp.capacity();
+      for (const std::vector<char>& frame : Mcompressed)
+        bytes += frame.capacity();
+      return bytes * CHAR_BIT + aggregates.allocatedBits();
+    }
+
+
+
+    /**
+     * Returns the largest number of bits allocated for the sketch at
+     * any one time
+     */
+    inline size_t peakResidentBits() const {
+      return peakBits;
+    }
+
+
+
+    /**
+     * Compresses the dirty blocks. The sketch stays open.
+     */
+    void flush() {
+      for (int b = 0; b < numBlocks; ++b)
+        if (dirtyBlocks[b])
+          compress(b);
+      dirty = 0;
+    }
+
+
+
+    /**
+     * Flushes the pending updates and releases the decompressed
+     * registers. The registers are not changed.
+     */
+    void seal() {
+      flush();
+      std::vector<char>().swap(Mtemp);
+      std::fill(openBlocks.begin(), openBlocks.end(), false);
+    }
+
+
+
+    /**
+     * Returns true if the decompressed registers are present
+     */
+    inline bool isOpen() const {
+      return !Mtemp.empty();
+    }
+
+
+
+    /**
+     * Returns the number of register updates not yet compressed
+     */
+    inline size_t dirtyCount() const {
+      return dirty;
+    }
+
+
+
+    /**
+     * Returns the number of registers per block
+     */
+    inline int getBlockSize() const {
+      return blockSize;
     }
 
 
@@ -39,7 +174,8 @@ namespace hyperlogloglog {
      */
     template<typename Object,
              typename XHashFun = decltype(farmhash<Object>),
-             typename JHashFun = decltype(fibonacciHash<Word>)>
+             typename JHashFun = decltype(fibonacciHash<Word>),
+             typename = std::enable_if_t<std::is_invocable_v<XHashFun, const Object&>>>
     inline void add(const Object& o, XHashFun h = farmhash<Object>,
                     JHashFun f = fibonacciHash<Word>) {
       static_assert(std::is_same<decltype(h(o)),Word>::value,
@@ -49,6 +185,16 @@ namespace hyperlogloglog {
 
 
 
+    /**
+     * Adds the len bytes at data to the sketch without copying them.
+     * Equivalent to adding std::string(data, len).
+     */
+    inline void add(const char* data, size_t len) {
+      add(std::string_view(data, len));
+    }
+
+
+
     /**
      * Adds a new hash to the sketch. Potentially useful if a
      * different kind of hashing scheme is used outside the class.
@@ -69,25 +215,52 @@ namespace hyperlogloglog {
      * r must satisfy 0 <= r < log(word length) (64 for uint64_t) but no checks are made
      */
     inline void addJr(Word j, Word r) {
-      if (r < lowerBound)
-        return;
-      
-      decompress();
-      Word r0 = Mtemp[j];
-      if (r > r0) {
-        Mtemp[j] = r;
-        compress();
-      }
+      if (update(j, r))
+        touch(1);
+    }
+
+
+
+    /**
+     * Adds the n objects of the array to the sketch. The sketch is
+     * flushed at most once per call.
+     */
+    template<typename Object,
+             typename XHashFun = decltype(farmhash<Object>),
+             typename JHashFun = decltype(fibonacciHash<Word>)>
+    void addBatch(const Object* objects, size_t n,
+                  XHashFun h = farmhash<Object>,
+                  JHashFun f = fibonacciHash<Word>) {
+      size_t changed = 0;
+      forEachHashBatch<Word>(h, objects, n, [&](const Word* hashes, size_t k) {
+        changed += updateHashes(hashes, k, f);
+      });
+      touch(changed);
+    }
+
+
+
+    /**
+     * Adds the n hashes of the array to the sketch. The sketch is
+     * flushed at most once per call.
+     */
+    template<typename JHashFun = decltype(fibonacciHash<Word>)>
+    void addHashes(const Word* hashes, size_t n,
+                   JHashFun f = fibonacciHash<Word>) {
+      touch(updateHashes(hashes, n, f));
     }
-    
+
 
 
     /**
      * Returns a vector that contains the register values
      */
     std::vector<uint8_t> exportRegisters() const {
-      decompress();
-      return std::vector<uint8_t>(Mtemp.begin(), Mtemp.begin() + m);
+      std::vector<uint8_t> v(m);
+      iterateBlocks([&](int j0, const char* block, int n) {
+          std::copy(block, block + n, v.begin() + j0);
+        });
+      return v;
     }
 
 
@@ -96,24 +269,14 @@ namespace hyperlogloglog {
      * Returns the present estimate
      */
     double estimate() const {
-      decompress();
-      double E = 0;
-      int V = 0;
-      for (int j = 0; j < m; ++j) {
-        Word r = Mtemp[j];
-        V += (r == 0);
-        E += 1.0 / (1ull << r);
-      }
-      E = HyperLogLog<Word>::alpha(m) * m * m / E;
-      if (E <= 5.0 / 2.0 * m && V != 0) {
-        return m*log(static_cast<double>(m)/V);
-      }
-      else if (E <= (1ull << 32)/30) {
-        return E;
-      }
-      else {
-        return -(1ll << 32) * log(1-E/(1ll << 32));
-      }
+      if (cacheEstimate)
+        return HyperLogLog<Word>::estimate(m, aggregates->value(),
+                                           aggregates->zeros());
+      RegisterHistogram<Word> h;
+      iterateBlocks([&](int, const char* block, int n) {
+          h.add(reinterpret_cast<const uint8_t*>(block), n);
+        });
+      return HyperLogLog<Word>::estimate(m, h);
     }
 
 
@@ -127,38 +290,315 @@ namespace hyperlogloglog {
     HyperLogLogZstd merge(const HyperLogLogZstd& that) const {
       if (m != that.m)
         throw std::invalid_argument("Mismatch in the number of registers");
-      HyperLogLogZstd H(m);
-      decompress();
-      that.decompress();
-      for (int j = 0; j < m; ++j)
-        H.Mtemp[j] = std::max(Mtemp[j], that.Mtemp[j]);
-      H.compress();
+      HyperLogLogZstd H(m, cacheEstimate, level, maxDirty, dictionary,
+                        blockSize);
+      iterateBlocks([&](int j0, const char* block, int n) {
+          std::copy(block, block + n, H.Mtemp.begin() + j0);
+        });
+      that.iterateBlocks([&](int j0, const char* block, int n) {
+          for (int j = 0; j < n; ++j)
+            H.Mtemp[j0 + j] = std::max(H.Mtemp[j0 + j], block[j]);
+        });
+      if (cacheEstimate)
+        for (int j = 0; j < m; ++j)
+          H.aggregates->update(0, H.Mtemp[j]);
+      std::fill(H.dirtyBlocks.begin(), H.dirtyBlocks.end(), true);
+      H.touch(m);
       return H;
     }
 
 
-    
+    /**
+     * Merges the other sketch into this one in place. The sketch is
+     * flushed at most once.
+     */
+    void mergeInto(const HyperLogLogZstd& that) {
+      if (m != that.m)
+        throw std::invalid_argument("Mismatch in the number of registers");
+      for (int b = 0; b < numBlocks; ++b)
+        openBlock(b);
+      size_t changed = 0;
+      that.iterateBlocks([&](int j0, const char* block, int n) {
+          for (int j = 0; j < n; ++j) {
+            if (block[j] > Mtemp[j0 + j]) {
+              if (cacheEstimate)
+                aggregates->update(Mtemp[j0 + j], block[j]);
+              Mtemp[j0 + j] = block[j];
+              dirtyBlocks[(j0 + j) / blockSize] = true;
+              ++changed;
+            }
+          }
+        });
+      touch(changed);
+    }
+
+
+
+    /**
+     * Same as mergeInto
+     */
+    HyperLogLogZstd& operator|=(const HyperLogLogZstd& that) {
+      mergeInto(that);
+      return *this;
+    }
+
+
+
+    /**
+     * Returns the compression level
+     */
+    inline int getLevel() const {
+      return level;
+    }
+
+
+
+    /**
+     * Returns the dictionary (null if there is none)
+     */
+    inline const std::shared_ptr<const ZstdDictionary>& getDictionary() const {
+      return dictionary;
+    }
+
+
+
   private:
-    void decompress() const {
-      ZSTD_decompress(&Mtemp[0], Mtemp.size(), &Mcompressed[0], compressedSize);
+    /**
+     * Raises register j to r, decompressing its block first if needed.
+     * Returns true if the register changed.
+     */
+    inline bool update(Word j, Word r) {
+      // rho of the hashes 0 and 1 exceeds the register range; saturate it
+      r = std::min(r, VALUE_MASK);
+      int b = j / blockSize;
+      if (r < lowerBounds[b])
+        return false;
+      openBlock(b);
+      Word r0 = Mtemp[j];
+      if (r <= r0)
+        return false;
+      Mtemp[j] = r;
+      dirtyBlocks[b] = true;
+      if (cacheEstimate)
+        aggregates->update(r0, r);
+      return true;
+    }
+
+
+
+    /**
+     * Updates the decompressed registers with the hashes. Returns the
+     * number of changed registers.
+     */
+    template<typename JHashFun>
+    size_t updateHashes(const Word* hashes, size_t n, JHashFun f) {
+      static_assert(std::is_same<decltype(f(*hashes,logM)),Word>::value,
+                    "Hash function type does not match the Word type of the class");
+      size_t changed = 0;
+      for (size_t i = 0; i < n; ++i)
+        changed += update(f(hashes[i], logM), rho(hashes[i]));
+      return changed;
+    }
+
+
+
+    /**
+     * Records k register updates, and flushes the sketch if maxDirty
+     * updates have accumulated
+     */
+    void touch(size_t k) {
+      dirty += k;
+      if (maxDirty > 0 && dirty >= maxDirty)
+        flush();
+    }
+
+
+
+    /**
+     * Decompresses block b into the decompressed registers unless it
+     * already is
+     */
+    void openBlock(int b) {
+      if (openBlocks[b])
+        return;
+      if (Mtemp.empty())
+        Mtemp.resize(m);
+      int j0 = b * blockSize;
+      decompress(b, &Mtemp[j0], std::min(blockSize, m - j0));
+      openBlocks[b] = true;
+      peakBits = std::max(peakBits, allocatedBits());
+    }
+
+
+
+    /**
+     * Applies the function to the (j0, registers, n) triples of the
+     * blocks in order, where registers holds the values of the
+     * registers j0, ..., j0+n-1. A block that is not decompressed is
+     * decompressed into a buffer of the thread, which is reused for
+     * the next block.
+     */
+    template<typename Fun>
+    void iterateBlocks(Fun f) const {
+      thread_local std::vector<char> buffer;
+      if (buffer.size() < static_cast<size_t>(blockSize))
+        buffer.resize(blockSize);
+      for (int b = 0; b < numBlocks; ++b) {
+        int j0 = b * blockSize;
+        int n = std::min(blockSize, m - j0);
+        if (openBlocks[b]) {
+          f(j0, &Mtemp[j0], n);
+        }
+        else {
+          decompress(b, &buffer[0], n);
+          f(j0, &buffer[0], n);
+        }
+      }
+    }
+
+
+
+    /**
+     * Returns the smallest window that covers n registers
+     */
+    static int windowLogFor(int n) {
+      int windowLog = ZSTD_cParam_getBounds(ZSTD_c_windowLog).lowerBound;
+      while ((1 << windowLog) < n)
+        ++windowLog;
+      return windowLog;
+    }
+
+
+
+    /**
+     * Returns a buffer of the calling thread that can hold the
+     * compressed registers of a block of n registers
+     */
+    static std::vector<char>& compressionBuffer(int n) {
+      thread_local std::vector<char> buffer;
+      if (buffer.size() < ZSTD_compressBound(n))
+        buffer.resize(ZSTD_compressBound(n));
+      return buffer;
+    }
+
+
+
+    /**
+     * Returns the compression context of the calling thread
+     */
+    static ZSTD_CCtx* compressionContext() {
+      thread_local std::unique_ptr<ZSTD_CCtx, size_t(*)(ZSTD_CCtx*)>
+        cctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+      if (!cctx)
+        throw std::runtime_error("Cannot create a Zstd compression context");
+      return cctx.get();
+    }
+
+
+
+    /**
+     * Returns the decompression context of the calling thread
+     */
+    static ZSTD_DCtx* decompressionContext() {
+      thread_local std::unique_ptr<ZSTD_DCtx, size_t(*)(ZSTD_DCtx*)>
+        dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+      if (!dctx)
+        throw std::runtime_error("Cannot create a Zstd decompression context");
+      return dctx.get();
+    }
+
+
+
+    /**
+     * Returns the result of a Zstd call, or throws if it is an error
+     * code
+     */
+    static size_t checkZstd(size_t result) {
+      if (ZSTD_isError(result))
+        throw std::runtime_error(ZSTD_getErrorName(result));
+      return result;
+    }
+
+
+
+    /**
+     * Decompresses the n registers of block b into out
+     */
+    void decompress(int b, char* out, int n) const {
+      const std::vector<char>& frame = Mcompressed[b];
+      size_t decompressedSize = checkZstd(dictionary ?
+        ZSTD_decompress_usingDDict(decompressionContext(), out, n,
+                                   frame.data(), frame.size(),
+                                   dictionary->decompressionDictionary()) :
+        ZSTD_decompressDCtx(decompressionContext(), out, n,
+                            frame.data(), frame.size()));
+      if (decompressedSize != static_cast<size_t>(n))
+        throw std::runtime_error("Truncated compressed block");
     }
 
-    void compress() {
-      compressedSize = ZSTD_compress(&Mcompressed[0], Mcompressed.size(),
-                                     &Mtemp[0], m, 1);
-      lowerBound = sizeof(Word)*CHAR_BIT;
-      for (Word Mj : Mtemp)
-        if (Mj < lowerBound)
-          lowerBound = Mj;
+
+    /**
+     * Compresses the decompressed registers of block b into the
+     * compression buffer of the thread. Returns the size of the frame.
+     */
+    size_t compressBlock(int b) const {
+      // the parameters are sticky, but the context may have been used
+      // by a sketch with other parameters in between (a dictionary
+      // brings its own parameters)
+      ZSTD_CCtx* cctx = compressionContext();
+      checkZstd(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level));
+      checkZstd(ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, windowLog));
+      checkZstd(ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 0));
+      int j0 = b * blockSize;
+      int n = std::min(blockSize, m - j0);
+      std::vector<char>& buffer = compressionBuffer(n);
+      return checkZstd(dictionary ?
+        ZSTD_compress_usingCDict(cctx, &buffer[0], buffer.size(), &Mtemp[j0], n,
+                                 dictionary->compressionDictionary()) :
+        ZSTD_compress2(cctx, &buffer[0], buffer.size(), &Mtemp[j0], n));
     }
 
-    
+
+
+    /**
+     * Compresses the decompressed registers of block b into a buffer
+     * of the exact size of the frame
+     */
+    void compress(int b) {
+      size_t compressedSize = compressBlock(b);
+      int j0 = b * blockSize;
+      int n = std::min(blockSize, m - j0);
+      std::vector<char>& buffer = compressionBuffer(n);
+      std::vector<char>& frame = Mcompressed[b];
+      frame.assign(buffer.begin(), buffer.begin() + compressedSize);
+      frame.shrink_to_fit();
+      dirtyBlocks[b] = false;
+      lowerBounds[b] = *std::min_element(&Mtemp[j0], &Mtemp[j0] + n);
+      peakBits = std::max(peakBits, allocatedBits());
+    }
+
+
+    static constexpr Word VALUE_MASK = sizeof(Word)*CHAR_BIT - 1;
+
     int m;
     int logM; // register address length
-    size_t compressedSize;
-    std::vector<char> Mcompressed;
-    mutable std::vector<char> Mtemp;
-    Word lowerBound = 0;
+    int level; // compression level
+    int blockSize; // registers per block
+    int numBlocks;
+    int windowLog;
+    size_t maxDirty; // flush after this many updates (0: never)
+    std::shared_ptr<const ZstdDictionary> dictionary;
+    size_t dirty = 0; // updates not yet compressed
+    std::vector<bool> dirtyBlocks; // blocks not yet compressed
+    size_t peakBits = 0; // largest allocatedBits() so far
+    // exactly the compressed frame of each block
+    std::vector<std::vector<char>> Mcompressed;
+    // lower bounds on the registers of each block as of its compression
+    std::vector<uint8_t> lowerBounds;
+    std::vector<char> Mtemp; // decompressed registers; empty if sealed
+    std::vector<bool> openBlocks; // blocks decompressed into Mtemp
+    bool cacheEstimate;
+    HeapOptional<HarmonicSum<Word>> aggregates; // only if cacheEstimate
   };
 }
 
@@ -0,0 +1,152 @@
+#ifndef HYPERLOGLOGLOG_INPUT_FORMAT
+#define HYPERLOGLOGLOG_INPUT_FORMAT
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+namespace hyperlogloglog {
+  /**
+   * Header of the versioned binary input container written by
+   * inputgenerator and read by measure. The header is followed by
+   * count records of the datatype, stored in the byte order given by
+   * endianness, as are the multibyte fields of the header itself. The
+   * header is 24 bytes so that the records of a memory-mapped file
+   * stay 8-byte aligned.
+   *
+   * The legacy raw format is the bare records in big-endian order.
+   */
+  struct InputHeader {
+    static constexpr char MAGIC[4] = { 'H', 'L', 'L', 'I' };
+    static const uint8_t VERSION = 1;
+
+    enum Endianness : uint8_t { LITTLE = 0, BIG = 1 };
+    enum Datatype : uint8_t { UINT64 = 0, STR = 1, JR = 2, PREHASHED = 3 };
+    enum Hash : uint8_t { HASH_NONE = 0, HASH_FARMHASH = 1, HASH_XXH64 = 2 };
+
+    char magic[4];
+    uint8_t version;
+    uint8_t endianness;
+    uint8_t datatype;
+    uint8_t hash; // the hash function of prehashed records
+    uint32_t len; // the length of str records
+    uint32_t reserved;
+    uint64_t count; // the number of records
+
+    /**
+     * Returns the byte order of the machine
+     */
+    static constexpr Endianness native() {
+      return __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ ? BIG : LITTLE;
+    }
+  };
+  static_assert(sizeof(InputHeader) == 24);
+
+
+
+  /**
+   * Converts a value of the given byte order into the native byte
+   * order. The conversion is its own inverse, so it also converts
+   * native values into the given byte order for writing.
+   */
+  inline uint64_t toNative(uint64_t x, bool bigEndian) {
+    return bigEndian == (InputHeader::native() == InputHeader::BIG) ?
+      x : __builtin_bswap64(x);
+  }
+
+  inline uint32_t toNative(uint32_t x, bool bigEndian) {
+    return bigEndian == (InputHeader::native() == InputHeader::BIG) ?
+      x : __builtin_bswap32(x);
+  }
+
+
+
+  /**
+   * Converts between the datatype names used on the command line and
+   * the header values. Throws std::invalid_argument on unknown names.
+   */
+  inline InputHeader::Datatype parseDatatype(const std::string& name) {
+    if (name == "uint64")
+      return InputHeader::UINT64;
+    if (name == "str" || name == "strview")
+      return InputHeader::STR;
+    if (name == "jr")
+      return InputHeader::JR;
+    if (name == "prehashed")
+      return InputHeader::PREHASHED;
+    throw std::invalid_argument("Unknown datatype " + name);
+  }
+
+  inline InputHeader::Hash parseHash(const std::string& name) {
+    if (name == "none")
+      return InputHeader::HASH_NONE;
+    if (name == "farmhash")
+      return InputHeader::HASH_FARMHASH;
+    if (name == "xxh64")
+      return InputHeader::HASH_XXH64;
+    throw std::invalid_argument("Unknown hash function " + name);
+  }
+
+  inline std::string hashName(InputHeader::Hash hash) {
+    switch (hash) {
+    case InputHeader::HASH_NONE:
+      return "none";
+    case InputHeader::HASH_FARMHASH:
+      return "farmhash";
+    case InputHeader::HASH_XXH64:
+      return "xxh64";
+    }
+    throw std::invalid_argument("Unknown hash function " +
+                                std::to_string(hash));
+  }
+
+
+
+  /**
+   * Writes the header; its multibyte fields are stored in the byte
+   * order given by header.endianness
+   */
+  inline void writeInputHeader(std::ostream& os, InputHeader header) {
+    memcpy(header.magic, InputHeader::MAGIC, sizeof(header.magic));
+    header.version = InputHeader::VERSION;
+    header.reserved = 0;
+    if (header.endianness != InputHeader::native()) {
+      header.len = __builtin_bswap32(header.len);
+      header.count = __builtin_bswap64(header.count);
+    }
+    os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  }
+
+
+
+  /**
+   * Reads a header and converts its fields into the native byte
+   * order. Throws std::runtime_error if the input does not start with
+   * a valid header.
+   */
+  inline InputHeader readInputHeader(std::istream& is) {
+    InputHeader header;
+    if (!is.read(reinterpret_cast<char*>(&header), sizeof(header)))
+      throw std::runtime_error("Truncated input header");
+    if (memcmp(header.magic, InputHeader::MAGIC, sizeof(header.magic)) != 0)
+      throw std::runtime_error("Input does not start with a header");
+    if (header.version != InputHeader::VERSION)
+      throw std::runtime_error("Unsupported input format version " +
+                               std::to_string(header.version));
+    if (header.endianness != InputHeader::LITTLE &&
+        header.endianness != InputHeader::BIG)
+      throw std::runtime_error("Invalid byte order in input header");
+    if (header.endianness != InputHeader::native()) {
+      header.len = __builtin_bswap32(header.len);
+      header.count = __builtin_bswap64(header.count);
+    }
+    if (header.datatype == InputHeader::STR && header.len == 0)
+      throw std::runtime_error("Zero string length in input header");
+    return header;
+  }
+}
+
+#endif // HYPERLOGLOGLOG_INPUT_FORMAT
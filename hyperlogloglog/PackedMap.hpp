@@ -71,27 +71,53 @@ namespace hyperlogloglog {
 
 
 
+    /**
+     * Returns the index of the first key that is not smaller than the
+     * given key (or size() if there is no such key)
+     */
+    size_t lowerBound(Word key) const {
+      size_t l = 0;
+      size_t r = size();
+      while (l < r) {
+        size_t m = (l+r)/2;
+        if (keyAt(m) < key)
+          l = m+1;
+        else
+          r = m;
+      }
+      return l;
+    }
+
+
+
     /**
      * Adds a new key-value pair. If the key is already in the data
-     * structure, its value will be replaced. Otherwise, the data
-     * structure the pair will be added as a new element to the data
-     * structure using insertion sort like addition.
+     * structure, its value will be replaced. Otherwise, the pair will
+     * be inserted at its sorted position, shifting the larger keys in
+     * the underlying packed vector.
      */
     void add(Word key, Word value) {
-      int i = find(key);
+      size_t i = lowerBound(key);
       Word kv;
       packElement(kv, key, value);
-      if (i >= 0)
-        arr.set(i, kv);
-      else {
-        arr.append(kv);
-        i = size()-1;
-        while (i > 0 && keyAt(i-1) > key) {
-          arr.set(i,arr.get(i-1));
-          --i;
-        }
+      if (i < size() && keyAt(i) == key)
         arr.set(i, kv);
-      }
+      else
+        arr.insert(i, kv);
+    }
+
+
+
+    /**
+     * Appends a new key-value pair to the end of the array. The key
+     * must be larger than any key presently stored, but no checks are
+     * made.
+     */
+    void append(Word key, Word value) {
+      assert(size() == 0 || keyAt(size()-1) < key);
+      Word kv;
+      packElement(kv, key, value);
+      arr.append(kv);
     }
 
 
@@ -124,7 +150,65 @@ namespace hyperlogloglog {
     inline size_t bitSize() const {
       return arr.bitSize();
     }
-    
+
+
+
+    /**
+     * Returns the number of bits allocated for the internal array
+     */
+    inline size_t allocatedBits() const {
+      return arr.allocatedBits();
+    }
+
+
+
+    /**
+     * Makes sure that at least n key/value pairs can be stored
+     * without reallocation
+     */
+    inline void reserve(size_t n) {
+      arr.reserve(n);
+    }
+
+
+
+    /**
+     * Releases the unused capacity of the internal array
+     */
+    inline void shrink_to_fit() {
+      arr.shrink_to_fit();
+    }
+
+
+
+    /**
+     * Returns the number of bytes written by toBytes
+     */
+    inline size_t byteSize() const {
+      return arr.byteSize();
+    }
+
+
+
+    /**
+     * Writes the packed key/value pairs into out as byteSize() bytes
+     * (see PackedVector::toBytes)
+     */
+    inline void toBytes(uint8_t* out) const {
+      arr.toBytes(out);
+    }
+
+
+
+    /**
+     * Replaces the contents with count key/value pairs read from the
+     * byte string written by toBytes. The keys must be in increasing
+     * order, but no checks are made.
+     */
+    inline void fromBytes(const uint8_t* in, size_t count) {
+      arr.fromBytes(in, count);
+    }
+
     
     
   private:
@@ -8,6 +8,9 @@
 #include <iostream>
 #include <cassert>
 #include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include "BitPacking.hpp"
 
 static_assert(CHAR_BIT == 8);
 
@@ -19,12 +22,18 @@ namespace hyperlogloglog {
    * elements can cross word boundaries.
    *
    * This enable space-efficient but time-inefficient storage.
+   *
+   * If ElemBits is nonzero, the element size is fixed at compile
+   * time, so get/set need no runtime size or mask fields and, if
+   * ElemBits divides the word length, no word crossing checks at
+   * all. Otherwise the element size is given at construction.
    */
-  template<typename Word = uint64_t>
+  template<typename Word = uint64_t, size_t ElemBits = 0>
   class PackedVector {
   public:
     /**
-     * elemSize : size of an individual element in bits
+     * elemSize : size of an individual element in bits (must equal
+     *            ElemBits if ElemBits is nonzero)
      * initialSize : how many zero elements to store in the array initially
      */
     explicit PackedVector(size_t elemSize, size_t initialSize = 0) :
@@ -34,6 +43,8 @@ namespace hyperlogloglog {
       capacity_((initialSize*elemSize +
                  WORD_BITS-1) / WORD_BITS)
     {
+      if (ElemBits > 0 && elemSize != ElemBits)
+        throw std::invalid_argument("element size does not match ElemBits");
       if (capacity_ > 0) {
         arr = new Word[capacity_];
         memset(arr, 0, sizeof(Word)*capacity_);
@@ -53,6 +64,7 @@ namespace hyperlogloglog {
       std::swap(a.size_, b.size_);
       std::swap(a.arr, b.arr);
       std::swap(a.capacity_, b.capacity_);
+      std::swap(a.growthFactor, b.growthFactor);
     }
 
 
@@ -61,7 +73,8 @@ namespace hyperlogloglog {
       elemMask(that.elemMask),
       size_(that.size_),
       arr(new Word[that.capacity_]),
-      capacity_(that.capacity_)
+      capacity_(that.capacity_),
+      growthFactor(that.growthFactor)
     {
       memcpy(arr, that.arr, sizeof(Word)*capacity_);
     }
@@ -103,10 +116,32 @@ namespace hyperlogloglog {
 
 
 
+    /**
+     * Returns the number of bits allocated for the underlying array
+     * (at least bitSize())
+     */
+    inline size_t allocatedBits() const {
+      return capacity_ * WORD_BITS;
+    }
+
+
+
+    /**
+     * Hints the processor to fetch the word holding the ith element
+     * into the cache for writing
+     */
+    inline void prefetch(size_t i) const {
+      __builtin_prefetch(&arr[i*elemSize/WORD_BITS], 1);
+    }
+
+
+
     /**
      * Returns the ith element
      */
     Word get(size_t i) const {
+      if constexpr (ElemBits > 0)
+        return getFixed(i);
       size_t firstBit = i*elemSize;      
       const Word* w = &arr[firstBit/WORD_BITS];
       firstBit %= WORD_BITS;
@@ -128,6 +163,10 @@ namespace hyperlogloglog {
      * Sets the ith element
      */
     void set(size_t i, Word e) {
+      if constexpr (ElemBits > 0) {
+        setFixed(i, e);
+        return;
+      }
       e &= elemMask;
       size_t firstBit = i*elemSize;
       Word* w = &arr[firstBit/WORD_BITS];
@@ -155,8 +194,8 @@ namespace hyperlogloglog {
      */
     void insert(size_t i, Word e) {
       append(0);
-      for (int j = static_cast<int>(size()) - 2; j >= static_cast<int>(i); --j) 
-        set(j+1,get(j));
+      if (i + 1 < size())
+        shiftBitsUp(i*elemSize, (size()-1)*elemSize);
       set(i,e);
     }
 
@@ -168,8 +207,8 @@ namespace hyperlogloglog {
      * the underlying array size.
      */
     void erase(size_t i) {
-      for (size_t j = i+1; j < size(); ++j)
-        set(j-1,get(j));
+      if (i + 1 < size())
+        shiftBitsDown(i*elemSize, size()*elemSize);
       --size_;
     }
     
@@ -197,37 +236,349 @@ namespace hyperlogloglog {
 
     /**
      * Add a new element to the end of the array, potentially
-     * increasing its size.
+     * increasing its size. The underlying array grows geometrically
+     * by the growth factor, so appends take amortized constant time.
      */
     void append(Word e) {
       size_t i = size_++;
-      if (capacity_ == 0) {
-        assert(arr == nullptr);
-        arr = new Word[++capacity_];
-        arr[0] = 0;        
-      }
-      else if (size_ * elemSize > WORD_BITS * capacity_) {
+      if (size_ * elemSize > WORD_BITS * capacity_) {
         /* increase array size */
-        Word* newArr = new Word[capacity_+1];
-        memcpy(newArr, arr, sizeof(Word)*capacity_);
-        delete[] arr;
-        arr = newArr;
-        arr[capacity_] = 0;
-        ++capacity_;
+        size_t newCapacity = static_cast<size_t>(capacity_ * growthFactor);
+        reallocate(std::max(newCapacity, capacity_ + 1));
       }
       set(i,e);
     }
 
+
+
+    /**
+     * Makes sure that at least n elements can be stored without
+     * reallocation.
+     */
+    void reserve(size_t n) {
+      size_t newCapacity = (n*elemSize + WORD_BITS - 1) / WORD_BITS;
+      if (newCapacity > capacity_)
+        reallocate(newCapacity);
+    }
+
+
+
+    /**
+     * Releases the unused part of the underlying array, leaving only
+     * as many words as are needed to store the present elements.
+     */
+    void shrink_to_fit() {
+      size_t newCapacity = (size_*elemSize + WORD_BITS - 1) / WORD_BITS;
+      if (newCapacity < capacity_)
+        reallocate(newCapacity);
+    }
+
+
+
+    /**
+     * Decodes count elements starting from the element first into
+     * out, one element per byte. The element size must be at most 8
+     * bits. Uses the vectorized kernels of BitPacking.hpp when
+     * available.
+     */
+    void unpack(uint8_t* out, size_t first, size_t count) const {
+      assert(elemSize <= 8);
+      assert(first + count <= size());
+      size_t done = std::min(count, (8 - first % 8) % 8);
+      unpackScalar(out, first, done);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      if (bitpacking::haveKernel(elemSize) && done < count) {
+        size_t firstByte = (first + done) * elemSize / CHAR_BIT;
+        done += bitpacking::unpack(elemSize,
+                                   reinterpret_cast<const uint8_t*>(arr) +
+                                   firstByte,
+                                   capacity_*sizeof(Word) - firstByte,
+                                   out + done, count - done);
+      }
+#endif
+      unpackScalar(out + done, first + done, count - done);
+    }
+
+
+
+    /**
+     * Encodes count elements from in (one element per byte) into the
+     * vector starting from the element first. The values are
+     * truncated to the element size, which must be at most 8 bits.
+     * Uses the vectorized kernels of BitPacking.hpp when available.
+     */
+    void pack(const uint8_t* in, size_t first, size_t count) {
+      assert(elemSize <= 8);
+      assert(first + count <= size());
+      size_t done = std::min(count, (8 - first % 8) % 8);
+      packScalar(in, first, done);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      if (bitpacking::haveKernel(elemSize) && done < count) {
+        size_t firstByte = (first + done) * elemSize / CHAR_BIT;
+        done += bitpacking::pack(elemSize, in + done, count - done,
+                                 reinterpret_cast<uint8_t*>(arr) + firstByte,
+                                 (count - done) * elemSize / CHAR_BIT);
+      }
+#endif
+      packScalar(in + done, first + done, count - done);
+    }
+
+
+
+    /**
+     * Returns the number of bytes written by toBytes (bitSize()
+     * rounded up to whole bytes)
+     */
+    inline size_t byteSize() const {
+      return (bitSize() + CHAR_BIT - 1) / CHAR_BIT;
+    }
+
+
+
+    /**
+     * Writes the elements into out as byteSize() bytes. The element i
+     * occupies the bits [i*elemSize, (i+1)*elemSize) of the byte
+     * string, counting from the least significant bit of the first
+     * byte, regardless of the byte order of the machine. The unused
+     * high bits of the last byte are zero.
+     */
+    void toBytes(uint8_t* out) const {
+      size_t n = byteSize();
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      if (n > 0)
+        memcpy(out, arr, n);
+#else
+      for (size_t i = 0; i < n; ++i)
+        out[i] = arr[i / sizeof(Word)] >> (i % sizeof(Word) * CHAR_BIT);
+#endif
+      if (bitSize() % CHAR_BIT != 0)
+        out[n-1] &= (1u << bitSize() % CHAR_BIT) - 1;
+    }
+
+
+
+    /**
+     * Replaces the contents with count elements read from the
+     * byte string written by toBytes, copying the words as they are
+     * on little-endian machines. The underlying array is allocated to
+     * the exact size; the unused high bits of the last byte are
+     * ignored.
+     */
+    void fromBytes(const uint8_t* in, size_t count) {
+      PackedVector v(elemSize, count);
+      v.growthFactor = growthFactor;
+      size_t n = v.byteSize();
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      if (n > 0)
+        memcpy(v.arr, in, n);
+#else
+      for (size_t i = 0; i < n; ++i)
+        v.arr[i / sizeof(Word)] |=
+          static_cast<Word>(in[i]) << (i % sizeof(Word) * CHAR_BIT);
+#endif
+      if (v.bitSize() % WORD_BITS != 0)
+        v.arr[v.capacity_-1] &=
+          (static_cast<Word>(1) << v.bitSize() % WORD_BITS) - 1;
+      swap(*this, v);
+    }
+
+
+
+    /**
+     * Sets the factor by which the underlying array is grown when an
+     * append runs out of capacity. A factor of 1 grows the array by
+     * one word at a time.
+     */
+    void setGrowthFactor(double factor) {
+      if (!(factor >= 1.0))
+        throw std::invalid_argument("growth factor must be at least 1");
+      growthFactor = factor;
+    }
+
+
+
+    /**
+     * Returns the growth factor
+     */
+    double getGrowthFactor() const {
+      return growthFactor;
+    }
+
     
 
   private:
     static const size_t WORD_BITS = sizeof(Word)*CHAR_BIT;
+    static constexpr Word FIXED_MASK = ElemBits > 0 ?
+      ~(~static_cast<Word>(0) << ElemBits) : 0;
+    static_assert(ElemBits < WORD_BITS,
+                  "ElemBits must be smaller than the word length");
+    
+
+
+    /**
+     * get() for a compile-time element size. The word crossing test
+     * is compiled away if ElemBits divides the word length; otherwise
+     * it is a well-predicted branch (a branch-free variant that always
+     * loads two words measured slower).
+     */
+    inline Word getFixed(size_t i) const {
+      size_t firstBit = i*ElemBits;
+      const Word* w = &arr[firstBit/WORD_BITS];
+      size_t offset = firstBit % WORD_BITS;
+      if (WORD_BITS % ElemBits == 0 || offset + ElemBits <= WORD_BITS)
+        return (w[0] >> offset) & FIXED_MASK;
+      return ((w[0] >> offset) | (w[1] << (WORD_BITS - offset))) &
+        FIXED_MASK;
+    }
+
+
+
+    /**
+     * set() for a compile-time element size
+     */
+    inline void setFixed(size_t i, Word e) {
+      e &= FIXED_MASK;
+      size_t firstBit = i*ElemBits;
+      Word* w = &arr[firstBit/WORD_BITS];
+      size_t offset = firstBit % WORD_BITS;
+      w[0] = (w[0] & ~(FIXED_MASK << offset)) | (e << offset);
+      if (WORD_BITS % ElemBits != 0 && offset + ElemBits > WORD_BITS) {
+        size_t numBits = WORD_BITS - offset;
+        w[1] = (w[1] & ~(FIXED_MASK >> numBits)) | (e >> numBits);
+      }
+    }
+
+
+    
+    /**
+     * Portable unpack(): streams through the words, shifting out one
+     * element at a time
+     */
+    void unpackScalar(uint8_t* out, size_t first, size_t count) const {
+      if (count == 0)
+        return;
+      const size_t k = elemSize;
+      size_t firstBit = first*k;
+      const Word* w = &arr[firstBit/WORD_BITS];
+      size_t avail = WORD_BITS - firstBit % WORD_BITS;
+      Word cur = *w >> (firstBit % WORD_BITS);
+      for (size_t i = 0; i < count; ++i) {
+        if (avail >= k) {
+          out[i] = cur & elemMask;
+          cur >>= k;
+          avail -= k;
+        }
+        else {
+          Word next = *++w;
+          out[i] = (cur | (next << avail)) & elemMask;
+          cur = next >> (k - avail);
+          avail = WORD_BITS - (k - avail);
+        }
+      }
+    }
+
+
+
+    /**
+     * Portable pack(): assembles whole words in an accumulator,
+     * preserving the bits outside the range in the first and last
+     * word
+     */
+    void packScalar(const uint8_t* in, size_t first, size_t count) {
+      if (count == 0)
+        return;
+      const size_t k = elemSize;
+      size_t firstBit = first*k;
+      Word* w = &arr[firstBit/WORD_BITS];
+      size_t used = firstBit % WORD_BITS;
+      Word acc = *w & ((static_cast<Word>(1) << used) - 1);
+      for (size_t i = 0; i < count; ++i) {
+        Word e = in[i] & elemMask;
+        acc |= e << used;
+        used += k;
+        if (used >= WORD_BITS) {
+          *w++ = acc;
+          used -= WORD_BITS;
+          acc = used > 0 ? e >> (k - used) : 0;
+        }
+      }
+      if (used > 0) {
+        Word lowMask = (static_cast<Word>(1) << used) - 1;
+        *w = (*w & ~lowMask) | acc;
+      }
+    }
+
+
+
+    /**
+     * Moves the bits in the range [firstBit, endBit) up by elemSize
+     * bits a word at a time, funnel-shifting across word
+     * boundaries. The bits below firstBit are left intact, and the
+     * vacated bits [firstBit, firstBit + elemSize) are left
+     * unspecified. The array must have room for endBit + elemSize
+     * bits.
+     */
+    void shiftBitsUp(size_t firstBit, size_t endBit) {
+      assert(0 < elemSize && elemSize < WORD_BITS);
+      const size_t k = elemSize;
+      size_t first = firstBit / WORD_BITS;
+      size_t last = (endBit + k - 1) / WORD_BITS;
+      Word lowMask = (static_cast<Word>(1) << (firstBit % WORD_BITS)) - 1;
+      for (size_t w = last; w > first; --w)
+        arr[w] = (arr[w] << k) | (arr[w-1] >> (WORD_BITS - k));
+      arr[first] = (arr[first] & lowMask) | ((arr[first] << k) & ~lowMask);
+    }
+
+
+
+    /**
+     * Moves the bits in the range [firstBit + elemSize, endBit) down
+     * by elemSize bits a word at a time, overwriting the bits
+     * [firstBit, firstBit + elemSize). The bits below firstBit are
+     * left intact.
+     */
+    void shiftBitsDown(size_t firstBit, size_t endBit) {
+      assert(0 < elemSize && elemSize < WORD_BITS);
+      const size_t k = elemSize;
+      size_t first = firstBit / WORD_BITS;
+      size_t last = (endBit - 1) / WORD_BITS;
+      Word lowMask = (static_cast<Word>(1) << (firstBit % WORD_BITS)) - 1;
+      Word low = arr[first] & lowMask;
+      for (size_t w = first; w <= last; ++w) {
+        Word next = w + 1 < capacity_ ? arr[w+1] : 0;
+        arr[w] = (arr[w] >> k) | (next << (WORD_BITS - k));
+      }
+      arr[first] = low | (arr[first] & ~lowMask);
+    }
+
+
+    
+    /**
+     * Moves the contents into a new underlying array of newCapacity
+     * words; the words not covered by the old array are zeroed.
+     */
+    void reallocate(size_t newCapacity) {
+      Word* newArr = nullptr;
+      if (newCapacity > 0) {
+        newArr = new Word[newCapacity];
+        size_t n = std::min(capacity_, newCapacity);
+        if (n > 0)
+          memcpy(newArr, arr, sizeof(Word)*n);
+        memset(newArr + n, 0, sizeof(Word)*(newCapacity - n));
+      }
+      delete[] arr;
+      arr = newArr;
+      capacity_ = newCapacity;
+    }
+
+
     
-    size_t elemSize = 0;
-    Word elemMask = 0;    
+    size_t elemSize = ElemBits;
+    Word elemMask = FIXED_MASK;
     size_t size_ = 0; // number of logical bit elements stored in arr
     Word* arr = nullptr;
     size_t capacity_ = 0; // number of elements in arr
+    double growthFactor = 2.0; // capacity multiplier when appending
   };
 }
 
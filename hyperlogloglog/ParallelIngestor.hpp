@@ -0,0 +1,157 @@
+#ifndef HYPERLOGLOGLOG_PARALLEL_INGESTOR
+#define HYPERLOGLOGLOG_PARALLEL_INGESTOR
+
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace hyperlogloglog {
+  /**
+   * Adds elements to a sketch from several threads. Each thread owns
+   * a shard, a sketch of the same type and parameters, and an input
+   * range is split into contiguous slices, one per shard. The shards
+   * are merged into a single sketch by result(), which can be called
+   * at any point between ingestions. As the union of sketches does not
+   * depend on how the elements were distributed, the result has
+   * exactly the same registers as a single sketch fed with all the
+   * elements.
+   *
+   * Sketch can be any of the sketch classes (anything that is copyable
+   * and provides addBatch, addHashes and mergeInto).
+   */
+  template<typename Sketch>
+  class ParallelIngestor {
+  public:
+    /**
+     * prototype : an empty sketch whose copies serve as the shards
+     * numThreads : the number of threads (and shards)
+     */
+    ParallelIngestor(const Sketch& prototype, int numThreads) :
+      shards(checkThreads(numThreads), prototype) {
+    }
+
+
+
+    /**
+     * Adds the n objects of the array, each thread calling
+     * addBatch(slice, length, args...) on its shard
+     */
+    template<typename Object, typename... Args>
+    void addBatch(const Object* objects, size_t n, Args... args) {
+      ingest(n, [=](Sketch& shard, size_t i0, size_t i1) {
+        shard.addBatch(objects + i0, i1 - i0, args...);
+      });
+    }
+
+
+
+    /**
+     * Adds the n hashes of the array, each thread calling
+     * addHashes(slice, length, args...) on its shard
+     */
+    template<typename Word, typename... Args>
+    void addHashes(const Word* hashes, size_t n, Args... args) {
+      ingest(n, [=](Sketch& shard, size_t i0, size_t i1) {
+        shard.addHashes(hashes + i0, i1 - i0, args...);
+      });
+    }
+
+
+
+    /**
+     * Splits the index range [0, n) into one contiguous slice per
+     * shard and calls f(shard, i0, i1) for each slice [i0, i1) in its
+     * own thread (the last slice is processed by the calling thread).
+     * Returns when all slices have been processed. If f throws, or a
+     * thread cannot be started, the exception is rethrown once all the
+     * started threads have finished (the first one by shard if several
+     * slices fail).
+     */
+    template<typename F>
+    void ingest(size_t n, F f) {
+      size_t numShards = shards.size();
+      std::vector<std::exception_ptr> errors(numShards);
+      auto work = [&](size_t t) {
+        try {
+          f(shards[t], n * t / numShards, n * (t + 1) / numShards);
+        }
+        catch (...) {
+          errors[t] = std::current_exception();
+        }
+      };
+      {
+        std::vector<std::thread> threads;
+        JoinGuard guard(threads);
+        threads.reserve(numShards - 1);
+        for (size_t t = 0; t + 1 < numShards; ++t)
+          threads.emplace_back(work, t);
+        work(numShards - 1);
+      }
+      for (std::exception_ptr& error : errors)
+        if (error)
+          std::rethrow_exception(error);
+    }
+
+
+
+    /**
+     * Returns the union of the shards
+     */
+    Sketch result() const {
+      Sketch S = shards[0];
+      for (size_t t = 1; t < shards.size(); ++t)
+        S.mergeInto(shards[t]);
+      return S;
+    }
+
+
+
+    /**
+     * Returns the number of shards
+     */
+    inline int numShards() const {
+      return shards.size();
+    }
+
+
+
+    /**
+     * Returns the shard of thread t
+     */
+    inline const Sketch& shard(int t) const {
+      return shards[t];
+    }
+
+  private:
+    /**
+     * Joins the threads of the vector on destruction, so that none is
+     * left running when an exception leaves the scope
+     */
+    class JoinGuard {
+    public:
+      JoinGuard(std::vector<std::thread>& threads) : threads(threads) { }
+
+      ~JoinGuard() {
+        for (std::thread& thread : threads)
+          thread.join();
+      }
+
+    private:
+      std::vector<std::thread>& threads;
+    };
+
+    
+    
+    static int checkThreads(int numThreads) {
+      if (numThreads < 1)
+        throw std::invalid_argument("The number of threads must be positive");
+      return numThreads;
+    }
+
+    std::vector<Sketch> shards;
+  };
+}
+
+#endif // HYPERLOGLOGLOG_PARALLEL_INGESTOR
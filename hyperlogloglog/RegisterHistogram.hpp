@@ -0,0 +1,326 @@
+#ifndef HYPERLOGLOGLOG_REGISTER_HISTOGRAM
+#define HYPERLOGLOGLOG_REGISTER_HISTOGRAM
+
+#include <cstdint>
+#include <cstddef>
+#include <climits>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HYPERLOGLOGLOG_HAVE_SIMD_HISTOGRAM
+#include <immintrin.h>
+#endif
+
+namespace hyperlogloglog {
+  __extension__ typedef unsigned __int128 FixedPoint;
+
+  /**
+   * Running aggregates of the estimator: the harmonic sum
+   * sum_j 2^-M[j] as a fixed-point integer with w fractional bits (w
+   * being the word length), and the number of zero registers. Since
+   * every term is exactly representable, updating the aggregates
+   * register by register gives exactly the same sum as recomputing
+   * it, with no floating-point drift.
+   */
+  template<typename Word = uint64_t>
+  class HarmonicSum {
+  public:
+    static const int FRACTION_BITS = sizeof(Word)*CHAR_BIT;
+
+    /**
+     * m : the number of registers (all initially zero)
+     */
+    explicit HarmonicSum(size_t m = 0) :
+      sum(static_cast<FixedPoint>(m) << FRACTION_BITS), zeros_(m) { }
+
+
+
+    /**
+     * Accounts for a register changing its value from r0 to r
+     */
+    inline void update(int r0, int r) {
+      sum = sum - term(r0) + term(r);
+      zeros_ += (r == 0) - (r0 == 0);
+    }
+
+
+
+    /**
+     * Returns the harmonic sum
+     */
+    inline double value() const {
+      return toDouble(sum);
+    }
+
+
+
+    /**
+     * Returns the number of zero-valued registers
+     */
+    inline size_t zeros() const {
+      return zeros_;
+    }
+
+
+
+    /**
+     * Returns 2^-r in fixed point
+     */
+    static inline FixedPoint term(int r) {
+      return static_cast<FixedPoint>(1) << (FRACTION_BITS - r);
+    }
+
+
+
+    /**
+     * Converts a fixed-point value into a double
+     */
+    static inline double toDouble(FixedPoint x) {
+      return std::ldexp(static_cast<double>(x), -FRACTION_BITS);
+    }
+
+  private:
+    FixedPoint sum;
+    size_t zeros_;
+  };
+
+
+
+  /**
+   * Histogram of register values. The estimators only depend on the
+   * harmonic sum sum_j 2^-M[j] and the number of zero registers, and
+   * both are functions of the histogram: the sum is computed in O(w)
+   * time (w being the word length) in the fixed-point format of
+   * HarmonicSum. As the counts are integers, the result does not
+   * depend on the order in which the registers were counted, so all
+   * sketch types obtain bit-identical estimates from the same
+   * registers, whether recomputed or maintained incrementally.
+   */
+  template<typename Word = uint64_t>
+  class RegisterHistogram {
+  public:
+    static const int NUM_VALUES = sizeof(Word)*CHAR_BIT;
+
+    RegisterHistogram() : counts() { }
+
+
+
+    /**
+     * Counts the n register values in the block
+     */
+    void add(const uint8_t* values, size_t n) {
+      // four interleaved sub-histograms break the dependency between
+      // consecutive increments of the same counter
+      uint16_t sub[3][NUM_VALUES] = { };
+      size_t i = 0;
+      while (i < n) {
+        size_t end = std::min(n, i + 0xffff);
+        for (; i + 4 <= end; i += 4) {
+          ++counts[values[i]];
+          ++sub[0][values[i+1]];
+          ++sub[1][values[i+2]];
+          ++sub[2][values[i+3]];
+        }
+        for (; i < end; ++i)
+          ++counts[values[i]];
+        for (int r = 0; r < NUM_VALUES; ++r) {
+          counts[r] += sub[0][r] + sub[1][r] + sub[2][r];
+          sub[0][r] = sub[1][r] = sub[2][r] = 0;
+        }
+      }
+    }
+
+
+
+    /**
+     * Counts the n register values in the array using vector compares
+     * where available: the range of the values is found first, and
+     * each value in the range is then counted with a compare and a
+     * popcount per vector. As the registers of a sketch fall into a
+     * narrow range, this beats add for arrays of more than a few
+     * hundred registers.
+     */
+    void addVectorized(const uint8_t* values, size_t n);
+
+
+
+    /**
+     * Adds the counts of the other histogram to this one
+     */
+    void add(const RegisterHistogram& that) {
+      for (int r = 0; r < NUM_VALUES; ++r)
+        counts[r] += that.counts[r];
+    }
+
+
+
+    /**
+     * Counts n more registers with the value r (0 <= r < NUM_VALUES)
+     */
+    inline void increment(int r, size_t n = 1) {
+      assert(0 <= r && r < NUM_VALUES);
+      counts[r] += n;
+    }
+
+
+
+    /**
+     * Accounts for a register changing its value from r0 to r; both
+     * must lie in [0, NUM_VALUES)
+     */
+    inline void update(int r0, int r) {
+      assert(0 <= r0 && r0 < NUM_VALUES);
+      assert(0 <= r && r < NUM_VALUES);
+      --counts[r0];
+      ++counts[r];
+    }
+
+
+
+    /**
+     * Returns the number of registers with the value r
+     */
+    inline size_t count(int r) const {
+      return counts[r];
+    }
+
+
+
+    /**
+     * Returns the number of zero-valued registers
+     */
+    inline size_t zeros() const {
+      return count(0);
+    }
+
+
+
+    /**
+     * Returns the harmonic sum sum_j 2^-M[j]
+     */
+    double harmonicSum() const {
+      FixedPoint E = 0;
+      for (int r = 0; r < NUM_VALUES; ++r)
+        E += counts[r] * HarmonicSum<Word>::term(r);
+      return HarmonicSum<Word>::toDouble(E);
+    }
+
+
+
+  private:
+    uint32_t counts[NUM_VALUES];
+  };
+
+
+
+  /**
+   * Kernels of RegisterHistogram::addVectorized. Each kernel counts a
+   * prefix of the input into counts and returns its length; the
+   * caller counts the rest with scalar code.
+   */
+  namespace histogram {
+#ifdef HYPERLOGLOGLOG_HAVE_SIMD_HISTOGRAM
+    inline bool haveAvx2() {
+      static const bool avx2 = []() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+      }();
+      return avx2;
+    }
+
+
+
+    inline bool haveAvx512() {
+      static const bool avx512 = []() {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512f") != 0 &&
+          __builtin_cpu_supports("avx512bw") != 0;
+      }();
+      return avx512;
+    }
+
+
+
+    __attribute__((target("avx2,popcnt")))
+    inline size_t avx2(const uint8_t* values, size_t n, size_t* counts) {
+      size_t k = n / 32 * 32;
+      if (k == 0)
+        return 0;
+      __m256i lo = _mm256_set1_epi8(-1);
+      __m256i hi = _mm256_setzero_si256();
+      for (size_t i = 0; i < k; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i));
+        lo = _mm256_min_epu8(lo, x);
+        hi = _mm256_max_epu8(hi, x);
+      }
+      alignas(32) uint8_t los[32];
+      alignas(32) uint8_t his[32];
+      _mm256_store_si256(reinterpret_cast<__m256i*>(los), lo);
+      _mm256_store_si256(reinterpret_cast<__m256i*>(his), hi);
+      int vMin = *std::min_element(los, los + 32);
+      int vMax = *std::max_element(his, his + 32);
+      for (int v = vMin; v <= vMax; ++v) {
+        __m256i vs = _mm256_set1_epi8(v);
+        size_t c = 0;
+        for (size_t i = 0; i < k; i += 32) {
+          __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i));
+          c += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, vs)));
+        }
+        counts[v] += c;
+      }
+      return k;
+    }
+
+
+
+    __attribute__((target("avx512f,avx512bw,popcnt")))
+    inline size_t avx512(const uint8_t* values, size_t n, size_t* counts) {
+      size_t k = n / 64 * 64;
+      if (k == 0)
+        return 0;
+      __m512i lo = _mm512_set1_epi8(-1);
+      __m512i hi = _mm512_setzero_si512();
+      for (size_t i = 0; i < k; i += 64) {
+        __m512i x = _mm512_loadu_si512(values + i);
+        lo = _mm512_min_epu8(lo, x);
+        hi = _mm512_max_epu8(hi, x);
+      }
+      alignas(64) uint8_t los[64];
+      alignas(64) uint8_t his[64];
+      _mm512_store_si512(los, lo);
+      _mm512_store_si512(his, hi);
+      int vMin = *std::min_element(los, los + 64);
+      int vMax = *std::max_element(his, his + 64);
+      for (int v = vMin; v <= vMax; ++v) {
+        __m512i vs = _mm512_set1_epi8(v);
+        size_t c = 0;
+        for (size_t i = 0; i < k; i += 64)
+          c += __builtin_popcountll(_mm512_cmpeq_epi8_mask(_mm512_loadu_si512(values + i), vs));
+        counts[v] += c;
+      }
+      return k;
+    }
+#endif // HYPERLOGLOGLOG_HAVE_SIMD_HISTOGRAM
+  }
+
+
+
+  template<typename Word>
+  void RegisterHistogram<Word>::addVectorized(const uint8_t* values, size_t n) {
+    size_t done = 0;
+#ifdef HYPERLOGLOGLOG_HAVE_SIMD_HISTOGRAM
+    size_t c[256] = { };
+    if (histogram::haveAvx512())
+      done = histogram::avx512(values, n, c);
+    else if (histogram::haveAvx2())
+      done = histogram::avx2(values, n, c);
+    for (int r = 0; r < NUM_VALUES; ++r)
+      counts[r] += c[r];
+#endif
+    add(values + done, n - done);
+  }
+}
+
+#endif // HYPERLOGLOGLOG_REGISTER_HISTOGRAM
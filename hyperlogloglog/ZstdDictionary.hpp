@@ -0,0 +1,106 @@
+#ifndef HYPERLOGLOGLOG_ZSTD_DICTIONARY
+#define HYPERLOGLOGLOG_ZSTD_DICTIONARY
+
+#ifndef ZSTD_STATIC_LINKING_ONLY
+#define ZSTD_STATIC_LINKING_ONLY // for the raw-content dictionaries
+#endif
+#include <zstd/zstd.h>
+#include <climits>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace hyperlogloglog {
+  /**
+   * A Zstd dictionary for compressing the registers of
+   * HyperLogLogZstd sketches. The dictionary is raw content, that is,
+   * the compressor may refer to any of its bytes as if they preceded
+   * the registers, so register arrays that look like those of the
+   * sketches make good dictionaries. Both the compression and the
+   * decompression dictionary are digested once, and any number of
+   * sketches can refer to the same dictionary.
+   */
+  class ZstdDictionary {
+  public:
+    /**
+     * content : the raw content of the dictionary
+     * level : the compression level of the sketches using the dictionary
+     * sizeHint : the typical size of the compressed registers (0: unknown)
+     */
+    explicit ZstdDictionary(const std::vector<char>& content, int level = 1,
+                            size_t sizeHint = 0) :
+      level(level), size(content.size()),
+      cdict(ZSTD_createCDict_advanced(content.data(), content.size(),
+                                      ZSTD_dlm_byCopy, ZSTD_dct_rawContent,
+                                      ZSTD_getCParams(level, sizeHint,
+                                                      content.size()),
+                                      ZSTD_defaultCMem),
+            ZSTD_freeCDict),
+      ddict(ZSTD_createDDict_advanced(content.data(), content.size(),
+                                      ZSTD_dlm_byCopy, ZSTD_dct_rawContent,
+                                      ZSTD_defaultCMem),
+            ZSTD_freeDDict) {
+      if (!cdict || !ddict)
+        throw std::invalid_argument("Invalid dictionary");
+    }
+
+
+
+    /**
+     * Builds a dictionary from the register arrays of sample sketches
+     * (as returned by exportRegisters). The samples are concatenated
+     * up to maxSize bytes; the first ones end up last, that is,
+     * closest to the compressed registers.
+     */
+    static std::shared_ptr<ZstdDictionary>
+    fromSamples(const std::vector<std::vector<uint8_t>>& samples,
+                int level = 1, size_t maxSize = 1 << 17) {
+      std::vector<char> content;
+      for (auto it = samples.rbegin(); it != samples.rend(); ++it)
+        content.insert(content.end(), it->begin(), it->end());
+      if (content.size() > maxSize)
+        content.erase(content.begin(), content.end() - maxSize);
+      size_t sizeHint = samples.empty() ? 0 : samples[0].size();
+      return std::make_shared<ZstdDictionary>(content, level, sizeHint);
+    }
+
+
+
+    /**
+     * Returns the compression level
+     */
+    inline int getLevel() const {
+      return level;
+    }
+
+
+
+    /**
+     * Returns the size of the content (the number of bits)
+     */
+    inline size_t bitSize() const {
+      return size * CHAR_BIT;
+    }
+
+
+
+    inline const ZSTD_CDict* compressionDictionary() const {
+      return cdict.get();
+    }
+
+
+
+    inline const ZSTD_DDict* decompressionDictionary() const {
+      return ddict.get();
+    }
+
+  private:
+    int level;
+    size_t size;
+    std::unique_ptr<ZSTD_CDict, size_t(*)(ZSTD_CDict*)> cdict;
+    std::unique_ptr<ZSTD_DDict, size_t(*)(ZSTD_DDict*)> ddict;
+  };
+}
+
+#endif // HYPERLOGLOGLOG_ZSTD_DICTIONARY
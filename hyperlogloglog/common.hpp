@@ -2,25 +2,29 @@
 #define HYPERLOGLOGLOG_COMMON
 
 #include <arpa/inet.h>
+#include <climits>
 #include <cstdint>
+#include <memory>
 
 namespace hyperlogloglog {
+  // the builtins are undefined for zero, which clz maps to the word
+  // length (a single lzcnt where the target has one)
   template<typename T>
   inline int clz(T x);
 
   template<>
   inline int clz(unsigned int x) {
-    return __builtin_clz(x);
+    return x ? __builtin_clz(x) : sizeof(x)*CHAR_BIT;
   }
 
   template<>
   inline int clz(unsigned long x) {
-    return __builtin_clzl(x);
+    return x ? __builtin_clzl(x) : sizeof(x)*CHAR_BIT;
   }
 
   template<>
   inline int clz(unsigned long long x) {
-    return __builtin_clzll(x);
+    return x ? __builtin_clzll(x) : sizeof(x)*CHAR_BIT;
   }
 
   template<typename T>
@@ -35,6 +39,102 @@ namespace hyperlogloglog {
 
 
 
+  // number of registers decoded at a time when sweeping over a sketch
+  constexpr int REGISTER_BLOCK_SIZE = 256;
+
+  // number of elements hashed at a time by the batch adds, so that
+  // the register words can be prefetched well before they are updated
+  constexpr int HASH_BATCH_SIZE = 64;
+
+
+
+  /**
+   * An optional value that is allocated on the heap when present, so
+   * that an absent one only costs a pointer. Copies are deep. As with
+   * std::unique_ptr, an absent value must not be dereferenced.
+   */
+  template<typename T>
+  class HeapOptional {
+  public:
+    HeapOptional() = default;
+
+    HeapOptional(const HeapOptional& that) :
+      p(that.p ? std::make_unique<T>(*that.p) : nullptr) { }
+
+    HeapOptional(HeapOptional&&) = default;
+
+    HeapOptional& operator=(const HeapOptional& that) {
+      if (p && that.p)
+        *p = *that.p;
+      else
+        p = that.p ? std::make_unique<T>(*that.p) : nullptr;
+      return *this;
+    }
+
+    HeapOptional& operator=(HeapOptional&&) = default;
+
+
+
+    /**
+     * Constructs the value from the arguments, replacing the present
+     * one if any
+     */
+    template<typename... Args>
+    T& emplace(Args&&... args) {
+      p = std::make_unique<T>(std::forward<Args>(args)...);
+      return *p;
+    }
+
+
+
+    /**
+     * Destroys the value
+     */
+    inline void reset() {
+      p.reset();
+    }
+
+
+
+    /**
+     * Returns true if the value is present
+     */
+    inline explicit operator bool() const {
+      return p != nullptr;
+    }
+
+    inline T& operator*() {
+      return *p;
+    }
+
+    inline const T& operator*() const {
+      return *p;
+    }
+
+    inline T* operator->() {
+      return p.get();
+    }
+
+    inline const T* operator->() const {
+      return p.get();
+    }
+
+
+
+    /**
+     * Returns the number of bits allocated for the value (0 if it is
+     * absent)
+     */
+    inline size_t allocatedBits() const {
+      return p ? sizeof(T) * CHAR_BIT : 0;
+    }
+
+  private:
+    std::unique_ptr<T> p;
+  };
+
+
+
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 #ifndef htonll // MacOS X defines this as a macro
     inline uint64_t htonll(uint64_t x) {
@@ -1,8 +1,13 @@
 #include "measure.hpp"
 #include "HyperLogLogZstd.hpp"
 #include "HyperLogLogLog.hpp"
+#include "ParallelIngestor.hpp"
+#include "ConcurrentHyperLogLog.hpp"
+#include "HyperLogLog8.hpp"
 #include <tclap/CmdLine.h>
 #include <memory>
+#include <fstream>
+#include <random>
 
 using std::chrono::duration_cast;
 using std::chrono::nanoseconds;
@@ -13,6 +18,7 @@ using std::make_pair;
 using std::pair;
 using std::vector;
 using std::string;
+using std::string_view;
 using std::cerr;
 using std::cout;
 using std::endl;
@@ -31,12 +37,30 @@ class Hasher {
 public:
   explicit Hasher(int m) : m(m) { }
   
-  template<typename T>
-  void add(const T& o) {
-    uint64_t x = hyperlogloglog::farmhash<T>(o);
+  template<typename T, typename XHashFun>
+  void add(const T& o, XHashFun h) {
+    uint64_t x = h(o);
     M = hyperlogloglog::fibonacciHash<uint64_t>(x,m);
   }
 
+  template<typename T, typename XHashFun>
+  void addBatch(const T* objects, size_t n, XHashFun h) {
+    hyperlogloglog::forEachHashBatch<uint64_t>(h, objects, n,
+                                               [this](const uint64_t* hashes,
+                                                      size_t k) {
+      addHashes(hashes, k);
+    });
+  }
+
+  void addHash(uint64_t x) {
+    M = hyperlogloglog::fibonacciHash<uint64_t>(x,m);
+  }
+
+  void addHashes(const uint64_t* hashes, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+      M = hyperlogloglog::fibonacciHash<uint64_t>(hashes[i],m);
+  }
+
   void addJr(int, int) {
     assert(false && "this is an unsupported operation");
   }
@@ -45,6 +69,10 @@ public:
     assert(false && "this is an unsupported operation");
     return Hasher(1);
   }
+
+  void mergeInto(const Hasher&) {
+    assert(false && "this is an unsupported operation");
+  }
   
   static uint64_t M; // to prevent code deletion
   int m;
@@ -53,40 +81,88 @@ uint64_t Hasher::M = 0;
 
 
 
-template<typename T>
-static void adds(T& h, vector<string>::const_iterator begin, vector<string>::const_iterator end) {
-  for (auto it = begin; it != end; ++it)
-    h.add(*it);
+/**
+ * Options that modify how the measurements are made
+ */
+struct Options {
+  int flags; // flags for hyperlogloglog
+  int merges; // number of sketches to merge in merge mode
+  bool inPlace; // merge with mergeInto instead of merge
+  size_t batch; // number of elements per addBatch call (0: add one by one)
+  string hash; // hash function for the elements (farmhash or xxh64)
+  size_t chunk; // records per chunk when streaming (0: read everything first)
+  string input; // file to map instead of reading stdin (empty: stdin)
+  bool bigEndian; // byte order of the integers in the input
+  size_t offset; // number of header bytes preceding the records
+  int threads; // number of ingestion threads (0: a single sketch, no merge)
+  bool sparse; // start hyperloglog and hyperlogloglog in the sparse representation
+  int level; // compression level of hyperloglogzstd
+  size_t maxDirty; // register updates between flushes of hyperloglogzstd
+  std::shared_ptr<const ZstdDictionary> dictionary; // of hyperloglogzstd (null: none)
+  int blockSize; // registers per compressed block of hyperloglogzstd (0: m)
+};
+
+
+
+template<typename T, typename Object, typename XHashFun>
+static void adds(T& h, const Object* begin, const Object* end, size_t batch,
+                 XHashFun hash) {
+  if (batch == 0) {
+    for (const Object* it = begin; it != end; ++it)
+      h.add(*it, hash);
+  }
+  else {
+    for (const Object* it = begin; it < end; it += batch)
+      h.addBatch(it, std::min<size_t>(batch, end - it), hash);
+  }
 }
 
-template<typename T>
-static void adds(T& h, vector<uint64_t>::const_iterator begin, vector<uint64_t>::const_iterator end) {
-  for (auto it = begin; it != end; ++it)
-    h.add(*it);
+template<typename T, typename Object>
+static void adds(T& h, const Object* begin, const Object* end,
+                 const Options& opts) {
+  if (opts.hash == "xxh64")
+    adds(h, begin, end, opts.batch, hyperlogloglog::xxh64<Object>);
+  else
+    adds(h, begin, end, opts.batch, hyperlogloglog::farmhash<Object>);
 }
 
 template<typename T>
-static void adds(T& h, vector<pair<int,int>>::const_iterator begin, vector<pair<int,int>>::const_iterator end) {
-  for (auto it = begin; it != end; ++it)
-    h.addJr(it->first, it->second);
+static void adds(T& h, const NetworkUint64* begin, const NetworkUint64* end,
+                 const Options& opts) {
+  if (opts.hash == "xxh64")
+    adds(h, begin, end, opts.batch, [](const NetworkUint64& x) {
+      return hyperlogloglog::xxh64<uint64_t>(x.value());
+    });
+  else
+    adds(h, begin, end, opts.batch, [](const NetworkUint64& x) {
+      return hyperlogloglog::farmhash<uint64_t>(x.value());
+    });
 }
 
 template<typename T>
-static void adds(T& h, const vector<string>& v) {
-  for (const string& o : v)
-    h.add(o);
+static void adds(T& h, const Prehashed* begin, const Prehashed* end,
+                 const Options& opts) {
+  if (opts.batch == 0) {
+    for (const Prehashed* it = begin; it != end; ++it)
+      h.addHash(it->value);
+  }
+  else {
+    for (const Prehashed* it = begin; it < end; it += opts.batch)
+      h.addHashes(reinterpret_cast<const uint64_t*>(it),
+                  std::min<size_t>(opts.batch, end - it));
+  }
 }
 
 template<typename T>
-static void adds(T& h, const vector<uint64_t>& v) {
-  for (const uint64_t& o : v)
-    h.add(o);
+static void adds(T& h, const pair<int,int>* begin, const pair<int,int>* end,
+                 const Options&) {
+  for (auto it = begin; it != end; ++it)
+    h.addJr(it->first, it->second);
 }
 
-template<typename T>
-static void adds(T& h, const vector<pair<int,int>>& v) {
-  for (const pair<int,int>& o : v)
-    h.addJr(o.first, o.second);
+template<typename T, typename Object>
+static void adds(T& h, const vector<Object>& v, const Options& opts) {
+  adds(h, v.data(), v.data() + v.size(), opts);
 }
 
 
@@ -131,13 +207,90 @@ size_t getBitsize(Hasher&) {
   return 0;
 }
 
+template<typename T>
+static size_t getAllocatedBits(T& H) {
+  return H.bitSize();
+}
+
+template<>
+size_t getAllocatedBits(HyperLogLog<uint64_t>& H) {
+  return H.allocatedBits();
+}
+
+template<>
+size_t getAllocatedBits(HyperLogLog8<uint64_t>& H) {
+  return H.allocatedBits();
+}
+
+template<>
+size_t getAllocatedBits(HyperLogLogLog<uint64_t,3>& H) {
+  return H.allocatedBits();
+}
+
+template<>
+size_t getAllocatedBits(HyperLogLogZstd<uint64_t>& H) {
+  return H.allocatedBits();
+}
+
+template<typename T>
+static size_t getPeakResidentBits(T& H) {
+  return getAllocatedBits(H);
+}
+
+template<>
+size_t getPeakResidentBits(HyperLogLogZstd<uint64_t>& H) {
+  return H.peakResidentBits();
+}
+
+template<typename T>
+static size_t getDictionaryBits(T&) {
+  return 0;
+}
+
+template<>
+size_t getDictionaryBits(HyperLogLogZstd<uint64_t>& H) {
+  return H.getDictionary() ? H.getDictionary()->bitSize() : 0;
+}
+
+/**
+ * Returns the size of the serialized sketch (the number of bits), or 0
+ * if the sketch has no serialization format
+ */
+template<typename T>
+static size_t getSerializedBits(T&) {
+  return 0;
+}
+
+template<>
+size_t getSerializedBits(HyperLogLogLog<uint64_t,3>& H) {
+  return H.serialize(true).size() * CHAR_BIT;
+}
+
+/**
+ * Completes the pending work of the sketch, so that it is included in
+ * the measured time
+ */
+template<typename T>
+static void seal(T&) {
+}
+
+template<>
+void seal(HyperLogLogZstd<uint64_t>& H) {
+  H.seal();
+}
+
+template<>
+size_t getAllocatedBits(Hasher&) {
+  return 0;
+}
+
 template<typename T>
 static int getCompressCount(T&) {
   return 0;
 }
 
 template<>
-int getCompressCount(HyperLogLogLog<uint64_t>& H) {
+int getCompressCount(HyperLogLogLog<uint64_t,3>& H) {
   return H.getCompressCount();
 }
 
@@ -147,77 +300,168 @@ static int getRebaseCount(T&) {
 }
 
 template<>
-int getRebaseCount(HyperLogLogLog<uint64_t>& H) {
+int getRebaseCount(HyperLogLogLog<uint64_t,3>& H) {
   return H.getRebaseCount();
 }
 
+template<typename T>
+static int getScanCount(T&) {
+  return 0;
+}
+
+template<>
+int getScanCount(HyperLogLogLog<uint64_t,3>& H) {
+  return H.getScanCount();
+}
+
 template<typename T>
 void report(double seconds, T& H) {
   double estimate = getEstimate(H);
   size_t bitsize = getBitsize(H);
+  size_t allocatedBits = getAllocatedBits(H);
+  size_t peakResidentBits = getPeakResidentBits(H);
+  size_t dictionaryBits = getDictionaryBits(H);
+  size_t serializedBits = getSerializedBits(H);
   int compressCount = getCompressCount(H);
   int rebaseCount = getRebaseCount(H);
+  int scanCount = getScanCount(H);
   
   fprintf(stdout, "time %g\n", seconds);
   fprintf(stdout, "estimate %f\n", estimate);
   fprintf(stdout, "bitsize %zu\n", bitsize);
+  fprintf(stdout, "allocatedBits %zu\n", allocatedBits);
+  fprintf(stdout, "peakResidentBits %zu\n", peakResidentBits);
+  fprintf(stdout, "dictionaryBits %zu\n", dictionaryBits);
+  fprintf(stdout, "serializedBits %zu\n", serializedBits);
   fprintf(stdout, "compressCount %d\n", compressCount);
   fprintf(stdout, "rebaseCount %d\n", rebaseCount);
+  fprintf(stdout, "scanCount %d\n", scanCount);
+}
+
+
+
+/**
+ * Returns the registers of a sketch with m registers after n distinct
+ * elements, drawn from the Poissonized register distribution: a
+ * register is at most r with probability exp(-n/m 2^-r). Takes O(m)
+ * time regardless of n.
+ */
+static vector<uint8_t> sampleRegisters(int m, size_t n, std::mt19937_64& rng) {
+  std::uniform_real_distribution<double> dist(0, 1);
+  vector<uint8_t> registers(m);
+  for (uint8_t& r : registers) {
+    double u = dist(rng);
+    double x = std::log2(static_cast<double>(n) / m / -std::log(u));
+    r = std::max(0.0, std::min(63.0, std::ceil(x)));
+  }
+  return registers;
+}
+
+
+
+/**
+ * Builds a dictionary for hyperloglogzstd from the registers of the
+ * given number of sample sketches of m registers and n elements
+ */
+static std::shared_ptr<const ZstdDictionary>
+buildDictionary(int samples, int m, size_t n, int level) {
+  std::mt19937_64 rng(0x5eed);
+  vector<vector<uint8_t>> registers;
+  for (int i = 0; i < samples; ++i)
+    registers.push_back(sampleRegisters(m, n, rng));
+  return ZstdDictionary::fromSamples(registers, level);
 }
 
 
 
 template<typename AlgorithmType>
-static unique_ptr<AlgorithmType> constructImplementation(int m, int flags);
+static unique_ptr<AlgorithmType> constructImplementation(int m, const Options& opts);
 
 template<>
-unique_ptr<HyperLogLog<uint64_t>> constructImplementation(int m, int) {
-  return make_unique<HyperLogLog<uint64_t>>(m);
+unique_ptr<HyperLogLog<uint64_t>> constructImplementation(int m, const Options& opts) {
+  return make_unique<HyperLogLog<uint64_t>>(m, false, opts.sparse);
 }
 
 template<>
-unique_ptr<HyperLogLogZstd<uint64_t>> constructImplementation(int m, int) {
-  return make_unique<HyperLogLogZstd<uint64_t>>(m);
+unique_ptr<HyperLogLog8<uint64_t>> constructImplementation(int m, const Options&) {
+  return make_unique<HyperLogLog8<uint64_t>>(m);
 }
 
 template<>
-unique_ptr<HyperLogLogLog<uint64_t>> constructImplementation(int m, int flags) {
-  return make_unique<HyperLogLogLog<uint64_t>>(m, 3, flags);
+unique_ptr<HyperLogLogZstd<uint64_t>> constructImplementation(int m, const Options& opts) {
+  return make_unique<HyperLogLogZstd<uint64_t>>(m, false, opts.level,
+                                                opts.maxDirty, opts.dictionary,
+                                                opts.blockSize);
 }
 
 template<>
-unique_ptr<Hasher> constructImplementation(int m, int) {
-  return make_unique<Hasher>(m);
+unique_ptr<HyperLogLogLog<uint64_t,3>> constructImplementation(int m, const Options& opts) {
+  return make_unique<HyperLogLogLog<uint64_t,3>>(m, 3, opts.flags, opts.sparse);
 }
 
-template<typename DataType, typename AlgorithmType>
-static void measureMerge(AlgorithmType& H1, AlgorithmType& H2,
-                         const vector<DataType>& data) {
-  size_t n1 = data.size() / 2;
-  adds(H1, data.begin(), data.begin() + n1);
-  adds(H2, data.begin() + n1, data.end());
-  auto start = steady_clock::now();
-  auto H = H1.merge(H2);
-  auto end = steady_clock::now();
-  auto diff = end - start;
-  double seconds = duration_cast<nanoseconds>(diff).count()/1e9;
-  report(seconds, H);
+template<>
+unique_ptr<ConcurrentHyperLogLog<uint64_t,false>> constructImplementation(int m, const Options&) {
+  return make_unique<ConcurrentHyperLogLog<uint64_t,false>>(m);
+}
+
+template<>
+unique_ptr<ConcurrentHyperLogLog<uint64_t,true>> constructImplementation(int m, const Options&) {
+  return make_unique<ConcurrentHyperLogLog<uint64_t,true>>(m);
 }
 
+template<>
+unique_ptr<Hasher> constructImplementation(int m, const Options&) {
+  return make_unique<Hasher>(m);
+}
+
+/**
+ * Adds the first half of the data to one sketch and splits the second
+ * half between opts.merges other sketches, and measures the time it
+ * takes to merge the other sketches into the first one, one at a time.
+ */
 template<typename DataType, typename AlgorithmType>
-static void measureMerge(int m, int flags,
-                         const vector<DataType>& data) {
-  unique_ptr<AlgorithmType> impl1 = constructImplementation<AlgorithmType>(m,flags);
-  unique_ptr<AlgorithmType> impl2 = constructImplementation<AlgorithmType>(m,flags);
-  measureMerge(*impl1, *impl2, data);
+static void measureMerge(int m, const DataType* data, size_t n,
+                         const Options& opts) {
+  unique_ptr<AlgorithmType> H1 = constructImplementation<AlgorithmType>(m,opts);
+  vector<unique_ptr<AlgorithmType>> others;
+  size_t n1 = n / 2;
+  adds(*H1, data, data + n1, opts);
+  for (int i = 0; i < opts.merges; ++i) {
+    others.push_back(constructImplementation<AlgorithmType>(m,opts));
+    adds(*others.back(), data + n1 + (n - n1) * i / opts.merges,
+         data + n1 + (n - n1) * (i + 1) / opts.merges, opts);
+  }
+  if (opts.inPlace) {
+    auto start = steady_clock::now();
+    for (int i = 0; i < opts.merges; ++i)
+      H1->mergeInto(*others[i]);
+    seal(*H1);
+    auto end = steady_clock::now();
+    auto diff = end - start;
+    double seconds = duration_cast<nanoseconds>(diff).count()/1e9;
+    report(seconds, *H1);
+  }
+  else {
+    auto start = steady_clock::now();
+    auto H = H1->merge(*others[0]);
+    for (int i = 1; i < opts.merges; ++i)
+      H = H.merge(*others[i]);
+    seal(H);
+    auto end = steady_clock::now();
+    auto diff = end - start;
+    double seconds = duration_cast<nanoseconds>(diff).count()/1e9;
+    report(seconds, H);
+  }
 }
 
 
 
 template<typename DataType, typename AlgorithmType>
-static void measureQuery(AlgorithmType& H, const vector<DataType>& data) {
+static void measureQuery(AlgorithmType& H, const DataType* data, size_t n,
+                         const Options& opts) {
     auto start = steady_clock::now();
-    adds(H, data);
+    adds(H, data, data + n, opts);
+    seal(H);
     auto end = steady_clock::now();
     auto diff = end - start;
     double seconds = duration_cast<nanoseconds>(diff).count()/1e9;
@@ -225,57 +469,267 @@ static void measureQuery(AlgorithmType& H, const vector<DataType>& data) {
 }
 
 
+/**
+ * Ingests the data with a ParallelIngestor; the reported time includes
+ * the final merge of the shards
+ */
 template<typename DataType, typename AlgorithmType>
-static void measureQuery(int m, int flags, const vector<DataType>& data) {
-  unique_ptr<AlgorithmType> impl = constructImplementation<AlgorithmType>(m,flags);
-  measureQuery(*impl, data);
+static void measureParallelQuery(AlgorithmType& prototype,
+                                 const DataType* data, size_t n,
+                                 const Options& opts) {
+  ParallelIngestor<AlgorithmType> ingestor(prototype, opts.threads);
+  auto start = steady_clock::now();
+  ingestor.ingest(n, [&](AlgorithmType& shard, size_t i0, size_t i1) {
+    adds(shard, data + i0, data + i1, opts);
+  });
+  auto mid = steady_clock::now();
+  AlgorithmType H = ingestor.result();
+  seal(H);
+  auto end = steady_clock::now();
+  double seconds = duration_cast<nanoseconds>(end - start).count()/1e9;
+  report(seconds, H);
+  fprintf(stdout, "ingestTime %g\n", duration_cast<nanoseconds>(mid - start).count()/1e9);
+  fprintf(stdout, "mergeTime %g\n", duration_cast<nanoseconds>(end - mid).count()/1e9);
+  fprintf(stdout, "throughput %g\n", n / seconds);
+}
+
+
+/**
+ * Concurrent sketches are not sharded: all the threads update the
+ * same sketch
+ */
+template<typename DataType, bool Packed>
+static void measureParallelQuery(ConcurrentHyperLogLog<uint64_t,Packed>& H,
+                                 const DataType* data, size_t n,
+                                 const Options& opts) {
+  auto work = [&](int t) {
+    adds(H, data + n * t / opts.threads, data + n * (t + 1) / opts.threads,
+         opts);
+  };
+  auto start = steady_clock::now();
+  vector<std::thread> threads;
+  for (int t = 1; t < opts.threads; ++t)
+    threads.emplace_back(work, t);
+  work(0);
+  for (std::thread& thread : threads)
+    thread.join();
+  auto end = steady_clock::now();
+  double seconds = duration_cast<nanoseconds>(end - start).count()/1e9;
+  report(seconds, H);
+  fprintf(stdout, "throughput %g\n", n / seconds);
+}
+
+
+template<typename DataType, typename AlgorithmType>
+static void measureQuery(int m, const DataType* data, size_t n,
+                         const Options& opts) {
+  unique_ptr<AlgorithmType> impl = constructImplementation<AlgorithmType>(m,opts);
+  if (opts.threads > 0)
+    measureParallelQuery(*impl, data, n, opts);
+  else
+    measureQuery(*impl, data, n, opts);
 }
 
 template<typename DataType,typename AlgorithmType>
 static void measure(const string& mode,
                     int m,
-                    int flags,
-                    const vector<DataType>& data) {
+                    const DataType* data,
+                    size_t n,
+                    const Options& opts) {
   if (mode == "merge")
-    measureMerge<DataType,AlgorithmType>(m, flags, data);
+    measureMerge<DataType,AlgorithmType>(m, data, n, opts);
   else if (mode == "query")
-    measureQuery<DataType,AlgorithmType>(m, flags, data);
+    measureQuery<DataType,AlgorithmType>(m, data, n, opts);
 }
 
 template<typename DataType>
 static void measure(const string& mode,
                     const string& algo,
                     int m,
-                    int flags,
+                    const DataType* data,
                     size_t n,
-                    size_t len) {
-  vector<DataType> data = readData<DataType>(n, len);
+                    const Options& opts) {
   if (algo == "hyperloglog")
-    measure<DataType,HyperLogLog<uint64_t>>(mode, m, flags, data);
+    measure<DataType,HyperLogLog<uint64_t>>(mode, m, data, n, opts);
   else if (algo == "hyperloglog")
-    measure<DataType,HyperLogLog<uint64_t>>(mode, m, flags, data);
+    measure<DataType,HyperLogLog<uint64_t>>(mode, m, data, n, opts);
+  else if (algo == "hyperloglog8")
+    measure<DataType,HyperLogLog8<uint64_t>>(mode, m, data, n, opts);
   else if (algo == "hyperloglogzstd")
-    measure<DataType,HyperLogLogZstd<uint64_t>>(mode, m, flags, data);
+    measure<DataType,HyperLogLogZstd<uint64_t>>(mode, m, data, n, opts);
   else if (algo == "hyperlogloglog")
-    measure<DataType,HyperLogLogLog<uint64_t>>(mode, m, flags, data);  
+    measure<DataType,HyperLogLogLog<uint64_t,3>>(mode, m, data, n, opts);  
+  else if (algo == "concurrenthyperloglog")
+    measure<DataType,ConcurrentHyperLogLog<uint64_t,false>>(mode, m, data, n, opts);
+  else if (algo == "concurrenthyperloglog6")
+    measure<DataType,ConcurrentHyperLogLog<uint64_t,true>>(mode, m, data, n, opts);
   else if (algo == "hashonly")
-    measure<DataType,Hasher>(mode, m, flags, data);
+    measure<DataType,Hasher>(mode, m, data, n, opts);
 }
 
 
+template<typename DataType>
+static void measure(const string& mode,
+                    const string& algo,
+                    int m,
+                    size_t n,
+                    size_t len,
+                    const Options& opts) {
+  vector<DataType> data = readData<DataType>(n, len, opts.bigEndian);
+  measure(mode, algo, m, data.data(), data.size(), opts);
+}
+
+template<>
+void measure<string_view>(const string& mode,
+                          const string& algo,
+                          int m,
+                          size_t n,
+                          size_t len,
+                          const Options& opts) {
+  vector<char> buffer;
+  vector<string_view> data = readRecords(n, len, buffer);
+  measure(mode, algo, m, data.data(), data.size(), opts);
+}
+
+
+
+/**
+ * Measures with the records taken directly from the memory-mapped
+ * input file. Big-endian uint64 records are byte-swapped by the hash
+ * function as they are hashed and native-order uint64 and prehashed
+ * records are used in place; strings (str and strview alike) are
+ * added as views into the mapping.
+ */
+static void measureMapped(const string& mode,
+                          const string& algo,
+                          const string& dt,
+                          int m,
+                          size_t n,
+                          size_t len,
+                          const Options& opts) {
+  MappedFile file(opts.input);
+  size_t size = dt == "uint64" || dt == "prehashed" ? recordSize<uint64_t>(len) :
+    dt == "jr" ? recordSize<pair<int,int>>(len) :
+    recordSize<string_view>(len);
+  size_t available = (file.size() - std::min(file.size(), opts.offset)) / size;
+  if (available < n)
+    throw std::runtime_error("Truncated input: " + opts.input + " holds " +
+                             std::to_string(available) + " of " +
+                             std::to_string(n) + " records");
+  const char* records = file.data() + opts.offset;
+  bool native = opts.bigEndian == (InputHeader::native() == InputHeader::BIG);
+  if (dt == "uint64" && native) {
+    const uint64_t* data = reinterpret_cast<const uint64_t*>(records);
+    measure(mode, algo, m, data, n, opts);
+  }
+  else if (dt == "uint64") {
+    const NetworkUint64* data = reinterpret_cast<const NetworkUint64*>(records);
+    measure(mode, algo, m, data, n, opts);
+  }
+  else if (dt == "prehashed" && native) {
+    const Prehashed* data = reinterpret_cast<const Prehashed*>(records);
+    measure(mode, algo, m, data, n, opts);
+  }
+  else if (dt == "prehashed") {
+    vector<Prehashed> data;
+    decodeRecords(records, n, len, data, opts.bigEndian);
+    measure(mode, algo, m, data.data(), n, opts);
+  }
+  else if (dt == "jr") {
+    vector<pair<int,int>> data;
+    decodeRecords(records, n, len, data, opts.bigEndian);
+    measure(mode, algo, m, data.data(), n, opts);
+  }
+  else {
+    vector<string_view> data;
+    decodeRecords(records, n, len, data);
+    measure(mode, algo, m, data.data(), n, opts);
+  }
+}
+
+template<typename DataType, typename AlgorithmType>
+static void measureStream(int m, size_t n, size_t len, const Options& opts) {
+  unique_ptr<AlgorithmType> impl = constructImplementation<AlgorithmType>(m,opts);
+  vector<DataType> data;
+  size_t total = 0;
+  double computeSeconds = 0;
+  auto start = steady_clock::now();
+  StreamReader reader(recordSize<DataType>(len), opts.chunk, n);
+  const char* chunk;
+  for (size_t k; (k = reader.next(chunk)) > 0; total += k) {
+    auto computeStart = steady_clock::now();
+    decodeRecords(chunk, k, len, data, opts.bigEndian);
+    adds(*impl, data, opts);
+    auto computeEnd = steady_clock::now();
+    computeSeconds += duration_cast<nanoseconds>(computeEnd - computeStart).count()/1e9;
+  }
+  seal(*impl);
+  auto end = steady_clock::now();
+  double seconds = duration_cast<nanoseconds>(end - start).count()/1e9;
+  double ioSeconds = reader.ioSeconds();
+  report(seconds, *impl);
+  fprintf(stdout, "ioTime %g\n", ioSeconds);
+  fprintf(stdout, "computeTime %g\n", computeSeconds);
+  fprintf(stdout, "throughput %g\n", total / seconds);
+  fprintf(stdout, "ioThroughput %g\n", total / ioSeconds);
+  fprintf(stdout, "computeThroughput %g\n", total / computeSeconds);
+}
+
+template<typename DataType>
+static void measureStream(const string& algo, int m, size_t n, size_t len,
+                          const Options& opts) {
+  if (algo == "hyperloglog")
+    measureStream<DataType,HyperLogLog<uint64_t>>(m, n, len, opts);
+  else if (algo == "hyperloglog8")
+    measureStream<DataType,HyperLogLog8<uint64_t>>(m, n, len, opts);
+  else if (algo == "hyperloglogzstd")
+    measureStream<DataType,HyperLogLogZstd<uint64_t>>(m, n, len, opts);
+  else if (algo == "hyperlogloglog")
+    measureStream<DataType,HyperLogLogLog<uint64_t,3>>(m, n, len, opts);
+  else if (algo == "concurrenthyperloglog")
+    measureStream<DataType,ConcurrentHyperLogLog<uint64_t,false>>(m, n, len, opts);
+  else if (algo == "concurrenthyperloglog6")
+    measureStream<DataType,ConcurrentHyperLogLog<uint64_t,true>>(m, n, len, opts);
+  else if (algo == "hashonly")
+    measureStream<DataType,Hasher>(m, n, len, opts);
+}
+
+
+
 static void measure(const string& mode,
                     const string& algo,
                     const string& dt,
                     int m,
-                    int flags,
                     size_t n,
-                    size_t len) {
+                    size_t len,
+                    const Options& opts) {
+  if (!opts.input.empty()) {
+    measureMapped(mode, algo, dt, m, n, len, opts);
+    return;
+  }
+  if (opts.chunk > 0) {
+    if (dt == "uint64")
+      measureStream<uint64_t>(algo, m, n, len, opts);
+    if (dt == "str")
+      measureStream<string>(algo, m, n, len, opts);
+    if (dt == "strview")
+      measureStream<string_view>(algo, m, n, len, opts);
+    if (dt == "jr")
+      measureStream<pair<int,int>>(algo, m, n, len, opts);
+    if (dt == "prehashed")
+      measureStream<Prehashed>(algo, m, n, len, opts);
+    return;
+  }
   if (dt == "uint64")
-    measure<uint64_t>(mode, algo, m, flags, n, len);
+    measure<uint64_t>(mode, algo, m, n, len, opts);
   if (dt == "str") 
-    measure<string>(mode, algo, m, flags, n, len);
+    measure<string>(mode, algo, m, n, len, opts);
+  if (dt == "strview")
+    measure<string_view>(mode, algo, m, n, len, opts);
   if (dt == "jr")
-    measure<pair<int,int>>(mode, algo, m, flags, n, len);
+    measure<pair<int,int>>(mode, algo, m, n, len, opts);
+  if (dt == "prehashed")
+    measure<Prehashed>(mode, algo, m, n, len, opts);
 }
 
 
@@ -289,12 +743,15 @@ int main(int argc, char* argv[]) {
     ValuesConstraint<string> modeValuesConstraint(modeValues);
     UnlabeledValueArg<string> modeArg("mode", "measurement mode", true, "query",
                                       &modeValuesConstraint, cmd);
-    vector<string> algorithmValues { "hyperloglog", "hyperloglogzstd", "hyperlogloglog", "hashonly" };
+    vector<string> algorithmValues { "hyperloglog", "hyperloglog8", "hyperloglogzstd",
+        "hyperlogloglog",
+        "concurrenthyperloglog", "concurrenthyperloglog6", "hashonly" };
     ValuesConstraint<string> algorithmValuesConstraint(algorithmValues);
     UnlabeledValueArg<string> algorithmArg("algorithm", "algorithm to measure",
                                            true, "hyperloglog",
                                            &algorithmValuesConstraint, cmd);
-    vector<string> datatypeValues { "uint64", "str", "jr" };
+    vector<string> datatypeValues { "uint64", "str", "strview", "jr",
+        "prehashed" };
     ValuesConstraint<string> datatypeValuesConstraint(datatypeValues);
     UnlabeledValueArg<string> datatypeArg("datatype", "type of input data",
                                           true, "uint64",
@@ -312,6 +769,52 @@ int main(int argc, char* argv[]) {
     ValueArg<string> flagArg("", "flags", "flags for hyperlogloglog", false,
                              "default", &flagValuesConstraint, cmd);
     ValueArg<size_t> lenArg("", "len", "length of strings to read", false, 0, "int", cmd);
+    ValueArg<int> mergesArg("", "merges", "number of sketches (each built from "
+                            "its own share of the second half of the input) "
+                            "to merge in merge mode",
+                            false, 1, "int", cmd);
+    SwitchArg inPlaceSwitch("", "inplace", "merge in place (mergeInto) instead of "
+                            "constructing a new sketch in merge mode", cmd, false);
+    ValueArg<size_t> streamArg("", "stream", "stream the input in chunks of this "
+                               "many records with a reader thread instead of "
+                               "reading it all first (query mode only)",
+                               false, 0, "int", cmd);
+    vector<string> formatValues { "raw", "binary" };
+    ValuesConstraint<string> formatValuesConstraint(formatValues);
+    ValueArg<string> formatArg("", "format", "input format: raw big-endian "
+                               "records or a binary container with a header",
+                               false, "raw", &formatValuesConstraint, cmd);
+    ValueArg<string> inputArg("", "input", "read the values from this file "
+                              "(memory-mapped) instead of stdin",
+                              false, "", "file", cmd);
+    vector<string> hashValues { "farmhash", "xxh64" };
+    ValuesConstraint<string> hashValuesConstraint(hashValues);
+    ValueArg<string> hashArg("", "hash", "hash function for the elements "
+                             "(defaults to the one named by a binary header, "
+                             "or farmhash); with binary prehashed input, "
+                             "checked against the header", false,
+                             "farmhash", &hashValuesConstraint, cmd);
+    ValueArg<int> threadsArg("", "threads", "number of threads to ingest the "
+                             "values with, each into its own sketch, merging "
+                             "the sketches at the end (concurrent sketches are "
+                             "shared by the threads; query mode only)",
+                             false, 0, "int", cmd);
+    SwitchArg sparseSwitch("", "sparse", "start hyperloglog and hyperlogloglog "
+                           "in the sparse representation", cmd, false);
+    ValueArg<int> levelArg("", "level", "compression level of hyperloglogzstd",
+                           false, 1, "int", cmd);
+    ValueArg<size_t> flushArg("", "flush", "recompress hyperloglogzstd after "
+                              "this many register updates (0: only at the end)",
+                              false, 0, "int", cmd);
+    ValueArg<int> dictionaryArg("", "dictionary", "compress hyperloglogzstd "
+                                "with a dictionary built from this many "
+                                "sample sketches of m registers and n values",
+                                false, 0, "int", cmd);
+    ValueArg<int> blockArg("", "block", "number of registers per compressed "
+                           "block of hyperloglogzstd (0: a single block)",
+                           false, 0, "int", cmd);
+    ValueArg<size_t> batchArg("", "batch", "number of elements to add per batch "
+                              "(0: add one at a time)", false, 0, "int", cmd);
     cmd.parse(argc, argv);
     
     if (helpSwitch.getValue()) {
@@ -326,12 +829,68 @@ int main(int argc, char* argv[]) {
     string flagsString = flagArg.getValue();
     size_t n = nArg.getValue();
     size_t len = lenArg.getValue();
+    int merges = mergesArg.getValue();
+    bool inPlace = inPlaceSwitch.getValue();
+    size_t batch = batchArg.getValue();
+    string hash = hashArg.getValue();
+    size_t chunk = streamArg.getValue();
+    string input = inputArg.getValue();
+    string format = formatArg.getValue();
+    int threads = threadsArg.getValue();
+    bool sparse = sparseSwitch.getValue();
+    int level = levelArg.getValue();
+    size_t maxDirty = flushArg.getValue();
+    int dictionarySamples = dictionaryArg.getValue();
+    int blockSize = blockArg.getValue();
 
     if (mode == "merge" && algo == "hashonly") {
       cerr << "hashonly does not support merging!" << endl;
       return EXIT_FAILURE;
     }
 
+    if (mode != "merge" && (mergesArg.isSet() || inPlaceSwitch.isSet())) {
+      cerr << "merges and inplace are only supported in merge mode!" << endl;
+      return EXIT_FAILURE;
+    }
+
+    if (merges < 1) {
+      cerr << "merges must be positive!" << endl;
+      return EXIT_FAILURE;
+    }
+
+    if (batchArg.isSet() && dt == "jr") {
+      cerr << "batch is not supported for jr datatype!" << endl;
+      return EXIT_FAILURE;
+    }
+
+    if (streamArg.isSet() && (mode != "query" || chunk == 0)) {
+      cerr << "stream is only supported in query mode with a positive chunk size!"
+           << endl;
+      return EXIT_FAILURE;
+    }
+
+    if (threadsArg.isSet() && (mode != "query" || threads < 1)) {
+      cerr << "threads is only supported in query mode with a positive number "
+           << "of threads!" << endl;
+      return EXIT_FAILURE;
+    }
+
+    if (threadsArg.isSet() && (streamArg.isSet() || algo == "hashonly")) {
+      cerr << "threads is not supported with stream or hashonly!" << endl;
+      return EXIT_FAILURE;
+    }
+
+    if (inputArg.isSet() && streamArg.isSet()) {
+      cerr << "input and stream are mutually exclusive!" << endl;
+      return EXIT_FAILURE;
+    }
+
+    if (hashArg.isSet() &&
+        (dt == "jr" || (dt == "prehashed" && format != "binary"))) {
+      cerr << "hash is not supported for " << dt << " datatype!" << endl;
+      return EXIT_FAILURE;
+    }
+
     if (algo == "hashonly" && dt == "jr") {
       cerr << "hashonly does not support jr datatype!" << endl;
       return EXIT_FAILURE;
@@ -342,6 +901,13 @@ int main(int argc, char* argv[]) {
       return EXIT_FAILURE;
     }
 
+    if (dictionaryArg.isSet() &&
+        (algo != "hyperloglogzstd" || dictionarySamples < 1)) {
+      cerr << "dictionary is only supported for hyperloglogzstd with a positive "
+           << "number of samples!" << endl;
+      return EXIT_FAILURE;
+    }
+
     if (flagArg.isSet() && algo != "hyperlogloglog") {
       cerr << "flags are only supported for hyperlogloglog!" << endl;
       return EXIT_FAILURE;
@@ -360,22 +926,88 @@ int main(int argc, char* argv[]) {
       HyperLogLogLog<uint64_t>::HYPERLOGLOGLOG_COMPRESS_BOTTOM :
       -1;
 
-    if (dt == "str" && !lenArg.isSet()) {
+    bool isString = dt == "str" || dt == "strview";
+    if (isString && !lenArg.isSet() && format == "raw") {
       cerr << "len must be set if datatype is string" << endl;
       return EXIT_FAILURE;
     }
-    if (dt != "str" && lenArg.isSet()) {
+    if (!isString && lenArg.isSet()) {
       cerr << "len must not be set if datatype is not string" << endl;
       return EXIT_FAILURE;
     }
+    if (isString && lenArg.isSet() && len == 0) {
+      cerr << "len must be positive if datatype is string" << endl;
+      return EXIT_FAILURE;
+    }
+
+    bool bigEndian = true;
+    size_t offset = 0;
+    if (format == "binary") {
+      InputHeader header;
+      if (input.empty()) {
+        header = readInputHeader(cin);
+      }
+      else {
+        std::ifstream is(input, std::ios::binary);
+        if (!is)
+          throw std::runtime_error(input + ": cannot open");
+        header = readInputHeader(is);
+      }
+      if (header.datatype != parseDatatype(dt)) {
+        cerr << "the datatype of the input does not match!" << endl;
+        return EXIT_FAILURE;
+      }
+      if (isString && lenArg.isSet() && len != header.len) {
+        cerr << "len does not match the string length of the input!" << endl;
+        return EXIT_FAILURE;
+      }
+      // the header names the hash function the records were written
+      // for (prehashed records were hashed with it)
+      if (header.hash != InputHeader::HASH_NONE) {
+        if (hashArg.isSet() && parseHash(hash) != header.hash) {
+          cerr << "hash does not match the hash function of the input ("
+               << hashName(static_cast<InputHeader::Hash>(header.hash))
+               << ")!" << endl;
+          return EXIT_FAILURE;
+        }
+        hash = hashName(static_cast<InputHeader::Hash>(header.hash));
+      }
+      else if (hashArg.isSet() && dt == "prehashed") {
+        cerr << "the input does not name the hash function of its records!"
+             << endl;
+        return EXIT_FAILURE;
+      }
+      if (n > header.count) {
+        cerr << "the input has only " << header.count << " values!" << endl;
+        return EXIT_FAILURE;
+      }
+      len = header.len;
+      bigEndian = header.endianness == InputHeader::BIG;
+      offset = sizeof(InputHeader);
+    }
+    
+    std::shared_ptr<const ZstdDictionary> dictionary;
+    if (dictionarySamples > 0)
+      dictionary = buildDictionary(dictionarySamples, m, n, level);
     
-    measure(mode, algo, dt, m, flags, n, len);
+    Options opts { flags, merges, inPlace, batch, hash, chunk, input,
+                   bigEndian, offset, threads, sparse, level,
+                   maxDirty, dictionary, blockSize };
+    measure(mode, algo, dt, m, n, len, opts);
   }
   catch (TCLAP::ArgException &e) {
     cerr << "error: " << e.error() << " for arg " << e.argId()
          << endl;
     return EXIT_FAILURE;
   }
+  catch (std::runtime_error& e) {
+    cerr << "error: " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  catch (std::invalid_argument& e) {
+    cerr << "error: " << e.what() << endl;
+    return EXIT_FAILURE;
+  }
 
   return EXIT_SUCCESS;
 }
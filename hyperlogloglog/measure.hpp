@@ -2,24 +2,82 @@
 #define HYPERLOGLOGLOG_MEASURE
 
 #include "common.hpp"
+#include "InputFormat.hpp"
 #include <vector>
+#include <string>
+#include <string_view>
 #include <cstdint>
+#include <cstring>
 #include <chrono>
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace hyperlogloglog {
+  /**
+   * A 64-bit hash value read from prehashed input; it is added to the
+   * sketches as is, bypassing the hash function
+   */
+  struct Prehashed {
+    uint64_t value;
+  };
+  static_assert(sizeof(Prehashed) == sizeof(uint64_t));
+
+
+
+  /**
+   * Reads exactly size bytes from stdin into data. Throws
+   * std::runtime_error if the input ends first.
+   */
+  inline void readFully(char* data, size_t size) {
+    if (!std::cin.read(data, size))
+      throw std::runtime_error("Truncated input: expected " +
+                               std::to_string(size) + " bytes, read " +
+                               std::to_string(std::cin.gcount()));
+  }
+
+
+
+  /**
+   * Reads n values from stdin. Throws std::runtime_error if the input
+   * holds fewer than n values. The integers of the input are in
+   * big-endian order unless bigEndian is false.
+   */
   template<typename T>
-  std::vector<T> readData(size_t n, size_t len);
+  std::vector<T> readData(size_t n, size_t len, bool bigEndian = true);
 
 
 
   template<>
-  inline std::vector<uint64_t> readData(size_t n, size_t) {
+  inline std::vector<uint64_t> readData(size_t n, size_t, bool bigEndian) {
     auto start = std::chrono::steady_clock::now();
     std::vector<uint64_t> v(n);
-    std::cin.read(reinterpret_cast<char*>(&v[0]), n*sizeof(uint64_t));
+    readFully(reinterpret_cast<char*>(v.data()), n*sizeof(uint64_t));
+    for (auto it = v.begin(); it != v.end(); ++it)
+      *it = toNative(*it, bigEndian);
+    auto end = std::chrono::steady_clock::now();
+    auto diff = end - start;
+    double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(diff).count()/1e9;
+    std::cerr << "data reading took " << seconds << std::endl;
+    return v;
+  }
+
+
+
+  template<>
+  inline std::vector<Prehashed> readData(size_t n, size_t, bool bigEndian) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Prehashed> v(n);
+    readFully(reinterpret_cast<char*>(v.data()), n*sizeof(uint64_t));
     for (auto it = v.begin(); it != v.end(); ++it)
-      *it = ntohll(*it);
+      it->value = toNative(it->value, bigEndian);
     auto end = std::chrono::steady_clock::now();
     auto diff = end - start;
     double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(diff).count()/1e9;
@@ -30,10 +88,10 @@ namespace hyperlogloglog {
 
 
   template<>
-  inline std::vector<std::string> readData(size_t n, size_t len) {
+  inline std::vector<std::string> readData(size_t n, size_t len, bool) {
     auto start = std::chrono::steady_clock::now();
     std::vector<char> temp(n*len);
-    std::cin.read(&temp[0], n*len);
+    readFully(temp.data(), n*len);
     std::vector<std::string> v(n);
     for (size_t i = 0; i < n; ++i)
       v[i] = std::string(temp.begin() + i*len, temp.begin() + (i+1)*len);
@@ -46,16 +104,39 @@ namespace hyperlogloglog {
 
 
 
+  /**
+   * Reads n strings of length len into the buffer and returns views
+   * of the records in place, without allocating a string per record.
+   * Throws std::runtime_error if the input holds fewer than n strings.
+   */
+  inline std::vector<std::string_view> readRecords(size_t n, size_t len,
+                                                   std::vector<char>& buffer) {
+    auto start = std::chrono::steady_clock::now();
+    buffer.resize(n*len);
+    readFully(buffer.data(), n*len);
+    std::vector<std::string_view> v(n);
+    for (size_t i = 0; i < n; ++i)
+      v[i] = std::string_view(buffer.data() + i*len, len);
+    auto end = std::chrono::steady_clock::now();
+    auto diff = end - start;
+    double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(diff).count()/1e9;
+    std::cerr << "data reading took " << seconds << std::endl;
+    return v;
+  }
+
+
+
   template<>
-  inline std::vector<std::pair<int,int>> readData(size_t n, size_t) {
+  inline std::vector<std::pair<int,int>> readData(size_t n, size_t,
+                                                  bool bigEndian) {
     auto start = std::chrono::steady_clock::now();
     std::vector<uint32_t> temp(2*n);
     std::vector<std::pair<int,int>> v(n);
-    std::cin.read(reinterpret_cast<char*>(&temp[0]), 2*n*sizeof(uint32_t));
+    readFully(reinterpret_cast<char*>(temp.data()), 2*n*sizeof(uint32_t));
     int j, r;
     for (size_t i = 0; i < n; ++i) {
-      j = ntohl(temp[2*i]);
-      r = ntohl(temp[2*i+1]);
+      j = toNative(temp[2*i], bigEndian);
+      r = toNative(temp[2*i+1], bigEndian);
       v[i].first = j;
       v[i].second = r;
     }
@@ -65,6 +146,303 @@ namespace hyperlogloglog {
     std::cerr << "data reading took " << seconds << std::endl;
     return v;
   }
+
+
+
+  /**
+   * Reads n fixed-size records from stdin in chunks on a background
+   * thread. There are two chunk buffers: while the caller processes
+   * one, the reader thread fills the other, so I/O overlaps with the
+   * sketch updates and only two chunks are ever held in memory.
+   */
+  class StreamReader {
+  public:
+    /**
+     * recordSize : the number of bytes per record
+     * chunkSize : the number of records per chunk
+     * n : the total number of records to read
+     */
+    StreamReader(size_t recordSize, size_t chunkSize, size_t n) :
+      recordSize(recordSize), chunkSize(chunkSize), remaining(n),
+      reader(&StreamReader::run, this) {
+    }
+
+
+
+    ~StreamReader() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+      }
+      cv.notify_all();
+      reader.join();
+    }
+
+
+
+    /**
+     * Releases the previously returned chunk and waits for the next
+     * one. Returns the number of records in the chunk (0 at the end
+     * of the input) and sets data to point to them. Throws
+     * std::runtime_error once the input has ended before n records.
+     */
+    size_t next(const char*& data) {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (consuming) {
+        buffers[current].full = false;
+        current ^= 1;
+        cv.notify_all();
+      }
+      consuming = true;
+      cv.wait(lock, [this]() { return buffers[current].full; });
+      if (buffers[current].truncated)
+        throw std::runtime_error("Truncated input: " +
+                                 std::to_string(remaining) +
+                                 " records missing");
+      data = buffers[current].data.data();
+      return buffers[current].records;
+    }
+
+
+
+    /**
+     * Returns the time the reader thread has spent reading (seconds)
+     */
+    double ioSeconds() const {
+      std::lock_guard<std::mutex> lock(mutex);
+      return ioTime;
+    }
+
+  private:
+    struct Buffer {
+      std::vector<char> data;
+      size_t records = 0;
+      bool full = false;
+      bool truncated = false; // the input ended within the chunk
+    };
+
+
+
+    void run() {
+      for (int b = 0; ; b ^= 1) {
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          cv.wait(lock, [&]() { return stopped || !buffers[b].full; });
+          if (stopped)
+            return;
+        }
+        // the buffer is not touched by the consumer until it is full
+        Buffer& buffer = buffers[b];
+        auto start = std::chrono::steady_clock::now();
+        size_t k = std::min(chunkSize, remaining);
+        buffer.data.resize(k*recordSize);
+        std::cin.read(buffer.data.data(), k*recordSize);
+        bool truncated = k > 0 && !std::cin;
+        remaining -= std::cin.gcount() / recordSize;
+        auto end = std::chrono::steady_clock::now();
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          ioTime += std::chrono::duration<double>(end - start).count();
+          buffer.records = k;
+          buffer.truncated = truncated;
+          buffer.full = true;
+        }
+        cv.notify_all();
+        if (k == 0 || truncated)
+          return;
+      }
+    }
+
+
+
+    size_t recordSize;
+    size_t chunkSize;
+    size_t remaining;
+    Buffer buffers[2];
+    int current = 0;
+    bool consuming = false;
+    bool stopped = false;
+    double ioTime = 0;
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::thread reader; // must be initialized last
+  };
+
+
+
+  /**
+   * Returns the number of bytes per record of the datatype in the
+   * input stream
+   */
+  template<typename T>
+  size_t recordSize(size_t len);
+
+  template<>
+  inline size_t recordSize<uint64_t>(size_t) {
+    return sizeof(uint64_t);
+  }
+
+  template<>
+  inline size_t recordSize<Prehashed>(size_t) {
+    return sizeof(uint64_t);
+  }
+
+  template<>
+  inline size_t recordSize<std::string>(size_t len) {
+    return len;
+  }
+
+  template<>
+  inline size_t recordSize<std::string_view>(size_t len) {
+    return len;
+  }
+
+  template<>
+  inline size_t recordSize<std::pair<int,int>>(size_t) {
+    return 2*sizeof(uint32_t);
+  }
+
+
+
+  /**
+   * Decodes the k records of a chunk read by StreamReader into out,
+   * reusing its storage. string_views point into the chunk. The
+   * integers are in big-endian order unless bigEndian is false.
+   */
+  template<typename T>
+  void decodeRecords(const char* data, size_t k, size_t len,
+                     std::vector<T>& out, bool bigEndian = true);
+
+  template<>
+  inline void decodeRecords(const char* data, size_t k, size_t,
+                            std::vector<uint64_t>& out, bool bigEndian) {
+    out.resize(k);
+    memcpy(out.data(), data, k*sizeof(uint64_t));
+    for (uint64_t& x : out)
+      x = toNative(x, bigEndian);
+  }
+
+  template<>
+  inline void decodeRecords(const char* data, size_t k, size_t,
+                            std::vector<Prehashed>& out, bool bigEndian) {
+    out.resize(k);
+    memcpy(out.data(), data, k*sizeof(uint64_t));
+    for (Prehashed& x : out)
+      x.value = toNative(x.value, bigEndian);
+  }
+
+  template<>
+  inline void decodeRecords(const char* data, size_t k, size_t len,
+                            std::vector<std::string>& out, bool) {
+    out.resize(k);
+    for (size_t i = 0; i < k; ++i)
+      out[i].assign(data + i*len, len);
+  }
+
+  template<>
+  inline void decodeRecords(const char* data, size_t k, size_t len,
+                            std::vector<std::string_view>& out, bool) {
+    out.resize(k);
+    for (size_t i = 0; i < k; ++i)
+      out[i] = std::string_view(data + i*len, len);
+  }
+
+  template<>
+  inline void decodeRecords(const char* data, size_t k, size_t,
+                            std::vector<std::pair<int,int>>& out,
+                            bool bigEndian) {
+    out.resize(k);
+    for (size_t i = 0; i < k; ++i) {
+      uint32_t jr[2];
+      memcpy(jr, data + i*sizeof(jr), sizeof(jr));
+      out[i].first = toNative(jr[0], bigEndian);
+      out[i].second = toNative(jr[1], bigEndian);
+    }
+  }
+
+
+  /**
+   * A read-only memory mapping of an input file. The kernel is told
+   * that the mapping will be read sequentially, so it reads ahead
+   * aggressively and the records can be hashed straight from the
+   * page cache without being copied.
+   */
+  class MappedFile {
+  public:
+    explicit MappedFile(const std::string& path) {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+        throw std::runtime_error(path + ": " + strerror(errno));
+      struct stat st;
+      if (fstat(fd, &st) < 0) {
+        int e = errno;
+        close(fd);
+        throw std::runtime_error(path + ": " + strerror(e));
+      }
+      length = st.st_size;
+      if (length > 0) {
+        void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+          int e = errno;
+          close(fd);
+          throw std::runtime_error(path + ": " + strerror(e));
+        }
+        madvise(p, length, MADV_SEQUENTIAL);
+        addr = static_cast<const char*>(p);
+      }
+      close(fd);
+    }
+
+
+
+    ~MappedFile() {
+      if (addr)
+        munmap(const_cast<char*>(addr), length);
+    }
+
+
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+
+
+    /**
+     * Returns a pointer to the first byte of the file (page-aligned)
+     */
+    inline const char* data() const {
+      return addr;
+    }
+
+
+
+    /**
+     * Returns the size of the file in bytes
+     */
+    inline size_t size() const {
+      return length;
+    }
+
+  private:
+    const char* addr = nullptr;
+    size_t length = 0;
+  };
+
+
+
+  /**
+   * A uint64 in network byte order, as stored in the input files. A
+   * mapped file of uint64 records can be viewed as an array of these
+   * so that the byte swap is done by the hash function, fused with
+   * the hashing, instead of in a separate pass over the data.
+   */
+  struct NetworkUint64 {
+    uint64_t bits;
+
+    inline uint64_t value() const {
+      return ntohll(bits);
+    }
+  };
+  static_assert(sizeof(NetworkUint64) == sizeof(uint64_t));
 }
 #endif // HYPERLOGLOGLOG_MEASURE
-
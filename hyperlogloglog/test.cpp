@@ -6,6 +6,9 @@
 #include "PackedMap.hpp"
 #include "common.hpp"
 #include "PackedVector.hpp"
+#include "ParallelIngestor.hpp"
+#include "ConcurrentHyperLogLog.hpp"
+#include "HyperLogLog8.hpp"
 
 #define CATCH_CONFIG_MAIN
 #include <catch2/catch.hpp>
@@ -130,11 +133,16 @@ TEST_CASE( "test_packed_vector", "[packedvector]" ) {
   for (uint64_t i = 0; i < 1024; ++i) {
     pv.append(i % 32);
     REQUIRE(pv.size() == i+1);
-    REQUIRE(pv.capacity() == (((i+1)*5+63)/64)*64/5);
+    REQUIRE(pv.capacity() >= i+1);
+    REQUIRE(pv.allocatedBits() < 2*(((i+1)*5+63)/64)*64);
+    REQUIRE(pv.bitSize() == (i+1)*5);
   }
   for (uint64_t i = 0; i < 1024; ++i) {
     REQUIRE(pv.get(i) == i%32);
   }
+  pv.shrink_to_fit();
+  REQUIRE(pv.capacity() == 1024);
+  REQUIRE(pv.allocatedBits() == 1024*5);
 
   hyperlogloglog::PackedVector pv2;
   REQUIRE(pv2.size() == 0);
@@ -273,6 +281,199 @@ TEST_CASE( "test_packed_vector2", "[packedvector]" ) {
 
 
 
+TEST_CASE( "test_packed_vector_capacity", "[packedvector]" ) {
+  hyperlogloglog::PackedVector pv(6);
+  REQUIRE(pv.getGrowthFactor() == 2.0);
+  REQUIRE_THROWS_AS(pv.setGrowthFactor(0.5), std::invalid_argument);
+
+  pv.reserve(100);
+  REQUIRE(pv.size() == 0);
+  REQUIRE(pv.bitSize() == 0);
+  REQUIRE(pv.capacity() == 106);
+  REQUIRE(pv.allocatedBits() == 640);
+  for (uint64_t i = 0; i < 106; ++i)
+    pv.append(i % 64);
+  REQUIRE(pv.allocatedBits() == 640);
+  pv.append(42);
+  REQUIRE(pv.allocatedBits() == 1280);
+  REQUIRE(pv.bitSize() == 107*6);
+  pv.reserve(10);
+  REQUIRE(pv.allocatedBits() == 1280);
+
+  pv.shrink_to_fit();
+  REQUIRE(pv.allocatedBits() == 704);
+  for (uint64_t i = 0; i < 106; ++i)
+    REQUIRE(pv.get(i) == i % 64);
+  REQUIRE(pv.get(106) == 42);
+
+  pv.setGrowthFactor(1.0);
+  pv.append(0);
+  REQUIRE(pv.allocatedBits() == 704);
+  for (int i = 0; i < 11; ++i)
+    pv.append(1);
+  REQUIRE(pv.allocatedBits() == 768);
+
+  for (int i = 0; i < 119; ++i)
+    pv.erase(0);
+  REQUIRE(pv.size() == 0);
+  pv.shrink_to_fit();
+  REQUIRE(pv.capacity() == 0);
+  REQUIRE(pv.allocatedBits() == 0);
+  pv.append(7);
+  REQUIRE(pv.get(0) == 7);
+  REQUIRE(pv.allocatedBits() == 64);
+}
+
+
+
+TEST_CASE( "test_packed_vector_shift", "[packedvector]" ) {
+  std::mt19937 rng(0x5eed);
+  for (size_t elemSize : { 1, 3, 6, 7, 13, 32, 37, 63 }) {
+    std::uniform_int_distribution<uint64_t> dist(0, (1ull << elemSize) - 1);
+    auto randint = [&](size_t maxval)->size_t {
+      return std::uniform_int_distribution<size_t>(0,maxval-1)(rng);
+    };
+    std::vector<uint64_t> correct;
+    hyperlogloglog::PackedVector pv(elemSize);
+    for (int i = 0; i < 500; ++i) {
+      size_t j = randint(correct.size() + 1);
+      uint64_t x = dist(rng);
+      correct.insert(correct.begin() + j, x);
+      pv.insert(j, x);
+    }
+    for (int i = 0; i < 300; ++i) {
+      size_t j = randint(correct.size());
+      correct.erase(correct.begin() + j);
+      pv.erase(j);
+    }
+    REQUIRE(pv.size() == correct.size());
+    for (size_t i = 0; i < correct.size(); ++i)
+      REQUIRE(pv.get(i) == correct[i]);
+  }
+}
+
+
+
+template<size_t ElemBits>
+static void testFixedPackedVector(std::mt19937& rng) {
+  std::uniform_int_distribution<uint64_t> dist(0, (1ull << ElemBits) - 1);
+  size_t n = 1000;
+  hyperlogloglog::PackedVector<uint64_t> pv1(ElemBits, n);
+  hyperlogloglog::PackedVector<uint64_t, ElemBits> pv2(ElemBits, n);
+  REQUIRE(pv2.bitSize() == pv1.bitSize());
+  for (int k = 0; k < 5000; ++k) {
+    size_t i = std::uniform_int_distribution<size_t>(0, n-1)(rng);
+    uint64_t x = dist(rng);
+    pv1.set(i, x);
+    pv2.set(i, x);
+  }
+  for (size_t i = 0; i < n; ++i)
+    REQUIRE(pv1.get(i) == pv2.get(i));
+  for (size_t i = 0; i < 100; ++i) {
+    uint64_t x = dist(rng);
+    pv1.insert(i*3, x);
+    pv2.insert(i*3, x);
+    pv1.append(x);
+    pv2.append(x);
+  }
+  REQUIRE(pv1.size() == pv2.size());
+  for (size_t i = 0; i < pv1.size(); ++i)
+    REQUIRE(pv1.get(i) == pv2.get(i));
+}
+
+
+
+TEST_CASE( "test_packed_vector_fixed", "[packedvector]" ) {
+  std::mt19937 rng(0xf1ed);
+  testFixedPackedVector<1>(rng);
+  testFixedPackedVector<2>(rng);
+  testFixedPackedVector<3>(rng);
+  testFixedPackedVector<4>(rng);
+  testFixedPackedVector<6>(rng);
+  testFixedPackedVector<7>(rng);
+  testFixedPackedVector<8>(rng);
+  testFixedPackedVector<13>(rng);
+  testFixedPackedVector<32>(rng);
+  testFixedPackedVector<63>(rng);
+
+  REQUIRE_THROWS_AS((hyperlogloglog::PackedVector<uint64_t,6>(5, 10)),
+                    std::invalid_argument);
+  REQUIRE_THROWS_AS((hyperlogloglog::HyperLogLogLog<uint64_t,3>(64, 2)),
+                    std::invalid_argument);
+
+  int m = 256;
+  hyperlogloglog::HyperLogLogLog<uint64_t> hlll1(m);
+  hyperlogloglog::HyperLogLogLog<uint64_t,3> hlll2(m);
+  hyperlogloglog::HyperLogLog<uint64_t,0> hll1(m);
+  hyperlogloglog::HyperLogLog<uint64_t> hll2(m);
+  std::uniform_int_distribution<uint64_t> dist;
+  for (int i = 0; i < 10000; ++i) {
+    uint64_t x = dist(rng);
+    hlll1.add(x);
+    hlll2.add(x);
+    hll1.add(x);
+    hll2.add(x);
+  }
+  REQUIRE(hlll1.bitSize() == hlll2.bitSize());
+  REQUIRE(hlll1.estimate() == hlll2.estimate());
+  REQUIRE(hll1.bitSize() == hll2.bitSize());
+  REQUIRE(hll1.estimate() == hll2.estimate());
+  REQUIRE(equals(hlll1.exportRegisters(), hlll2.exportRegisters()));
+  REQUIRE(equals(hll1.exportRegisters(), hll2.exportRegisters()));
+  REQUIRE(equals(hll1.exportRegisters(), hlll2.exportRegisters()));
+}
+
+
+
+TEST_CASE( "test_packed_vector_unpack", "[packedvector]" ) {
+  std::mt19937 rng(0xb10c);
+  auto randint = [&](size_t maxval)->size_t {
+    return std::uniform_int_distribution<size_t>(0,maxval-1)(rng);
+  };
+  for (size_t elemSize = 1; elemSize <= 8; ++elemSize) {
+    std::uniform_int_distribution<uint64_t> dist(0, (1ull << elemSize) - 1);
+    size_t n = 2000;
+    hyperlogloglog::PackedVector pv(elemSize, n);
+    std::vector<uint8_t> correct(n);
+    for (size_t i = 0; i < n; ++i) {
+      correct[i] = dist(rng);
+      pv.set(i, correct[i]);
+    }
+    for (int k = 0; k < 100; ++k) {
+      size_t first = randint(n);
+      size_t count = randint(n - first + 1);
+      std::vector<uint8_t> out(count + 1, 0xff);
+      pv.unpack(out.data(), first, count);
+      for (size_t i = 0; i < count; ++i)
+        REQUIRE(out[i] == correct[first + i]);
+      REQUIRE(out[count] == 0xff);
+
+      std::vector<uint8_t> in(count);
+      for (size_t i = 0; i < count; ++i) {
+        correct[first + i] = dist(rng);
+        // the bits above the element size must be ignored
+        in[i] = correct[first + i] | ~((1u << elemSize) - 1);
+      }
+      pv.pack(in.data(), first, count);
+      for (size_t i = 0; i < n; ++i)
+        REQUIRE(pv.get(i) == correct[i]);
+    }
+  }
+
+  hyperlogloglog::PackedVector<uint64_t,3> pv3(3, 1000);
+  std::vector<uint8_t> v(1000);
+  for (size_t i = 0; i < v.size(); ++i)
+    v[i] = i % 8;
+  pv3.pack(v.data(), 0, v.size());
+  for (size_t i = 0; i < v.size(); ++i)
+    REQUIRE(pv3.get(i) == i % 8);
+  std::vector<uint8_t> w(v.size());
+  pv3.unpack(w.data(), 0, w.size());
+  REQUIRE(equals(v, w));
+}
+
+
+
 TEST_CASE( "test_packed_vector3", "[packedvector]" ) {
   hyperlogloglog::PackedVector pv(8);
   REQUIRE(pv.size() == 0);
@@ -453,6 +654,45 @@ TEST_CASE( "test_farmhash", "[farmhash]" ) {
     REQUIRE(hyperlogloglog::farmhash(xs[i]) == hs[i]);
   }
 
+  uint64_t batch[sizeof(xs)/sizeof(xs[0])];
+  hyperlogloglog::farmhashBatch(xs, sizeof(xs)/sizeof(xs[0]), batch);
+  for (size_t i = 0; i < sizeof(xs)/sizeof(xs[0]); ++i) {
+    REQUIRE(batch[i] == hs[i]);
+  }
+
+  // the batch version and every kernel available on this machine
+  // must agree with the scalar version on all lengths and alignments
+  std::mt19937_64 rng(77123);
+  std::vector<uint64_t> keys(1000);
+  for (uint64_t& x : keys)
+    x = rng();
+  std::vector<uint64_t> expected(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i)
+    expected[i] = hyperlogloglog::farmhash(keys[i]);
+  for (size_t first = 0; first < 9; ++first) {
+    for (size_t n = 0; first + n <= keys.size(); n += 1 + n / 4) {
+      std::vector<uint64_t> out(n);
+      hyperlogloglog::farmhashBatch(keys.data() + first, n, out.data());
+      REQUIRE(std::equal(out.begin(), out.end(), expected.begin() + first));
+#ifdef HYPERLOGLOGLOG_HAVE_SIMD_FINGERPRINT
+      if (hyperlogloglog::fingerprint::haveAvx2()) {
+        size_t k = hyperlogloglog::fingerprint::avx2(keys.data() + first, n,
+                                                     out.data());
+        REQUIRE(k == n / 4 * 4);
+        REQUIRE(std::equal(out.begin(), out.begin() + k,
+                           expected.begin() + first));
+      }
+      if (hyperlogloglog::fingerprint::haveAvx512()) {
+        size_t k = hyperlogloglog::fingerprint::avx512(keys.data() + first, n,
+                                                       out.data());
+        REQUIRE(k == n / 8 * 8);
+        REQUIRE(std::equal(out.begin(), out.begin() + k,
+                           expected.begin() + first));
+      }
+#endif
+    }
+  }
+
   int bitCounts[64] = { 0 };
   int bitPairCounts[64][64] = { { } };
   for (uint64_t x = 0; x < 1000000; ++x) {
@@ -669,6 +909,97 @@ TEST_CASE( "test_hyperloglog_string", "[hyperloglog]" ) {
 
 
 
+TEST_CASE( "test_xxh64", "[xxh64]" ) {
+  REQUIRE(hyperlogloglog::xxh64(std::string("")) == 0xef46db3751d8e999);
+  REQUIRE(hyperlogloglog::xxh64(std::string("a")) == 0xd24ec4f1a98c6e5b);
+  REQUIRE(hyperlogloglog::xxh64(std::string("abc")) == 0x44bc2cf5ad770999);
+  REQUIRE(hyperlogloglog::xxh64(std::string_view("abc")) == 0x44bc2cf5ad770999);
+
+  std::mt19937 rng(6654);
+  std::uniform_int_distribution<uint64_t> dist;
+  hyperlogloglog::HyperLogLog hll1(1024);
+  hyperlogloglog::HyperLogLog hll2(1024);
+  int n = 100000;
+  for (int i = 0; i < n; ++i) {
+    uint64_t x = dist(rng);
+    REQUIRE(hyperlogloglog::xxh64(x) ==
+            hyperlogloglog::xxh64(std::string(reinterpret_cast<char*>(&x),
+                                              sizeof(x))));
+    hll1.add(x, hyperlogloglog::xxh64<uint64_t>);
+    std::string s = generateRandomString(rng);
+    hll2.add(s, hyperlogloglog::xxh64<std::string>);
+  }
+  REQUIRE(std::abs(hll1.estimate() - n) < 0.1*n);
+  REQUIRE(std::abs(hll2.estimate() - n) < 0.1*n);
+}
+
+
+
+TEST_CASE( "test_string_view", "[farmhash][hyperloglog][hyperlogloglog][hyperloglogzstd][hyperloglog8][concurrenthyperloglog]" ) {
+  std::mt19937 rng(90210);
+  int m = 256;
+  hyperlogloglog::HyperLogLog hll1(m), hll2(m), hll3(m);
+  hyperlogloglog::HyperLogLogLog hlll1(m), hlll2(m);
+  hyperlogloglog::HyperLogLogZstd hllz1(m), hllz2(m);
+  std::string buffer;
+  std::vector<size_t> offsets;
+  for (int i = 0; i < 2000; ++i) {
+    std::string x = generateRandomString(rng);
+    REQUIRE(hyperlogloglog::farmhash(std::string_view(x)) ==
+            hyperlogloglog::farmhash(x));
+    offsets.push_back(buffer.size());
+    buffer += x;
+    hll1.add(x);
+    hlll1.add(x);
+    hllz1.add(x);
+  }
+  offsets.push_back(buffer.size());
+  std::vector<std::string_view> views;
+  for (size_t i = 0; i + 1 < offsets.size(); ++i) {
+    const char* data = buffer.data() + offsets[i];
+    size_t len = offsets[i+1] - offsets[i];
+    hll2.add(data, len);
+    hlll2.add(data, len);
+    views.emplace_back(data, len);
+    hllz2.add(views.back());
+  }
+  hll3.addBatch(views.data(), views.size());
+
+  // a mutable pointer with an int length must reach the raw-bytes
+  // overload rather than the hasher template
+  char word[] = "hello";
+  char* p = word;
+  hyperlogloglog::HyperLogLog hll4(m), hll5(m);
+  hyperlogloglog::HyperLogLogLog hlll4(m), hlll5(m);
+  hyperlogloglog::HyperLogLogZstd hllz4(m), hllz5(m);
+  hyperlogloglog::HyperLogLog8 hll84(m), hll85(m);
+  hyperlogloglog::ConcurrentHyperLogLog hllc4(m), hllc5(m);
+  hll4.add(p, 5);
+  hlll4.add(p, 5);
+  hllz4.add(p, 5);
+  hll84.add(p, 5);
+  hllc4.add(p, 5);
+  hll5.add(std::string("hello"));
+  hlll5.add(std::string("hello"));
+  hllz5.add(std::string("hello"));
+  hll85.add(std::string("hello"));
+  hllc5.add(std::string("hello"));
+  REQUIRE(equals(hll4.exportRegisters(), hll5.exportRegisters()));
+  REQUIRE(equals(hlll4.exportRegisters(), hlll5.exportRegisters()));
+  REQUIRE(equals(hllz4.exportRegisters(), hllz5.exportRegisters()));
+  REQUIRE(equals(hll84.exportRegisters(), hll85.exportRegisters()));
+  REQUIRE(equals(hllc4.exportRegisters(), hllc5.exportRegisters()));
+
+  REQUIRE(equals(hll1.exportRegisters(), hll2.exportRegisters()));
+  REQUIRE(equals(hll1.exportRegisters(), hll3.exportRegisters()));
+  REQUIRE(equals(hll1.exportRegisters(), hlll2.exportRegisters()));
+  REQUIRE(equals(hll1.exportRegisters(), hllz2.exportRegisters()));
+  REQUIRE(hlll1.bitSize() == hlll2.bitSize());
+  REQUIRE(hllz1.bitSize() == hllz2.bitSize());
+}
+
+
+
 TEST_CASE( "test_hyperloglog_merge", "[hyperloglog]" ) {
   int m = 128;
   hyperlogloglog::HyperLogLog hll1(m);
@@ -782,6 +1113,148 @@ TEST_CASE( "test_hyperloglog_adds", "[hyperloglog]" ) {
 
 
 
+TEST_CASE( "test_hyperloglog_cached_estimate", "[hyperloglog]" ) {
+  int m = 256;
+  std::mt19937 rng(5512309);
+  std::uniform_int_distribution<uint64_t> dist;
+  int n = 20000;
+
+  hyperlogloglog::HyperLogLog hll(m);
+  hyperlogloglog::HyperLogLog hllc(m, true);
+  hyperlogloglog::HyperLogLogZstd hllz(m);
+  hyperlogloglog::HyperLogLogZstd hllzc(m, true);
+  hyperlogloglog::HyperLogLogLog hlll(m);
+  REQUIRE(hll.estimate() == hllc.estimate());
+  REQUIRE(hll.estimate() == hllzc.estimate());
+  REQUIRE(hll.estimate() == hlll.estimate());
+
+  for (int i = 0; i < n; ++i) {
+    uint64_t x = dist(rng);
+    hll.add(x);
+    hllc.add(x);
+    hllz.add(x);
+    hllzc.add(x);
+    hlll.add(x);
+    if (i % 97 == 0) {
+      REQUIRE(hll.estimate() == hllc.estimate());
+      REQUIRE(hll.estimate() == hllz.estimate());
+      REQUIRE(hll.estimate() == hllzc.estimate());
+      REQUIRE(hll.estimate() == hlll.estimate());
+    }
+  }
+  REQUIRE(hll.estimate() == hllc.estimate());
+  REQUIRE(hll.estimate() == hllzc.estimate());
+  REQUIRE(hll.estimate() == hlll.estimate());
+
+  hyperlogloglog::HyperLogLog hll2(m);
+  hyperlogloglog::HyperLogLog hllc2(m, true);
+  hyperlogloglog::HyperLogLogZstd hllzc2(m, true);
+  for (int i = 0; i < n; ++i) {
+    std::string x = generateRandomString(rng);
+    hll2.add(x);
+    hllc2.add(x);
+    hllzc2.add(x);
+  }
+  hyperlogloglog::HyperLogLog merged = hll.merge(hll2);
+  REQUIRE(merged.estimate() == hllc.merge(hllc2).estimate());
+  REQUIRE(merged.estimate() == hllzc.merge(hllzc2).estimate());
+  REQUIRE(merged.estimate() ==
+          hyperlogloglog::HyperLogLog(merged.exportRegisters(),
+                                      true).estimate());
+}
+
+
+
+TEST_CASE( "test_batch_adds", "[hyperloglog][hyperlogloglog][hyperloglogzstd]" ) {
+  int m = 1024;
+  std::mt19937 rng(31337);
+  std::uniform_int_distribution<uint64_t> dist;
+  std::vector<uint64_t> ints(20000);
+  for (uint64_t& x : ints)
+    x = dist(rng);
+  std::vector<std::string> strings(5000);
+  for (std::string& x : strings)
+    x = generateRandomString(rng);
+
+  hyperlogloglog::HyperLogLog hll(m);
+  hyperlogloglog::HyperLogLog hllb(m, true);
+  hyperlogloglog::HyperLogLogZstd hllz(m);
+  hyperlogloglog::HyperLogLogZstd hllzb(m);
+  hyperlogloglog::HyperLogLogLog hlll(m);
+  hyperlogloglog::HyperLogLogLog hlllb(m);
+  hyperlogloglog::HyperLogLogLog hlllbb(m, 3,
+    hyperlogloglog::HyperLogLogLog<>::HYPERLOGLOGLOG_COMPRESS_BOTTOM);
+  hyperlogloglog::HyperLogLogLog hllli(m, 3,
+    hyperlogloglog::HyperLogLogLog<>::HYPERLOGLOGLOG_COMPRESS_TYPE_INCREASE);
+  hyperlogloglog::HyperLogLogLog hlllib(m, 3,
+    hyperlogloglog::HyperLogLogLog<>::HYPERLOGLOGLOG_COMPRESS_TYPE_INCREASE);
+  hyperlogloglog::HyperLogLogLog hllli1(m, 3,
+    hyperlogloglog::HyperLogLogLog<>::HYPERLOGLOGLOG_COMPRESS_TYPE_INCREASE);
+  for (uint64_t x : ints) {
+    hll.add(x);
+    hllz.add(x);
+    hlll.add(x);
+    hllli.add(x);
+  }
+  // batches of varying sizes, including empty ones
+  for (size_t i0 = 0, k = 0; i0 < ints.size(); i0 += k, k = (3*k + 1) % 500) {
+    k = std::min(k, ints.size() - i0);
+    hllb.addBatch(ints.data() + i0, k);
+    hllzb.addBatch(ints.data() + i0, k);
+    hlllb.addBatch(ints.data() + i0, k);
+    hlllbb.addBatch(ints.data() + i0, k);
+    hlllib.addBatch(ints.data() + i0, k);
+  }
+  // the increase policy moves the base one step per compression, so a
+  // single large batch must not compress only once
+  hllli1.addBatch(ints.data(), ints.size());
+  REQUIRE(equals(hll.exportRegisters(), hllb.exportRegisters()));
+  REQUIRE(equals(hll.exportRegisters(), hllzb.exportRegisters()));
+  REQUIRE(equals(hll.exportRegisters(), hlllb.exportRegisters()));
+  REQUIRE(equals(hll.exportRegisters(), hlllbb.exportRegisters()));
+  REQUIRE(hll.estimate() == hllb.estimate());
+  REQUIRE(hll.estimate() == hllzb.estimate());
+  REQUIRE(hll.estimate() == hlllb.estimate());
+  REQUIRE(hllz.bitSize() == hllzb.bitSize());
+  REQUIRE(hlll.bitSize() == hlllb.bitSize());
+  REQUIRE(hlll.getB() == hlllb.getB());
+  REQUIRE(hlllb.getCompressCount() < hlll.getCompressCount());
+  REQUIRE(equals(hll.exportRegisters(), hlllib.exportRegisters()));
+  REQUIRE(hllli.bitSize() == hlllib.bitSize());
+  REQUIRE(hllli.getB() == hlllib.getB());
+  REQUIRE(equals(hll.exportRegisters(), hllli1.exportRegisters()));
+  REQUIRE(hllli.bitSize() == hllli1.bitSize());
+  REQUIRE(hllli.getB() == hllli1.getB());
+
+  std::vector<uint64_t> hashes;
+  for (const std::string& x : strings) {
+    hll.add(x);
+    hlll.add(x);
+    hllz.add(x);
+    hllli.add(x);
+    hashes.push_back(hyperlogloglog::farmhash(x));
+  }
+  hllb.addBatch(strings.data(), strings.size());
+  hllzb.addHashes(hashes.data(), hashes.size());
+  hlllb.addHashes(hashes.data(), hashes.size());
+  hlllbb.addBatch(strings.data(), strings.size());
+  hlllib.addHashes(hashes.data(), hashes.size());
+  REQUIRE(equals(hll.exportRegisters(), hllb.exportRegisters()));
+  REQUIRE(equals(hll.exportRegisters(), hllzb.exportRegisters()));
+  REQUIRE(equals(hll.exportRegisters(), hlllb.exportRegisters()));
+  REQUIRE(equals(hll.exportRegisters(), hlllbb.exportRegisters()));
+  REQUIRE(hll.estimate() == hllb.estimate());
+  REQUIRE(hll.estimate() == hlllb.estimate());
+  REQUIRE(equals(hll.exportRegisters(), hlllib.exportRegisters()));
+  REQUIRE(hllz.bitSize() == hllzb.bitSize());
+  REQUIRE(hlll.bitSize() == hlllb.bitSize());
+  REQUIRE(hlll.getB() == hlllb.getB());
+  REQUIRE(hllli.bitSize() == hlllib.bitSize());
+  REQUIRE(hllli.getB() == hlllib.getB());
+}
+
+
+
 TEST_CASE( "test_minimum_bits", "" ) {
   std::vector<uint8_t> M { 8, 4, 2, 1, 4, 2, 5, 3, 5, 4, 6, 2, 5, 4, 3, 4 };
   int minBits = 48;
@@ -976,6 +1449,7 @@ TEST_CASE( "test_hyperlogloglog", "[hyperlogloglog]" ) {
   hlll.addJr(10,5);
   REQUIRE(hlll.getCompressCount() == 18);
   REQUIRE(hlll.getRebaseCount() == 2);  
+  REQUIRE(hlll.getScanCount() == 2);
 }
 
 
@@ -1127,6 +1601,38 @@ TEST_CASE( "test_hyperlogloglog_string", "[hyperlogloglog]" ) {
 
 
 
+TEST_CASE( "test_zero_hash", "[hyperloglog][hyperlogloglog][hyperloglogzstd][hyperloglog8]" ) {
+  // rho of the hashes 0 and 1 is beyond the largest register value
+  // and saturates
+  int m = 64;
+  for (uint64_t x : { uint64_t(0), uint64_t(1) }) {
+    hyperlogloglog::HyperLogLog hll(m, true);
+    hyperlogloglog::HyperLogLogLog hlll(m, 3);
+    hyperlogloglog::HyperLogLogZstd hllz(m, true);
+    hyperlogloglog::HyperLogLog8 hll8(m);
+    hll.addHash(x);
+    hlll.addHash(x);
+    hllz.addHash(x);
+    hll8.addHash(x);
+    std::vector<uint8_t> registers(m, 0);
+    registers[hyperlogloglog::fibonacciHash(x, 6)] = 63;
+    REQUIRE(equals(hll.exportRegisters(), registers));
+    REQUIRE(equals(hlll.exportRegisters(), registers));
+    REQUIRE(equals(hllz.exportRegisters(), registers));
+    REQUIRE(equals(hll8.exportRegisters(), registers));
+    REQUIRE(hlll.estimate() == hll.estimate());
+    REQUIRE(hllz.estimate() == hll.estimate());
+    REQUIRE(hll8.estimate() == hll.estimate());
+  }
+
+  hyperlogloglog::HyperLogLogLog hlll(m, 3);
+  hlll.add(uint64_t(0));
+  hlll.addHash(~uint64_t(0));
+  REQUIRE(hlll.estimate() > 0);
+}
+
+
+
 TEST_CASE( "test_hyperlogloglog_merge", "[hyperlogloglog]" ) {
   int m = 1024;
   hyperlogloglog::HyperLogLogLog hlll1(m);
@@ -1185,6 +1691,456 @@ TEST_CASE( "test_hyperlogloglog_merge", "[hyperlogloglog]" ) {
 
 
 
+TEST_CASE( "test_merge_into", "[hyperloglog][hyperlogloglog][hyperloglogzstd]" ) {
+  int m = 512;
+  int K = 20;
+  std::mt19937 rng(9081726);
+  std::uniform_int_distribution<uint64_t> dist;
+  hyperlogloglog::HyperLogLog hll(m);
+  hyperlogloglog::HyperLogLog hllc(m, true);
+  hyperlogloglog::HyperLogLog hllAcc(m);
+  hyperlogloglog::HyperLogLogLog hlll(m);
+  hyperlogloglog::HyperLogLogLog hlllAcc(m);
+  hyperlogloglog::HyperLogLogZstd hllz(m);
+  hyperlogloglog::HyperLogLogZstd hllzAcc(m);
+  for (int k = 0; k < K; ++k) {
+    hyperlogloglog::HyperLogLog hll1(m);
+    hyperlogloglog::HyperLogLogLog hlll1(m);
+    hyperlogloglog::HyperLogLogZstd hllz1(m);
+    int n = 100 << (k % 8);
+    for (int i = 0; i < n; ++i) {
+      uint64_t x = dist(rng);
+      hll1.add(x);
+      hlll1.add(x);
+      hllz1.add(x);
+    }
+    hll = hll.merge(hll1);
+    hllc.mergeInto(hll1);
+    hllAcc |= hll1;
+    hlll = hlll.merge(hlll1);
+    hlllAcc |= hlll1;
+    hllz = hllz.merge(hllz1);
+    hllzAcc.mergeInto(hllz1);
+
+    REQUIRE(equals(hll.exportRegisters(), hllAcc.exportRegisters()));
+    REQUIRE(equals(hll.exportRegisters(), hllc.exportRegisters()));
+    REQUIRE(equals(hll.exportRegisters(), hlllAcc.exportRegisters()));
+    REQUIRE(equals(hll.exportRegisters(), hllzAcc.exportRegisters()));
+    REQUIRE(hll.estimate() == hllAcc.estimate());
+    REQUIRE(hll.estimate() == hllc.estimate());
+    REQUIRE(hll.estimate() == hllzAcc.estimate());
+    REQUIRE(hlll.estimate() == hlllAcc.estimate());
+    REQUIRE(hlll.bitSize() == hlllAcc.bitSize());
+    REQUIRE(hllz.bitSize() == hllzAcc.bitSize());
+  }
+  REQUIRE(hlllAcc.getScanCount() >= K);
+
+  hyperlogloglog::HyperLogLogLog hlll2(m);
+  hlll2.mergeInto(hlllAcc);
+  REQUIRE(equals(hlll2.exportRegisters(), hlllAcc.exportRegisters()));
+  hlll2 |= hlll2;
+  REQUIRE(equals(hlll2.exportRegisters(), hlllAcc.exportRegisters()));
+
+  REQUIRE_THROWS_AS(hllAcc.mergeInto(hyperlogloglog::HyperLogLog(2*m)),
+                    std::invalid_argument);
+  REQUIRE_THROWS_AS(hlllAcc.mergeInto(hyperlogloglog::HyperLogLogLog(2*m)),
+                    std::invalid_argument);
+  REQUIRE_THROWS_AS(hllzAcc.mergeInto(hyperlogloglog::HyperLogLogZstd(2*m)),
+                    std::invalid_argument);
+}
+
+
+
+TEST_CASE( "test_hyperlogloglog_union_all", "[hyperlogloglog]" ) {
+  int m = 2048;
+  int K = 50;
+  std::mt19937 rng(7162534);
+  std::uniform_int_distribution<uint64_t> dist;
+  for (int flags : { hyperlogloglog::HyperLogLogLog<>::HYPERLOGLOGLOG_COMPRESS_DEFAULT,
+        hyperlogloglog::HyperLogLogLog<>::HYPERLOGLOGLOG_COMPRESS_TYPE_INCREASE,
+        hyperlogloglog::HyperLogLogLog<>::HYPERLOGLOGLOG_COMPRESS_BOTTOM }) {
+    std::vector<hyperlogloglog::HyperLogLogLog<>> sketches;
+    hyperlogloglog::HyperLogLog hll(m);
+    hyperlogloglog::HyperLogLogLog merged(m, 3, flags);
+    for (int k = 0; k < K; ++k) {
+      sketches.emplace_back(m, 3, flags);
+      int n = 10 << (k % 12);
+      for (int i = 0; i < n; ++i) {
+        uint64_t x = dist(rng);
+        sketches.back().add(x);
+        hll.add(x);
+      }
+      merged.mergeInto(sketches.back());
+    }
+    for (int numThreads : { 1, 3, 8, 100 }) {
+      auto hlll = hyperlogloglog::HyperLogLogLog<>::unionAll(sketches.begin(),
+                                                             sketches.end(),
+                                                             numThreads);
+      REQUIRE(equals(hll.exportRegisters(), hlll.exportRegisters()));
+      REQUIRE(hll.estimate() == hlll.estimate());
+      REQUIRE(hlll.getScanCount() == 1);
+      if (flags == hyperlogloglog::HyperLogLogLog<>::HYPERLOGLOGLOG_COMPRESS_DEFAULT) {
+        REQUIRE(merged.bitSize() == hlll.bitSize());
+        REQUIRE(hyperlogloglog::minimumBits(hll.exportRegisters(), 3, 6) ==
+                static_cast<int>(hlll.bitSize()));
+      }
+      // the result must behave like any other sketch
+      hyperlogloglog::HyperLogLogLog extended = merged;
+      for (int i = 0; i < 1000; ++i) {
+        uint64_t x = dist(rng);
+        hlll.add(x);
+        extended.add(x);
+      }
+      REQUIRE(equals(extended.exportRegisters(), hlll.exportRegisters()));
+    }
+
+    // an executor that runs the tasks in reverse order on the caller
+    int calls = 0;
+    auto hlll = hyperlogloglog::HyperLogLogLog<>::unionAll(sketches.begin(),
+                                                           sketches.end(), 5,
+                                                           [&](int n, const auto& task) {
+      for (int t = n - 1; t >= 0; --t) {
+        task(t);
+        ++calls;
+      }
+    });
+    REQUIRE(calls == 5);
+    REQUIRE(equals(hll.exportRegisters(), hlll.exportRegisters()));
+  }
+
+  std::vector<hyperlogloglog::HyperLogLogLog<>> none;
+  REQUIRE_THROWS_AS(hyperlogloglog::HyperLogLogLog<>::unionAll(none.begin(),
+                                                               none.end()),
+                    std::invalid_argument);
+  std::vector<hyperlogloglog::HyperLogLogLog<>> mismatch { hyperlogloglog::HyperLogLogLog<>(m),
+      hyperlogloglog::HyperLogLogLog<>(2*m) };
+  REQUIRE_THROWS_AS(hyperlogloglog::HyperLogLogLog<>::unionAll(mismatch.begin(),
+                                                               mismatch.end()),
+                    std::invalid_argument);
+}
+
+
+
+TEST_CASE( "test_parallel_ingestor", "[hyperloglog][hyperlogloglog][hyperloglogzstd]" ) {
+  int m = 1024;
+  std::mt19937 rng(9182736);
+  std::uniform_int_distribution<uint64_t> dist;
+  std::vector<uint64_t> data(50000);
+  for (uint64_t& x : data)
+    x = dist(rng);
+  std::vector<uint64_t> hashes(data.size());
+  hyperlogloglog::farmhashBatch(data.data(), data.size(), hashes.data());
+
+  hyperlogloglog::HyperLogLog hll(m);
+  for (uint64_t x : data)
+    hll.add(x);
+
+  for (int numThreads : { 1, 2, 7 }) {
+    hyperlogloglog::ParallelIngestor<hyperlogloglog::HyperLogLog<>>
+      hllIngestor(hyperlogloglog::HyperLogLog<>(m), numThreads);
+    hyperlogloglog::ParallelIngestor<hyperlogloglog::HyperLogLogLog<>>
+      hlllIngestor(hyperlogloglog::HyperLogLogLog<>(m), numThreads);
+    hyperlogloglog::ParallelIngestor<hyperlogloglog::HyperLogLogZstd<>>
+      hllzIngestor(hyperlogloglog::HyperLogLogZstd<>(m), numThreads);
+    REQUIRE(hllIngestor.numShards() == numThreads);
+
+    // the result is available on demand between ingestions
+    size_t half = data.size() / 2;
+    hllIngestor.addBatch(data.data(), half);
+    hlllIngestor.addBatch(data.data(), half);
+    hllzIngestor.addHashes(hashes.data(), half);
+    hyperlogloglog::HyperLogLog partial(m);
+    for (size_t i = 0; i < half; ++i)
+      partial.add(data[i]);
+    REQUIRE(equals(partial.exportRegisters(),
+                   hlllIngestor.result().exportRegisters()));
+
+    hllIngestor.addHashes(hashes.data() + half, data.size() - half);
+    hlllIngestor.addHashes(hashes.data() + half, data.size() - half);
+    hllzIngestor.addBatch(data.data() + half, data.size() - half);
+
+    auto hllResult = hllIngestor.result();
+    auto hlllResult = hlllIngestor.result();
+    auto hllzResult = hllzIngestor.result();
+    REQUIRE(equals(hll.exportRegisters(), hllResult.exportRegisters()));
+    REQUIRE(equals(hll.exportRegisters(), hlllResult.exportRegisters()));
+    REQUIRE(equals(hll.exportRegisters(), hllzResult.exportRegisters()));
+    REQUIRE(hll.estimate() == hllResult.estimate());
+    REQUIRE(hll.estimate() == hlllResult.estimate());
+    REQUIRE(hll.estimate() == hllzResult.estimate());
+  }
+
+  REQUIRE_THROWS_AS(hyperlogloglog::ParallelIngestor<hyperlogloglog::HyperLogLog<>>
+                    (hyperlogloglog::HyperLogLog<>(m), 0), std::invalid_argument);
+
+  // an exception in a worker thread reaches the caller after all the
+  // threads have been joined, and the other slices are still ingested
+  hyperlogloglog::ParallelIngestor<hyperlogloglog::HyperLogLog<>>
+    failing(hyperlogloglog::HyperLogLog<>(m), 4);
+  REQUIRE_THROWS_AS(failing.ingest(data.size(), [&](hyperlogloglog::HyperLogLog<>& shard,
+                                                    size_t i0, size_t i1) {
+    if (i0 == 0)
+      throw std::runtime_error("failing slice");
+    shard.addBatch(data.data() + i0, i1 - i0);
+  }), std::runtime_error);
+  REQUIRE(failing.shard(0).estimate() == 0);
+  REQUIRE(failing.shard(3).estimate() > 0);
+}
+
+
+
+template<typename Concurrent>
+static void testConcurrentHyperLogLog() {
+  int m = 1024;
+  int numThreads = 8;
+  int perThread = 100000;
+  std::vector<std::vector<uint64_t>> data(numThreads);
+  hyperlogloglog::HyperLogLog hll(m);
+  std::mt19937 rng(5647382);
+  std::uniform_int_distribution<uint64_t> dist;
+  for (auto& v : data) {
+    for (int i = 0; i < perThread; ++i) {
+      // small values make the threads collide on the same registers
+      // (0 is avoided: its hash is zero, which HyperLogLog stores modulo
+      // the register width)
+      v.push_back(dist(rng) % 50000 + 1);
+      hll.add(v.back());
+    }
+  }
+
+  Concurrent chll(m);
+  std::atomic<bool> done(false);
+  bool finite = true;
+  std::thread reader([&]() {
+    while (!done)
+      finite &= std::isfinite(chll.estimate());
+  });
+  std::vector<std::thread> threads;
+  for (int t = 0; t < numThreads; ++t)
+    threads.emplace_back([&, t]() {
+      if (t % 2)
+        chll.addBatch(data[t].data(), data[t].size());
+      else
+        for (uint64_t x : data[t])
+          chll.add(x);
+    });
+  for (std::thread& thread : threads)
+    thread.join();
+  done = true;
+  reader.join();
+
+  REQUIRE(finite);
+  REQUIRE(equals(hll.exportRegisters(), chll.exportRegisters()));
+  REQUIRE(hll.estimate() == chll.estimate());
+
+  // conversions
+  REQUIRE(equals(hll.exportRegisters(), chll.toHyperLogLog().exportRegisters()));
+  auto hlll = chll.toHyperLogLogLog();
+  REQUIRE(equals(hll.exportRegisters(), hlll.exportRegisters()));
+  REQUIRE(equals(hll.exportRegisters(),
+                 Concurrent::fromHyperLogLog(hll).exportRegisters()));
+  REQUIRE(equals(hll.exportRegisters(),
+                 Concurrent::fromHyperLogLogLog(hlll).exportRegisters()));
+
+  // merging
+  Concurrent a(m);
+  Concurrent b(m);
+  for (int i = 0; i < perThread; ++i) {
+    a.add(data[0][i]);
+    b.add(data[1][i]);
+  }
+  hyperlogloglog::HyperLogLog ha(m);
+  hyperlogloglog::HyperLogLog hb(m);
+  for (int i = 0; i < perThread; ++i) {
+    ha.add(data[0][i]);
+    hb.add(data[1][i]);
+  }
+  REQUIRE(equals(ha.merge(hb).exportRegisters(), a.merge(b).exportRegisters()));
+  a |= b;
+  REQUIRE(equals(ha.merge(hb).exportRegisters(), a.exportRegisters()));
+  REQUIRE_THROWS_AS(a.mergeInto(Concurrent(2*m)), std::invalid_argument);
+}
+
+
+
+TEST_CASE( "test_concurrent_hyperloglog", "[concurrenthyperloglog]" ) {
+  testConcurrentHyperLogLog<hyperlogloglog::ConcurrentHyperLogLog<uint64_t, false>>();
+  testConcurrentHyperLogLog<hyperlogloglog::ConcurrentHyperLogLog<uint64_t, true>>();
+  REQUIRE(hyperlogloglog::ConcurrentHyperLogLog<uint64_t, false>(1000).bitSize() == 8000);
+  REQUIRE(hyperlogloglog::ConcurrentHyperLogLog<uint64_t, true>(1000).bitSize() == 6400);
+}
+
+
+
+TEST_CASE( "test_hyperloglog8", "[hyperloglog8]" ) {
+  std::mt19937 rng(4657382);
+  std::uniform_int_distribution<uint64_t> dist;
+  for (int m : { 16, 256, 4096, 65536 }) {
+    hyperlogloglog::HyperLogLog hll(m);
+    hyperlogloglog::HyperLogLog8 hll8(m);
+    hyperlogloglog::HyperLogLog8 cached(m, true);
+    hyperlogloglog::HyperLogLog8 batched(m);
+    std::vector<uint64_t> data;
+    for (int n = 1; n < 50*m; n = n*3/2 + 1) {
+      while (static_cast<int>(data.size()) < n) {
+        uint64_t x = dist(rng);
+        data.push_back(x);
+        hll.add(x);
+        hll8.add(x);
+        cached.add(x);
+      }
+      REQUIRE(equals(hll.exportRegisters(), hll8.exportRegisters()));
+      REQUIRE(hll.estimate() == hll8.estimate());
+      REQUIRE(hll.estimate() == cached.estimate());
+    }
+    batched.addBatch(data.data(), data.size());
+    REQUIRE(equals(hll.exportRegisters(), batched.exportRegisters()));
+    REQUIRE(hll8.bitSize() == static_cast<size_t>(8*m));
+
+    // merging
+    hyperlogloglog::HyperLogLog other(m);
+    hyperlogloglog::HyperLogLog8 other8(m);
+    for (int i = 0; i < 10*m; ++i) {
+      uint64_t x = dist(rng);
+      other.add(x);
+      other8.add(x);
+    }
+    REQUIRE(equals(hll.merge(other).exportRegisters(),
+                   hll8.merge(other8).exportRegisters()));
+    cached |= other8;
+    REQUIRE(equals(hll.merge(other).exportRegisters(), cached.exportRegisters()));
+    REQUIRE(hll.merge(other).estimate() == cached.estimate());
+    REQUIRE_THROWS_AS(hll8.mergeInto(hyperlogloglog::HyperLogLog8(2*m)),
+                      std::invalid_argument);
+
+    // conversions
+    REQUIRE(equals(hll.exportRegisters(), hll8.toHyperLogLog().exportRegisters()));
+    REQUIRE(equals(hll.exportRegisters(),
+                   hyperlogloglog::HyperLogLog8<>::fromHyperLogLog(hll).exportRegisters()));
+    auto hlll = hll8.toHyperLogLogLog();
+    REQUIRE(equals(hll.exportRegisters(), hlll.exportRegisters()));
+    REQUIRE(equals(hll.exportRegisters(),
+                   hyperlogloglog::HyperLogLog8<>::fromHyperLogLogLog(hlll).exportRegisters()));
+  }
+
+  // the vectorized histogram counts like the scalar one
+  std::uniform_int_distribution<int> rdist(0, 63);
+  for (int n : { 0, 1, 31, 32, 63, 64, 65, 1000, 4096 }) {
+    std::vector<uint8_t> values(n);
+    for (uint8_t& v : values)
+      v = rdist(rng);
+    hyperlogloglog::RegisterHistogram<> h1;
+    hyperlogloglog::RegisterHistogram<> h2;
+    h1.add(values.data(), n);
+    h2.addVectorized(values.data(), n);
+    for (int r = 0; r < 64; ++r)
+      REQUIRE(h1.count(r) == h2.count(r));
+  }
+}
+
+
+
+TEST_CASE( "test_sparse", "[hyperloglog][hyperlogloglog]" ) {
+  std::mt19937 rng(9182734);
+  std::uniform_int_distribution<uint64_t> dist;
+  for (int m : { 16, 256, 4096 }) {
+    hyperlogloglog::HyperLogLog hll(m);
+    hyperlogloglog::HyperLogLog sparse(m, false, true);
+    hyperlogloglog::HyperLogLog cached(m, true, true);
+    hyperlogloglog::HyperLogLog denseCached(m, true);
+    hyperlogloglog::HyperLogLogLog hlll(m);
+    hyperlogloglog::HyperLogLogLog sparseLog(m, 3,
+      hyperlogloglog::HyperLogLogLog<>::HYPERLOGLOGLOG_COMPRESS_DEFAULT, true);
+    REQUIRE(sparse.bitSize() == 0);
+    REQUIRE(sparseLog.bitSize() == 0);
+    // the histogram and the cached aggregates are part of the footprint
+    REQUIRE(sparse.allocatedBits() == 0);
+    REQUIRE(sparseLog.allocatedBits() == 0);
+    REQUIRE(hlll.allocatedBits() >= 3*m + CHAR_BIT *
+            sizeof(hyperlogloglog::RegisterHistogram<>));
+    REQUIRE(denseCached.allocatedBits() >= hll.allocatedBits() + CHAR_BIT *
+            sizeof(hyperlogloglog::HarmonicSum<>));
+    std::vector<uint64_t> data;
+    for (int n = 1; n < 20*m; n = n*3/2 + 1) {
+      while (static_cast<int>(data.size()) < n) {
+        uint64_t x = dist(rng);
+        data.push_back(x);
+        hll.add(x);
+        sparse.add(x);
+        cached.add(x);
+        denseCached.add(x);
+        hlll.add(x);
+        sparseLog.add(x);
+      }
+      REQUIRE(equals(hll.exportRegisters(), sparse.exportRegisters()));
+      REQUIRE(equals(hll.exportRegisters(), sparseLog.exportRegisters()));
+      REQUIRE(hll.estimate() == sparse.estimate());
+      REQUIRE(hll.estimate() == cached.estimate());
+      REQUIRE(hll.estimate() == sparseLog.estimate());
+      REQUIRE(sparse.bitSize() <= hll.bitSize());
+      if (n < m/16) {
+        REQUIRE(sparse.isSparse());
+        REQUIRE(sparseLog.isSparse());
+      }
+      // a tenth of the memory of the dense sketch
+      if (n < m/64) {
+        REQUIRE(10*sparse.allocatedBits() <= hll.allocatedBits());
+        // the aggregates outweigh the registers of a small sketch
+        if (m >= 4096)
+          REQUIRE(10*cached.allocatedBits() <= denseCached.allocatedBits());
+      }
+      if (n < m/128)
+        REQUIRE(10*sparseLog.allocatedBits() <= hlll.allocatedBits());
+    }
+    REQUIRE(!sparse.isSparse());
+    REQUIRE(!sparseLog.isSparse());
+    REQUIRE(sparse.bitSize() == hll.bitSize());
+    REQUIRE(sparseLog.bitSize() == hlll.bitSize());
+
+    // batches and merges in all combinations of representations
+    std::vector<uint64_t> small(data.begin(), data.begin() + m/32 + 1);
+    hyperlogloglog::HyperLogLog batched(m, false, true);
+    batched.addBatch(data.data(), data.size());
+    REQUIRE(equals(hll.exportRegisters(), batched.exportRegisters()));
+    hyperlogloglog::HyperLogLog few(m, false, true);
+    hyperlogloglog::HyperLogLogLog fewLog(m, 3,
+      hyperlogloglog::HyperLogLogLog<>::HYPERLOGLOGLOG_COMPRESS_DEFAULT, true);
+    few.addBatch(small.data(), small.size());
+    fewLog.addBatch(small.data(), small.size());
+    REQUIRE(few.isSparse());
+    REQUIRE(fewLog.isSparse());
+    hyperlogloglog::HyperLogLog fewDense(m);
+    fewDense.addBatch(small.data(), small.size());
+    REQUIRE(equals(few.merge(few).exportRegisters(), fewDense.exportRegisters()));
+    REQUIRE(few.merge(few).isSparse());
+    REQUIRE(fewLog.merge(fewLog).isSparse());
+    REQUIRE(equals(few.merge(hll).exportRegisters(), hll.exportRegisters()));
+    REQUIRE(equals(hll.merge(few).exportRegisters(), hll.exportRegisters()));
+    REQUIRE(equals(fewLog.merge(hlll).exportRegisters(), hll.exportRegisters()));
+    REQUIRE(equals(hlll.merge(fewLog).exportRegisters(), hll.exportRegisters()));
+    REQUIRE(equals(fewLog.merge(fewLog).exportRegisters(),
+                   fewDense.exportRegisters()));
+    hyperlogloglog::HyperLogLog acc(m, false, true);
+    hyperlogloglog::HyperLogLogLog accLog(m, 3,
+      hyperlogloglog::HyperLogLogLog<>::HYPERLOGLOGLOG_COMPRESS_DEFAULT, true);
+    for (size_t i0 = 0; i0 < data.size(); i0 += m/8) {
+      hyperlogloglog::HyperLogLog part(m, false, true);
+      hyperlogloglog::HyperLogLogLog partLog(m, 3,
+        hyperlogloglog::HyperLogLogLog<>::HYPERLOGLOGLOG_COMPRESS_DEFAULT, true);
+      size_t k = std::min<size_t>(m/8, data.size() - i0);
+      part.addBatch(data.data() + i0, k);
+      partLog.addBatch(data.data() + i0, k);
+      acc |= part;
+      accLog |= partLog;
+    }
+    REQUIRE(equals(hll.exportRegisters(), acc.exportRegisters()));
+    REQUIRE(equals(hll.exportRegisters(), accLog.exportRegisters()));
+    REQUIRE(hll.estimate() == accLog.estimate());
+  }
+}
+
+
+
 TEST_CASE( "test_hyperloglogzstd", "[hyperloglogzstd]" ) {
   int m = 128;
   hyperlogloglog::HyperLogLog hll(m);
@@ -1238,6 +2194,135 @@ TEST_CASE( "test_hyperloglogzstd", "[hyperloglogzstd]" ) {
   hllz = hllz1.merge(hllz2);
   REQUIRE(hll.estimate() == hllz.estimate());
   REQUIRE(equals(hll.exportRegisters(), hllz.exportRegisters()));
+
+  // the level changes the compressed size only; sketches of different
+  // levels share the contexts of the thread
+  m = 4096;
+  hll = hyperlogloglog::HyperLogLog(m);
+  hyperlogloglog::HyperLogLogZstd fast(m, false, -5);
+  hyperlogloglog::HyperLogLogZstd strong(m, false, 19);
+  for (int i = 0; i < 4*m; ++i) {
+    uint64_t x = dist(rng);
+    hll.add(x);
+    fast.add(x);
+    strong.add(x);
+  }
+  REQUIRE(equals(hll.exportRegisters(), fast.exportRegisters()));
+  REQUIRE(equals(hll.exportRegisters(), strong.exportRegisters()));
+  REQUIRE(strong.bitSize() < fast.bitSize());
+  REQUIRE(strong.merge(fast).getLevel() == 19);
+  REQUIRE(strong.merge(fast).bitSize() == strong.bitSize());
+  REQUIRE_THROWS_AS(hyperlogloglog::HyperLogLogZstd(m, false, 1000),
+                    std::invalid_argument);
+
+  // updates are written back on flush, seal, or every maxDirty
+  // updates; bitSize reports the flushed size without writing
+  hll = hyperlogloglog::HyperLogLog(m);
+  hyperlogloglog::HyperLogLogZstd eager(m, false, 1, 1);
+  hyperlogloglog::HyperLogLogZstd lazy(m);
+  hyperlogloglog::HyperLogLogZstd periodic(m, false, 1, 100);
+  for (int i = 0; i < 2*m; ++i) {
+    uint64_t x = dist(rng);
+    hll.add(x);
+    eager.add(x);
+    lazy.add(x);
+    periodic.add(x);
+    REQUIRE(eager.dirtyCount() == 0);
+    REQUIRE(periodic.dirtyCount() < 100);
+  }
+  REQUIRE(lazy.dirtyCount() > 0);
+  REQUIRE(equals(hll.exportRegisters(), lazy.exportRegisters()));
+  REQUIRE(lazy.isOpen());
+  REQUIRE(lazy.allocatedBits() >= static_cast<size_t>(8*m));
+  size_t dirtyCount = lazy.dirtyCount();
+  REQUIRE(lazy.bitSize() == eager.bitSize());
+  REQUIRE(lazy.dirtyCount() == dirtyCount);
+  periodic.flush();
+  REQUIRE(periodic.dirtyCount() == 0);
+  REQUIRE(periodic.isOpen());
+  lazy.seal();
+  periodic.seal();
+  REQUIRE(!lazy.isOpen());
+  REQUIRE(lazy.dirtyCount() == 0);
+  REQUIRE(lazy.bitSize() == eager.bitSize());
+  REQUIRE(periodic.bitSize() == eager.bitSize());
+  REQUIRE(lazy.allocatedBits() == lazy.bitSize());
+  REQUIRE(lazy.peakResidentBits() >= static_cast<size_t>(8*m));
+  // reading a sealed sketch does not open it
+  REQUIRE(hll.estimate() == lazy.estimate());
+  REQUIRE(equals(hll.exportRegisters(), lazy.exportRegisters()));
+  REQUIRE(equals(hll.exportRegisters(), lazy.merge(periodic).exportRegisters()));
+  REQUIRE(!lazy.isOpen());
+  lazy.mergeInto(eager);
+  REQUIRE(lazy.isOpen());
+  REQUIRE(lazy.bitSize() == eager.bitSize());
+
+  // a dictionary shared by reference; registers that occur in the
+  // dictionary compress to almost nothing
+  auto dictionary = hyperlogloglog::ZstdDictionary::fromSamples({ hll.exportRegisters() });
+  REQUIRE(dictionary->bitSize() == static_cast<size_t>(8*m));
+  REQUIRE_THROWS_AS(hyperlogloglog::HyperLogLogZstd(m, false, 3, 0, dictionary),
+                    std::invalid_argument);
+  hyperlogloglog::HyperLogLogZstd withDictionary(m, false, 1, 0, dictionary);
+  hyperlogloglog::HyperLogLogZstd withDictionary2(m, false, 1, 0, dictionary);
+  hyperlogloglog::HyperLogLogZstd withoutDictionary(m);
+  REQUIRE(dictionary.use_count() == 3);
+  hyperlogloglog::HyperLogLog half(m);
+  for (uint64_t j = 0; j < static_cast<uint64_t>(m); ++j) {
+    uint8_t r = hll.exportRegisters()[j];
+    withDictionary.addJr(j, r);
+    withoutDictionary.addJr(j, r);
+    if (j % 2 == 0) {
+      withDictionary2.addJr(j, r);
+      half.addJr(j, r);
+    }
+  }
+  withDictionary.seal();
+  withDictionary2.seal();
+  REQUIRE(equals(hll.exportRegisters(), withDictionary.exportRegisters()));
+  REQUIRE(equals(half.exportRegisters(), withDictionary2.exportRegisters()));
+  REQUIRE(hll.estimate() == withDictionary.estimate());
+  REQUIRE(8*withDictionary.bitSize() < withoutDictionary.bitSize());
+  auto merged = withDictionary2.merge(withoutDictionary);
+  REQUIRE(merged.getDictionary() == dictionary);
+  REQUIRE(equals(hll.exportRegisters(), merged.exportRegisters()));
+  REQUIRE(merged.bitSize() == withDictionary.bitSize());
+
+  // block-wise compression, including a partial last block and merges
+  // of sketches with different block sizes
+  hll = hyperlogloglog::HyperLogLog(m);
+  hyperlogloglog::HyperLogLogZstd single(m);
+  std::vector<hyperlogloglog::HyperLogLogZstd<>> blocked;
+  for (int blockSize : { 1, 256, 1000, 4096, 100000 })
+    blocked.emplace_back(m, false, 1, 1, nullptr, blockSize);
+  REQUIRE(blocked.back().getBlockSize() == m);
+  REQUIRE_THROWS_AS(hyperlogloglog::HyperLogLogZstd(m, false, 1, 0, nullptr, -1),
+                    std::invalid_argument);
+  for (int i = 0; i < 3*m; ++i) {
+    uint64_t x = dist(rng);
+    hll.add(x);
+    single.add(x);
+    for (auto& H : blocked)
+      H.add(x);
+  }
+  single.seal();
+  for (auto& H : blocked) {
+    REQUIRE(H.dirtyCount() == 0);
+    REQUIRE(equals(hll.exportRegisters(), H.exportRegisters()));
+    REQUIRE(hll.estimate() == H.estimate());
+    H.seal();
+    REQUIRE(equals(hll.exportRegisters(), H.exportRegisters()));
+    REQUIRE(hll.estimate() == H.estimate());
+    REQUIRE(H.bitSize() >= single.bitSize());
+    REQUIRE(equals(hll.exportRegisters(), H.merge(single).exportRegisters()));
+    REQUIRE(equals(hll.exportRegisters(), single.merge(H).exportRegisters()));
+  }
+  REQUIRE(blocked.back().bitSize() == single.bitSize());
+  hyperlogloglog::HyperLogLogZstd empty(m, false, 1, 0, nullptr, 1000);
+  empty.seal();
+  empty |= blocked[1];
+  REQUIRE(equals(hll.exportRegisters(), empty.exportRegisters()));
+  REQUIRE(empty.bitSize() == blocked[2].bitSize());
 }
 
 TEST_CASE( "test_hyperlogloglog_bottom_uint64", "[hyperlogloglog]" ) {
@@ -1486,3 +2571,115 @@ TEST_CASE( "test_hyperlogloglog_conversion", "[hyperlogloglog]" ) {
     REQUIRE(M[j] == Md[j]);
 }
 
+
+
+
+TEST_CASE( "test_hyperlogloglog_serialize", "[hyperlogloglog]" ) {
+  typedef hyperlogloglog::HyperLogLogLog<> HLLL;
+  std::mt19937 rng(5150);
+  std::uniform_int_distribution<uint64_t> dist;
+
+  // the byte strings of packed vectors do not depend on the word type
+  for (int elemSize : { 1, 3, 5, 13 }) {
+    hyperlogloglog::PackedVector<uint64_t> pv(elemSize);
+    hyperlogloglog::PackedVector<uint32_t> pv32(elemSize, 0);
+    for (int i = 0; i < 1000; ++i) {
+      uint64_t x = dist(rng);
+      pv.append(x);
+      pv32.append(x);
+    }
+    pv.erase(17); // leaves stale bits past the end
+    pv32.erase(17);
+    std::vector<uint8_t> bytes(pv.byteSize());
+    std::vector<uint8_t> bytes32(pv32.byteSize());
+    pv.toBytes(bytes.data());
+    pv32.toBytes(bytes32.data());
+    REQUIRE(equals(bytes, bytes32));
+    hyperlogloglog::PackedVector<uint64_t> copy(elemSize);
+    copy.fromBytes(bytes.data(), pv.size());
+    REQUIRE(copy.size() == pv.size());
+    REQUIRE(copy.allocatedBits() < pv.bitSize() + 64);
+    for (size_t i = 0; i < pv.size(); ++i)
+      REQUIRE(copy.get(i) == pv.get(i));
+  }
+
+  for (int m : { 16, 1024, 8192 }) {
+    for (int flags : { static_cast<int>(HLLL::HYPERLOGLOGLOG_COMPRESS_DEFAULT),
+                       HLLL::HYPERLOGLOGLOG_COMPRESS_TYPE_INCREASE |
+                       HLLL::HYPERLOGLOGLOG_COMPRESS_WHEN_APPEND,
+                       static_cast<int>(HLLL::HYPERLOGLOGLOG_COMPRESS_BOTTOM) }) {
+      for (bool sparse : { false, true }) {
+        HLLL H(m, 3, flags, sparse);
+        int added = 0;
+        for (int n : { 0, 1, m/8, m, 50*m }) {
+          for (; added < n; ++added)
+            H.add(dist(rng));
+          for (bool entropyCoded : { false, true }) {
+            std::vector<uint8_t> bytes = H.serialize(entropyCoded);
+            HLLL H2 = HLLL::deserialize(bytes);
+            REQUIRE(equals(H.exportRegisters(), H2.exportRegisters()));
+            REQUIRE(H.estimate() == H2.estimate());
+            REQUIRE(H.bitSize() == H2.bitSize());
+            REQUIRE(H.isSparse() == H2.isSparse());
+            REQUIRE(H.getB() == H2.getB());
+            REQUIRE(H.getLowerBound() <= H2.getLowerBound());
+            REQUIRE(equals(bytes, H2.serialize(entropyCoded)));
+            REQUIRE(bytes.size() <= H.serialize(false).size());
+            if (!entropyCoded)
+              REQUIRE(bytes.size() == 16 + H.getS().byteSize() +
+                      (H.isSparse() ? 0 : H.getM().byteSize()));
+
+            // the copy continues exactly like the original
+            HLLL H3 = H;
+            for (int i = 0; i < m; ++i) {
+              uint64_t x = dist(rng);
+              H2.add(x);
+              H3.add(x);
+            }
+            REQUIRE(equals(H2.exportRegisters(), H3.exportRegisters()));
+            REQUIRE(H2.bitSize() == H3.bitSize());
+            REQUIRE(H2.estimate() == H3.estimate());
+          }
+        }
+      }
+    }
+  }
+
+  // the offsets of a large sketch take less than their 3 bits each
+  // (about 2.7 bits, their empirical entropy)
+  HLLL big(1 << 16);
+  for (int i = 0; i < 1000000; ++i)
+    big.add(dist(rng));
+  std::vector<uint8_t> raw = big.serialize();
+  std::vector<uint8_t> coded = big.serialize(true);
+  REQUIRE(coded.size() < raw.size());
+  REQUIRE(equals(big.exportRegisters(),
+                 HLLL::deserialize(coded).exportRegisters()));
+
+  // a sketch of a single register value is run-length coded
+  HLLL empty(1024);
+  REQUIRE(empty.serialize(true).size() == 16 + 1);
+  REQUIRE(empty.serialize().size() == 16 + 1024*3/8);
+
+  // invalid input
+  REQUIRE_THROWS_AS(HLLL::deserialize(coded.data(), 10), std::invalid_argument);
+  REQUIRE_THROWS_AS(HLLL::deserialize(coded.data(), coded.size() - 1),
+                    std::invalid_argument);
+  std::vector<uint8_t> trailing = raw;
+  trailing.push_back(0);
+  REQUIRE_THROWS_AS(HLLL::deserialize(trailing), std::invalid_argument);
+  std::vector<uint8_t> magic = raw;
+  magic[0] = 'X';
+  REQUIRE_THROWS_AS(HLLL::deserialize(magic), std::invalid_argument);
+  std::vector<uint8_t> single = HLLL(1).serialize();
+  REQUIRE(single[6] == 0);
+  REQUIRE_THROWS_AS(HLLL::deserialize(single), std::invalid_argument);
+  REQUIRE_THROWS_AS(hyperlogloglog::HyperLogLogLog<uint32_t>::deserialize(raw),
+                    std::invalid_argument);
+  HLLL two(1024, 2);
+  two.add(static_cast<uint64_t>(1));
+  REQUIRE_THROWS_AS((hyperlogloglog::HyperLogLogLog<uint64_t,3>::
+                     deserialize(two.serialize())), std::invalid_argument);
+  REQUIRE(equals(two.exportRegisters(),
+                 HLLL::deserialize(two.serialize(true)).exportRegisters()));
+}
@@ -1,4 +1,6 @@
 #include "../hyperlogloglog/common.hpp"
+#include "../hyperlogloglog/InputFormat.hpp"
+#include "../hyperlogloglog/Hash.hpp"
 #include <tclap/CmdLine.h>
 #include <random>
 #include <cstdint>
@@ -21,21 +23,28 @@ using std::uniform_real_distribution;
 using std::chrono::duration_cast;
 using std::chrono::nanoseconds;
 using std::chrono::steady_clock;
-
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-#ifndef htonll // MacOS X defines this as a macro
-using hyperlogloglog::htonll;
-#endif // htonll
-#endif // byte order
-
-static void generateUint64(mt19937& rng, uint64_t n) {
+using hyperlogloglog::InputHeader;
+using hyperlogloglog::toNative;
+
+/**
+ * Generates n random uint64 values in the given byte order. If hash
+ * is set, the values are replaced by their hashes (prehashed input);
+ * the keys are the same as without it, so both inputs give the same
+ * estimates.
+ */
+static void generateUint64(mt19937& rng, uint64_t n, bool bigEndian,
+                           InputHeader::Hash hash = InputHeader::HASH_NONE) {
   auto start = steady_clock::now();
   uniform_int_distribution<uint64_t> dist(0,~static_cast<uint64_t>(0));
   vector<uint64_t> xs(n);
   uint64_t x;
   for (size_t i = 0; i < n; ++i) {
     x = dist(rng);
-    xs[i] = htonll(x);
+    if (hash == InputHeader::HASH_FARMHASH)
+      x = hyperlogloglog::farmhash<uint64_t>(x);
+    else if (hash == InputHeader::HASH_XXH64)
+      x = hyperlogloglog::xxh64<uint64_t>(x);
+    xs[i] = toNative(x, bigEndian);
   }
   auto end = steady_clock::now();
   auto diff = end - start;
@@ -73,7 +82,7 @@ static void generateStr(mt19937& rng, uint64_t n, int len) {
 
 
 
-static void generateJr(mt19937& rng, uint64_t n, int m) {
+static void generateJr(mt19937& rng, uint64_t n, int m, bool bigEndian) {
   auto start = steady_clock::now();
   uniform_int_distribution<uint32_t> jdist(0,m-1);
   uniform_real_distribution<double> cdist;
@@ -82,8 +91,8 @@ static void generateJr(mt19937& rng, uint64_t n, int m) {
   for (uint64_t i = 0; i < n; ++i) {
     j = jdist(rng);
     r = static_cast<uint32_t>(ceil(-log2(1-cdist(rng))));
-    temp[2*i] = htonl(j);
-    temp[2*i+1] = htonl(r);
+    temp[2*i] = toNative(j, bigEndian);
+    temp[2*i+1] = toNative(r, bigEndian);
   }
   auto end = steady_clock::now();
   auto diff = end - start;
@@ -106,7 +115,7 @@ int main(int argc, char* argv[]) {
     SwitchArg helpSwitch("h", "help", "Print this message", cmd, false);
     UnlabeledValueArg<uint64_t> nArg("n", "number of elements to create", true, 0,
                                 "int", cmd);
-    vector<string> dtValues { "uint64", "str", "jr" };
+    vector<string> dtValues { "uint64", "str", "jr", "prehashed" };
     ValuesConstraint<string> dtValuesConstraint(dtValues);
     UnlabeledValueArg<string> dtArg("dt", "datatype", true, "uint64",
                                     &dtValuesConstraint, cmd);
@@ -117,6 +126,21 @@ int main(int argc, char* argv[]) {
     ValueArg<int> lenArg("", "len",
                          "length of strings to create (for str input)",
                          false, 0, "int", cmd);
+    vector<string> formatValues { "raw", "binary" };
+    ValuesConstraint<string> formatValuesConstraint(formatValues);
+    ValueArg<string> formatArg("", "format", "output format: raw big-endian "
+                               "records or a binary container with a header",
+                               false, "raw", &formatValuesConstraint, cmd);
+    vector<string> endianValues { "big", "little" };
+    ValuesConstraint<string> endianValuesConstraint(endianValues);
+    ValueArg<string> endianArg("", "endian", "byte order of the binary "
+                               "container (default: native)", false, "",
+                               &endianValuesConstraint, cmd);
+    vector<string> hashValues { "none", "farmhash", "xxh64" };
+    ValuesConstraint<string> hashValuesConstraint(hashValues);
+    ValueArg<string> hashArg("", "hash", "hash function applied to the "
+                             "values (for prehashed input)", false, "none",
+                             &hashValuesConstraint, cmd);
     cmd.parse(argc,argv);
 
     if (helpSwitch.getValue()) {
@@ -146,14 +170,41 @@ int main(int argc, char* argv[]) {
       return EXIT_FAILURE;
     }
 
+    if (hashArg.isSet() && dt != "prehashed") {
+      cerr << "--hash can be used only in conjunction with datatype prehashed" << endl;
+      return EXIT_FAILURE;
+    }
+
+    string format = formatArg.getValue();
+    if (endianArg.isSet() && format != "binary") {
+      cerr << "--endian can be used only in conjunction with --format binary" << endl;
+      return EXIT_FAILURE;
+    }
+
+    bool bigEndian = format == "raw" || endianArg.getValue() == "big" ||
+      (!endianArg.isSet() && InputHeader::native() == InputHeader::BIG);
+    InputHeader::Hash hash = hyperlogloglog::parseHash(hashArg.getValue());
+
+    if (format == "binary") {
+      InputHeader header { };
+      header.endianness = bigEndian ? InputHeader::BIG : InputHeader::LITTLE;
+      header.datatype = hyperlogloglog::parseDatatype(dt);
+      header.hash = hash;
+      header.len = dt == "str" ? lenArg.getValue() : 0;
+      header.count = nArg.getValue();
+      hyperlogloglog::writeInputHeader(cout, header);
+    }
+
     mt19937 rng(seedArg.getValue());
 
     if (dt == "uint64")
-      generateUint64(rng, nArg.getValue());
+      generateUint64(rng, nArg.getValue(), bigEndian);
+    else if (dt == "prehashed")
+      generateUint64(rng, nArg.getValue(), bigEndian, hash);
     else if (dt == "str")
       generateStr(rng, nArg.getValue(), lenArg.getValue());
     else if (dt == "jr")
-      generateJr(rng, nArg.getValue(), mArg.getValue());
+      generateJr(rng, nArg.getValue(), mArg.getValue(), bigEndian);
   }
   catch (TCLAP::ArgException &e) {
     cerr << "error: " << e.error() << " for arg " << e.argId()